@@ -3,15 +3,16 @@
 #include <errno.h>
 #include <math.h>
 
+#include "checkpoint.h"
+#include "demand.h"
 #include "dhcp.h"
 #include "logger.h"
+#include "pool.h"
 #include "statistics.h"
+#include "timer.h"
 #include "tools.h"
 
-// TODO define sane value
-#define UPDATE_CLAIM_MAX_BLOCKS 32
-
-int block_alloc(ddhcp_block* block) {
+ATTR_NONNULL(2) int block_alloc(ddhcp_block* block, ddhcp_config* config) {
   DEBUG("block_alloc(block)\n");
 
   if (!block) {
@@ -24,18 +25,19 @@ int block_alloc(ddhcp_block* block) {
     return 0;
   }
 
-  block->addresses = (struct dhcp_lease*) calloc(sizeof(struct dhcp_lease), block->subnet_len);
+  block->addresses = (struct dhcp_lease_block*) pool_alloc(&config->lease_blocks);
 
   if (!block->addresses) {
     WARNING("block_alloc(...): Failed to allocate memory for lease management on block %i\n", block->index);
     return 1;
   }
 
-  for (unsigned int index = 0; index < block->subnet_len; index++) {
-    block->addresses[index].state = FREE;
-    block->addresses[index].lease_end = 0;
+  for (unsigned int index = 0; index < config->block_size; index++) {
+    block->addresses->bitmap[FREE][index / 64] |= (uint64_t) 1 << (index % 64);
   }
 
+  block->addresses->num[FREE] = config->block_size;
+
   return 0;
 }
 
@@ -45,76 +47,315 @@ ATTR_NONNULL(2) int block_own(ddhcp_block* block, ddhcp_config* config) {
     return 1;
   }
 
-  if (block_alloc(block)) {
+  if (block_alloc(block, config)) {
     WARNING("block_own(...): Failed to initialize block %i for owning\n", block->index);
     return 1;
   }
 
-  block->state = DDHCP_OURS;
   block->first_claimed = time(NULL);
-  NODE_ID_CP(&block->node_id, &config->node_id);
+  block_set_state(block, DDHCP_OURS, config);
+  block_set_owner(block, DDHCP_PEER_SELF, config);
   return 0;
 }
 
-ATTR_NONNULL_ALL void block_free(ddhcp_block* block) {
+ATTR_NONNULL_ALL void block_free(ddhcp_block* block, ddhcp_config* config) {
   DEBUG("block_free(%i)\n", block->index);
 
   if (block->state != DDHCP_BLOCKED) {
-    NODE_ID_CLEAR(&block->node_id);
-    block->state = DDHCP_FREE;
+    block_set_state(block, DDHCP_FREE, config);
   }
 
   if (block->addresses) {
     DEBUG("block_free(%i): Freeing DHCP leases\n", block->index);
-    free(block->addresses);
+    dhcp_free_hwaddrs(block, config);
+    pool_release(&config->lease_blocks, block->addresses);
     block->addresses = NULL;
+    block_update_free_leases(block, config);
     // Reset needless timeout
     block->needless_since = 0;
   }
 }
 
-ATTR_NONNULL_ALL ddhcp_block* block_find_free(ddhcp_config* config) {
-  DEBUG("block_find_free(config)\n");
-  ddhcp_block* block = config->blocks;
+ATTR_NONNULL_ALL static void _block_free_set_add(ddhcp_config* config, uint32_t index, int32_t delta) {
+  for (uint32_t i = index / 64 + 1; i <= config->used_blocks_words; i += i & (~i + 1)) {
+    config->used_blocks_tree[i] = (uint32_t)((int32_t) config->used_blocks_tree[i] + delta);
+  }
+}
 
-  ddhcp_block_list free_blocks;
-  INIT_LIST_HEAD(&free_blocks);
-  uint32_t num_free_blocks = 0;
+ATTR_NONNULL_ALL static void _block_free_set_insert(ddhcp_config* config, uint32_t index) {
+  config->used_blocks[index / 64] &= ~((uint64_t) 1 << (index % 64));
+  _block_free_set_add(config, index, -1);
+}
 
-  for (uint32_t i = 0; i < config->number_of_blocks; i++) {
-    if (block->state == DDHCP_FREE) {
-      list_add_tail((&block->tmp_list), &free_blocks);
-      num_free_blocks++;
+ATTR_NONNULL_ALL static void _block_free_set_remove(ddhcp_config* config, uint32_t index) {
+  config->used_blocks[index / 64] |= (uint64_t) 1 << (index % 64);
+  _block_free_set_add(config, index, 1);
+}
+
+/**
+ * Index of the n-th free block, n has to be less than the number of free blocks.
+ */
+ATTR_NONNULL_ALL static uint32_t _block_free_set_select(ddhcp_config* config, uint32_t n) {
+  uint32_t word = 0;
+  uint32_t step = 1;
+
+  while (step * 2 <= config->used_blocks_words) {
+    step *= 2;
+  }
+
+  // Descend the fenwick tree to the word holding the n-th unset bit,
+  // the node at word + step covers the step words following word.
+  for (; step > 0; step /= 2) {
+    uint32_t next = word + step;
+
+    if (next > config->used_blocks_words) {
+      continue;
     }
 
-    block++;
+    uint32_t free_blocks = step * 64 - config->used_blocks_tree[next];
+
+    if (free_blocks <= n) {
+      word = next;
+      n -= free_blocks;
+    }
   }
 
-  DEBUG("block_find_free(...): found %i free blocks\n", num_free_blocks);
+  uint64_t bits = ~config->used_blocks[word];
+
+  for (; n > 0; n--) {
+    bits &= bits - 1;
+  }
 
-  ddhcp_block* random_free = NULL;
-  uint32_t r = ~0u;
+  return word * 64 + (uint32_t) __builtin_ctzll(bits);
+}
 
-  if (num_free_blocks > 0) {
-    r = (uint32_t)rand() % num_free_blocks;
-  } else {
-    DEBUG("block_find_free(...): no free block found\n");
+ATTR_NONNULL_ALL int block_free_set_init(ddhcp_config* config) {
+  uint32_t words = (config->number_of_blocks + 63) / 64;
+
+  config->used_blocks = (uint64_t*) calloc(sizeof(uint64_t), words);
+  config->used_blocks_tree = (uint32_t*) calloc(sizeof(uint32_t), words + 1);
+  config->used_blocks_words = words;
+
+  if (!config->used_blocks || !config->used_blocks_tree) {
+    block_free_set_free(config);
+    return 1;
+  }
+
+  // Mark the bits beyond the last block as used, so they are never selected.
+  uint32_t padding = words * 64 - config->number_of_blocks;
+
+  if (padding > 0) {
+    config->used_blocks[words - 1] = ~(uint64_t) 0 << (64 - padding);
+    _block_free_set_add(config, (words - 1) * 64, (int32_t) padding);
+  }
+
+  return 0;
+}
+
+ATTR_NONNULL_ALL void block_free_set_free(ddhcp_config* config) {
+  free(config->used_blocks);
+  free(config->used_blocks_tree);
+  config->used_blocks = NULL;
+  config->used_blocks_tree = NULL;
+  config->used_blocks_words = 0;
+}
+
+ATTR_NONNULL_ALL ddhcp_block* block_lookup(uint32_t index, ddhcp_config* config) {
+  ddhcp_block_page* page = config->block_pages[index / DDHCP_BLOCK_PAGE_SIZE];
+
+  if (!page) {
     return NULL;
   }
 
-  struct list_head* pos, *q;
+  return page->block + index % DDHCP_BLOCK_PAGE_SIZE;
+}
+
+ATTR_NONNULL_ALL ddhcp_block* block_get(uint32_t index, ddhcp_config* config) {
+  ddhcp_block* block = block_lookup(index, config);
+
+  if (block) {
+    return block;
+  }
+
+  ddhcp_block_page* page = (ddhcp_block_page*) pool_alloc(&config->block_page_pool);
+
+  if (!page) {
+    WARNING("block_get(...): Failed to allocate memory for block %i\n", index);
+    return NULL;
+  }
+
+  DEBUG("block_get(...): Allocated page of block %i\n", index);
+
+  uint32_t first = index - index % DDHCP_BLOCK_PAGE_SIZE;
 
-  list_for_each_safe(pos, q, &free_blocks) {
-    block = list_entry(pos, ddhcp_block, tmp_list);
-    list_del(pos);
+  for (uint32_t i = 0; i < DDHCP_BLOCK_PAGE_SIZE; i++) {
+    block = page->block + i;
+    block->index = first + i;
+    block->state = DDHCP_FREE;
+    block->owner = DDHCP_PEER_NONE;
+    block->checkpoint_slot = 0;
+    INIT_LIST_HEAD(&block->claim_list);
+    INIT_LIST_HEAD(&block->free_leases_list);
+    INIT_LIST_HEAD(&block->owner_list);
+  }
+
+  // Until one of its blocks is used, the page is idle.
+  list_add_tail(&page->idle_list, &config->idle_block_pages);
+  config->block_pages[index / DDHCP_BLOCK_PAGE_SIZE] = page;
+
+  return page->block + index % DDHCP_BLOCK_PAGE_SIZE;
+}
+
+ATTR_NONNULL_ALL void block_collect_pages(ddhcp_config* config) {
+  ddhcp_block_page* page;
+  ddhcp_block_page* tmp;
+
+  list_for_each_entry_safe(page, tmp, &config->idle_block_pages, idle_list) {
+    bool busy = false;
+
+    for (uint32_t i = 0; i < DDHCP_BLOCK_PAGE_SIZE && !busy; i++) {
+      ddhcp_block* block = page->block + i;
+      busy = block->timer_pending || block->reannounce || block->addresses || !list_empty(&block->claim_list);
+    }
 
-    if (r == 0) {
-      random_free = block;
+    // Try again on a later run, once the timers have passed.
+    if (busy) {
+      continue;
+    }
+
+    DEBUG("block_collect_pages(...): Release page of block %i\n", page->block[0].index);
+    list_del(&page->idle_list);
+    config->block_pages[page->block[0].index / DDHCP_BLOCK_PAGE_SIZE] = NULL;
+    pool_release(&config->block_page_pool, page);
+  }
+}
+
+ATTR_NONNULL_ALL void block_set_state(ddhcp_block* block, enum ddhcp_block_state state, ddhcp_config* config) {
+  if (block->state == state) {
+    return;
+  }
+
+  ddhcp_block_page* page = config->block_pages[block->index / DDHCP_BLOCK_PAGE_SIZE];
+
+  if (block->state == DDHCP_FREE) {
+    _block_free_set_remove(config, block->index);
+
+    if (page->num_used++ == 0) {
+      list_del(&page->idle_list);
+    }
+  } else {
+    list_del(&block->state_list);
+  }
+
+  config->num_blocks_by_state[block->state]--;
+
+  block->state = state;
+
+  if (state == DDHCP_FREE) {
+    _block_free_set_insert(config, block->index);
+
+    if (--page->num_used == 0) {
+      list_add_tail(&page->idle_list, &config->idle_block_pages);
+    }
+  } else {
+    list_add_tail(&block->state_list, &config->blocks_by_state[state]);
+  }
+
+  config->num_blocks_by_state[state]++;
+
+  if (state == DDHCP_OURS) {
+    checkpoint_block(block, config);
+  } else {
+    checkpoint_drop(block, config);
+  }
+
+  if (state != DDHCP_CLAIMED && state != DDHCP_OURS) {
+    block_set_owner(block, DDHCP_PEER_NONE, config);
+  }
+
+  block_update_free_leases(block, config);
+}
+
+ATTR_NONNULL_ALL void block_set_owner(ddhcp_block* block, uint16_t owner, ddhcp_config* config) {
+  if (block->owner == owner) {
+    return;
+  }
+
+  if (block->owner != DDHCP_PEER_NONE) {
+    block_owner(block, config)->num_blocks--;
+    list_del_init(&block->owner_list);
+  }
+
+  block->owner = owner;
+
+  if (owner != DDHCP_PEER_NONE) {
+    ddhcp_peer* peer = block_owner(block, config);
+    peer->num_blocks++;
+    list_add_tail(&block->owner_list, &peer->blocks);
+  }
+}
+
+ATTR_NONNULL_ALL void block_update_free_leases(ddhcp_block* block, ddhcp_config* config) {
+  bool has_free = block->state == DDHCP_OURS && block->addresses && dhcp_has_free(block);
+  bool listed = !list_empty(&block->free_leases_list);
+
+  if (has_free == listed) {
+    return;
+  }
+
+  if (!has_free) {
+    list_del_init(&block->free_leases_list);
+    return;
+  }
+
+  // Keep the set ordered by first_claimed, usually the block is
+  // the youngest one and the walk stops immediately.
+  ddhcp_block* iter;
+
+  list_for_each_entry_reverse(iter, &config->blocks_with_free_leases, free_leases_list) {
+    if (iter->first_claimed <= block->first_claimed) {
       break;
     }
+  }
+
+  list_add(&block->free_leases_list, &iter->free_leases_list);
+}
+
+ATTR_NONNULL_ALL void block_set_timeout(ddhcp_block* block, time_t timeout, ddhcp_config* config) {
+  // A pending timer is due no later than the current timeout and gets
+  // rescheduled on expiry, so only an earlier timeout needs another timer.
+  bool reschedule = !block->timer_pending || timeout < block->timeout;
+  block->timeout = timeout;
+
+  if (block->state == DDHCP_OURS) {
+    checkpoint_block(block, config);
+  }
+
+  if (!reschedule) {
+    return;
+  }
 
-    r--;
+  if (timer_queue_add(&config->block_timers, timeout, block->index, 0) == 0) {
+    block->timer_pending = 1;
+  } else {
+    ERROR("block_set_timeout(...): Failed to schedule timeout of block %i\n", block->index);
   }
+}
+
+ATTR_NONNULL_ALL ddhcp_block* block_find_free(ddhcp_config* config) {
+  DEBUG("block_find_free(config)\n");
+
+  uint32_t num_free_blocks = block_num_in_state(config, DDHCP_FREE);
+
+  DEBUG("block_find_free(...): found %i free blocks\n", num_free_blocks);
+
+  if (num_free_blocks == 0) {
+    DEBUG("block_find_free(...): no free block found\n");
+    return NULL;
+  }
+
+  uint32_t r = (uint32_t)rand() % num_free_blocks;
+  ddhcp_block* random_free = block_get(_block_free_set_select(config, r), config);
 
 #if LOG_LEVEL_LIMIT >= LOG_WARNING
   if (random_free) {
@@ -147,11 +388,11 @@ ATTR_NONNULL_ALL int block_claim(int32_t num_blocks, ddhcp_config* config) {
         INFO("block_claim(...): block %i claimed after 3 claims.\n", block->index);
       }
 
-      list_del(pos);
+      list_del_init(pos);
       config->claiming_blocks_amount--;
     } else if (block->state != DDHCP_CLAIMING) {
       DEBUG("block_claim(...): block %i is no longer marked for claiming\n", block->index);
-      list_del(pos);
+      list_del_init(pos);
       config->claiming_blocks_amount--;
     }
   }
@@ -165,9 +406,9 @@ ATTR_NONNULL_ALL int block_claim(int32_t num_blocks, ddhcp_config* config) {
       ddhcp_block* block = block_find_free(config);
 
       if (block) {
-        block->state = DDHCP_CLAIMING;
+        block_set_state(block, DDHCP_CLAIMING, config);
         block->claiming_counts = 0;
-        block->timeout = now + config->tentative_timeout;
+        block_set_timeout(block, now + config->tentative_timeout, config);
         list_add_tail(&(block->claim_list), &config->claiming_blocks);
         config->claiming_blocks_amount++;
       } else {
@@ -190,83 +431,59 @@ ATTR_NONNULL_ALL int block_claim(int32_t num_blocks, ddhcp_config* config) {
   }
 
   // Send claim message for all blocks in claiming process.
-  struct ddhcp_mcast_packet* packet = new_ddhcp_packet(DDHCP_MSG_INQUIRE, config);
-
-  if (!packet) {
-    WARNING("block_claim(...): Failed to allocate ddhcpd mcast packet.\n");
-    return -ENOMEM;
-  }
+  ddhcp_epoll_data* socket = DDHCP_SKT_MCAST(config);
+  uint8_t max_inquiries = packet_max_payload(DDHCP_MSG_INQUIRE, socket);
+  ddhcp_block* block;
+  ddhcp_block* first = list_first_entry(&config->claiming_blocks, ddhcp_block, claim_list);
 
-  packet->count = config->claiming_blocks_amount;
+  packet_tx_begin(socket, DDHCP_MSG_INQUIRE, config);
 
-  packet->payload = (struct ddhcp_payload*) calloc(sizeof(struct ddhcp_payload), config->claiming_blocks_amount);
+  list_for_each_entry(block, &config->claiming_blocks, claim_list) {
+    packet_tx_add_inquire(socket, block->index);
 
-  if (!packet->payload) {
-    free(packet);
-    WARNING("block_claim(...): Failed to allocate ddhcpd mcast packet payload.\n");
-    return -ENOMEM;
-  }
+    if (packet_tx_count(socket) == max_inquiries || list_is_last(&block->claim_list, &config->claiming_blocks)) {
+      statistics_record(config, STAT_MCAST_SEND_PKG, 1);
+      statistics_record(config, STAT_MCAST_SEND_INQUIRE, 1);
+      ssize_t bytes_send = packet_tx_send_mcast(socket);
+      statistics_record(config, STAT_MCAST_SEND_BYTE, (long int) bytes_send);
 
-  int index = 0;
-  ddhcp_block* block;
+      if (bytes_send > 0) {
+        // Count the claim for every block of this packet.
+        for (ddhcp_block* sent = first; ; sent = list_entry(sent->claim_list.next, ddhcp_block, claim_list)) {
+          sent->claiming_counts++;
 
-  list_for_each_entry(block, &config->claiming_blocks, claim_list) {
-    packet->payload[index].block_index = block->index;
-    packet->payload[index].timeout = 0;
-    packet->payload[index].reserved = 0;
-    index++;
-  }
-
-  statistics_record(config, STAT_MCAST_SEND_PKG, 1);
-  statistics_record(config, STAT_MCAST_SEND_INQUIRE, 1);
-  ssize_t bytes_send = send_packet_mcast(packet, DDHCP_SKT_MCAST(config));
-  statistics_record(config, STAT_MCAST_SEND_BYTE, (long int) bytes_send);
+          if (sent == block) {
+            break;
+          }
+        }
+      } else {
+        DEBUG("block_claim(...): Send failed, no updates made.\n");
+      }
 
-  if (bytes_send > 0) {
-    list_for_each_entry(block, &config->claiming_blocks, claim_list) {
-      block->claiming_counts++;
+      first = list_entry(block->claim_list.next, ddhcp_block, claim_list);
+      packet_tx_begin(socket, DDHCP_MSG_INQUIRE, config);
     }
-  } else {
-    DEBUG("block_claim(...): Send failed, no updates made.\n");
   }
 
-  free(packet->payload);
-  free(packet);
   return 0;
 }
 
 ATTR_NONNULL_ALL uint32_t block_num_free_leases(ddhcp_config* config) {
   DEBUG("block_num_free_leases(config)\n");
 
-  ddhcp_block* block = config->blocks;
+  ddhcp_block* block;
   uint32_t free_leases = 0;
-#if LOG_LEVEL_LIMIT >= LOG_DEBUG
-  uint32_t num_blocks = 0;
-#endif
-
-  for (uint32_t i = 0; i < config->number_of_blocks; i++) {
-    if (block->state == DDHCP_OURS) {
-      free_leases += dhcp_num_free(block);
-#if LOG_LEVEL_LIMIT >= LOG_DEBUG
-      num_blocks++;
-#endif
-    }
 
-    block++;
+  block_for_each_in_state(block, DDHCP_OURS, config) {
+    free_leases += dhcp_num_free(block);
   }
 
-  DEBUG("block_num_free_leases(...): Found %lu free DHCP leases in OUR (%lu) blocks\n", free_leases, num_blocks);
+  DEBUG("block_num_free_leases(...): Found %lu free DHCP leases in OUR (%lu) blocks\n", free_leases, block_num_in_state(config, DDHCP_OURS));
   return free_leases;
 }
 
 ATTR_NONNULL_ALL uint32_t block_num_owned(ddhcp_config* config) {
-  uint32_t owned_blocks = 0;
-  ddhcp_block* block = config->blocks;
-  for (uint32_t i = 0; i < config->number_of_blocks; i++) {
-    if (block->state == DDHCP_OURS) {
-      owned_blocks++;
-    }
-  }
+  uint32_t owned_blocks = block_num_in_state(config, DDHCP_OURS);
   DEBUG("block_num_owned(...): We own %lu blocks\n", owned_blocks);
   return owned_blocks;
 }
@@ -274,24 +491,12 @@ ATTR_NONNULL_ALL uint32_t block_num_owned(ddhcp_config* config) {
 ATTR_NONNULL_ALL ddhcp_block* block_find_free_leases(ddhcp_config* config) {
   DEBUG("block_find_free_leases(config)\n");
 
-  ddhcp_block* block = config->blocks;
   ddhcp_block* selected = NULL;
 
-  for (uint32_t i = 0; i < config->number_of_blocks; i++) {
-    if (block->state == DDHCP_OURS) {
-      if (dhcp_has_free(block)) {
-        if (selected) {
-          // If observed block is claimed earlier, select that block.
-          if (selected->first_claimed > block->first_claimed) {
-            selected = block;
-          }
-        } else {
-          selected = block;
-        }
-      }
-    }
-
-    block++;
+  // The set is ordered by the time we claimed the blocks, so the
+  // first entry is the block claimed earliest.
+  if (!list_empty(&config->blocks_with_free_leases)) {
+    selected = list_first_entry(&config->blocks_with_free_leases, ddhcp_block, free_leases_list);
   }
 
 #if LOG_LEVEL_LIMIT >= LOG_DEBUG
@@ -309,30 +514,36 @@ ATTR_NONNULL_ALL ddhcp_block* block_find_free_leases(ddhcp_config* config) {
 
 ATTR_NONNULL_ALL void block_drop_unused(ddhcp_config* config) {
   DEBUG("block_drop_unsued(config)\n");
-  ddhcp_block* block = config->blocks;
+  ddhcp_block* block;
   ddhcp_block* freeable_block = NULL;
 
-  for (uint32_t i = 0; i < config->number_of_blocks; i++) {
-    if (block->state == DDHCP_OURS) {
-      if (dhcp_num_free(block) == config->block_size) {
-        DEBUG("block_drop unused(...): block %i is unused.\n", block->index);
-
-        if (freeable_block) {
-          // If observed block is younger than current selected, select block.
-          if (freeable_block->first_claimed < block->first_claimed) {
-            freeable_block = block;
-          }
-        } else {
-          freeable_block = block;
-        }
-      }
+  // Walk our blocks from the youngest to the oldest claim and
+  // select the first unused one.
+  list_for_each_entry_reverse(block, &config->blocks_by_state[DDHCP_OURS], state_list) {
+    if (dhcp_num_free(block) == config->block_size) {
+      DEBUG("block_drop unused(...): block %i is unused.\n", block->index);
+      freeable_block = block;
+      break;
     }
-
-    block++;
   }
 
   if (freeable_block) {
     time_t now = time(NULL);
+
+    // Keep the block, when the expected demand would need it again before
+    // it could be released.
+    uint32_t expected = demand_expected(&config->demand, now, config->block_needless_timeout);
+
+    if (block_num_free_leases(config) < config->spare_leases_needed + expected + config->block_size) {
+      DEBUG("block_drop_unused(...): keep block %i, %u leases expected\n", freeable_block->index, expected);
+
+      if (config->needless_marks != 0) {
+        block_unmark_needless(config);
+      }
+
+      return;
+    }
+
     if ( freeable_block->needless_since == 0 ) {
       DEBUG("block_drop_unused(...): mark block %i to be needless\n",freeable_block->index);
       freeable_block->needless_since = now;
@@ -341,7 +552,7 @@ ATTR_NONNULL_ALL void block_drop_unused(ddhcp_config* config) {
     } else {
       if ( freeable_block->needless_since <= now - config->block_needless_timeout) {
         DEBUG("block_drop_unused(...): free block %i.\n", freeable_block->index);
-        block_free(freeable_block);
+        block_free(freeable_block, config);
         config->needless_marks = 0;
       } else {
 #if LOG_LEVEL_LIMIT >= LOG_DEBUG
@@ -353,144 +564,357 @@ ATTR_NONNULL_ALL void block_drop_unused(ddhcp_config* config) {
   }
 }
 
-ATTR_NONNULL_ALL static void _block_update_claim_send(struct ddhcp_mcast_packet* packet, time_t new_block_timeout, ddhcp_config* config) {
-  DEBUG("block_update_claims_send(packet:%i,%li,config)\n",packet->count,new_block_timeout);
+ATTR_NONNULL_ALL static void _block_update_claim_send(ddhcp_epoll_data* socket, time_t new_block_timeout, ddhcp_config* config) {
+  DEBUG("block_update_claims_send(packet:%i,%li,config)\n",packet_tx_count(socket),new_block_timeout);
 
   statistics_record(config, STAT_MCAST_SEND_PKG, 1);
   statistics_record(config, STAT_MCAST_SEND_UPDATECLAIM, 1);
-  ssize_t bytes_send = send_packet_mcast(packet, DDHCP_SKT_MCAST(config));
+  ssize_t bytes_send = packet_tx_send_mcast(socket);
   statistics_record(config, STAT_MCAST_SEND_BYTE, (long int) bytes_send);
   // TODO? Stat the number of blocks reclaimed.
 
   if (bytes_send > 0) {
     // Update the timeout value of all contained blocks
     // iff the packet has been transmitted
-    for (uint8_t i = 0; i < packet->count; i++) {
-      uint32_t index = packet->payload[i].block_index;
-      DEBUG("block_update_claims_send(...): updated claim for block %i\n", index);
-      config->blocks[index].timeout = new_block_timeout;
+    for (uint8_t i = 0; i < packet_tx_count(socket); i++) {
+      uint16_t length;
+      uint32_t start = packet_tx_claim(socket, i, &length);
+
+      for (uint32_t index = start; index < start + length; index++) {
+        DEBUG("block_update_claims_send(...): updated claim for block %i\n", index);
+        block_set_timeout(block_lookup(index, config), new_block_timeout, config);
+      }
     }
   } else {
     DEBUG("block_update_claims_send(...): Send failed, no updates made.\n");
   }
+
+  packet_tx_begin(socket, packet_tx_command(socket), config);
+}
+
+/**
+ * Append a block to the update claim packet, a full packet is sent beforehand.
+ * In range claims a block following on the last range extends that range.
+ */
+ATTR_NONNULL_ALL static void _block_update_claim_add(ddhcp_epoll_data* socket, uint8_t max_claims, ddhcp_block* block, time_t new_block_timeout, ddhcp_config* config) {
+  DEBUG("block_update_claims(...): update claim for block %i\n", block->index);
+
+  if (config->claim_ranges && packet_tx_extend_range(socket, block->index) == 0) {
+    return;
+  }
+
+  if (packet_tx_count(socket) == max_claims) {
+    _block_update_claim_send(socket, new_block_timeout, config);
+  }
+
+  if (config->claim_ranges) {
+    packet_tx_add_range(socket, block->index, config->block_timeout);
+  } else {
+    packet_tx_add_claim(socket, block->index, config->block_timeout);
+  }
+}
+
+static int _block_compare_index(const void* a, const void* b) {
+  uint32_t index_a = (*(ddhcp_block* const*) a)->index;
+  uint32_t index_b = (*(ddhcp_block* const*) b)->index;
+
+  return (index_a > index_b) - (index_a < index_b);
 }
 
 ATTR_NONNULL_ALL void block_update_claims(ddhcp_config* config) {
   DEBUG("block_update_claims(config)\n");
-  uint32_t our_blocks = 0;
-  ddhcp_block* block = config->blocks;
+  ddhcp_block* block;
   time_t now = time(NULL);
-  time_t timeout_factor = now + config->block_timeout - (time_t)(config->block_timeout / config->block_refresh_factor);
+  time_t period = config->block_timeout / config->block_refresh_factor;
 
-  // Determine if we need to run a full update claim run
-  // we run through the list until we see one block which needs update.
-  // Running a full update claims (see below) is much more expensive
-  for (uint32_t i = 0; i < config->number_of_blocks; i++) {
-    if (block->state == DDHCP_OURS && block->timeout < timeout_factor) {
-      our_blocks++;
-      break;
+  if (period < 1) {
+    period = 1;
+  }
+
+  // Without any blocks to refresh, the next period starts with the first owned block.
+  if (block_num_in_state(config, DDHCP_OURS) == 0) {
+    DEBUG("block_update_claims(...): No blocks need claim updates.\n");
+    config->claim_refresh_start = 0;
+    config->claim_refresh_next = now + period;
+    return;
+  }
+
+  if (now >= config->claim_refresh_start + period) {
+    config->claim_refresh_start = now;
+    config->claim_refresh_next = now;
+  }
+
+  time_t period_end = config->claim_refresh_start + period;
+  // Blocks refreshed during the current period time out no earlier than this.
+  time_t refreshed_timeout = config->claim_refresh_start + config->block_timeout;
+  // Blocks which may time out before their turn in the next period.
+  time_t urgent_timeout = now + period;
+  time_t pending_timeout = refreshed_timeout > urgent_timeout ? refreshed_timeout : urgent_timeout;
+
+  uint32_t pending = 0;
+  uint32_t urgent = 0;
+
+  block_for_each_in_state(block, DDHCP_OURS, config) {
+    if (block->timeout < pending_timeout) {
+      pending++;
     }
 
-    block++;
+    if (block->timeout < urgent_timeout) {
+      urgent++;
+    }
   }
 
-  if (our_blocks == 0) {
+  if (pending == 0) {
     DEBUG("block_update_claims(...): No blocks need claim updates.\n");
+    config->claim_refresh_next = period_end;
     return;
   }
 
-  struct ddhcp_mcast_packet* packet = new_ddhcp_packet(DDHCP_MSG_UPDATECLAIM, config);
-
-  if (!packet) {
-    WARNING("block_update_claims(...): Failed to allocate ddhcpd mcast packet.\n");
+  if (urgent == 0 && now < config->claim_refresh_next) {
+    DEBUG("block_update_claims(...): Next claim update in %li seconds.\n", config->claim_refresh_next - now);
     return;
   }
 
-  // Aggressively group blocks into packets, send packet iff
-  // at least one block in a packet is below the baseline.
+  uint8_t command = config->claim_ranges ? DDHCP_MSG_UPDATECLAIM_RANGE : DDHCP_MSG_UPDATECLAIM;
+  ddhcp_epoll_data* socket = DDHCP_SKT_MCAST(config);
+  uint8_t max_claims = packet_max_payload(command, socket);
 
-  packet->payload = (struct ddhcp_payload*) calloc(sizeof(struct ddhcp_payload), UPDATE_CLAIM_MAX_BLOCKS);
+  // The scratch space only grows, so it is allocated once for a stable set of blocks.
+  if (pending > config->claim_scratch_size) {
+    ddhcp_block** scratch = (ddhcp_block**) realloc(config->claim_scratch, sizeof(ddhcp_block*) * pending);
 
-  if (!packet->payload) {
-    WARNING("block_update_claims(...): Failed to allocate ddhcpd packet payload.\n");
-    free(packet);
-    return;
+    if (!scratch) {
+      WARNING("block_update_claims(...): Failed to allocate claim scratch space.\n");
+      return;
+    }
+
+    config->claim_scratch = scratch;
+    config->claim_scratch_size = pending;
+  }
+
+  ddhcp_block** pending_blocks = config->claim_scratch;
+
+  uint32_t num_pending = 0;
+
+  block_for_each_in_state(block, DDHCP_OURS, config) {
+    if (block->timeout < pending_timeout) {
+      pending_blocks[num_pending++] = block;
+    }
   }
 
-  block = config->blocks;
-  uint8_t send_packet = 0;
-  uint8_t index = 0;
+  // Runs of adjacent blocks are found in the order of the block index,
+  // each run is sent as a single claim.
+  if (config->claim_ranges) {
+    qsort(pending_blocks, num_pending, sizeof(ddhcp_block*), _block_compare_index);
+  }
+
+  uint32_t claims = 0;
+
+  for (uint32_t i = 0; i < num_pending; i++) {
+    if (i == 0 || !config->claim_ranges || pending_blocks[i]->index != pending_blocks[i - 1]->index + 1) {
+      claims++;
+    }
+  }
+
+  uint32_t quota = 0;
+
+  if (now >= config->claim_refresh_next) {
+    // Spread the packets left in this period evenly over the remaining time.
+    uint32_t packets = (claims + max_claims - 1) / max_claims;
+    uint32_t seconds = (uint32_t)(period_end - now);
+    quota = (packets + seconds - 1) / seconds * max_claims;
+  }
+
+  packet_tx_begin(socket, command, config);
+  uint32_t sent = 0;
   time_t new_block_timeout = now + config->block_timeout;
 
-  for (uint32_t i = 0; i < config->number_of_blocks; i++) {
-    if (block->state == DDHCP_OURS) {
+  for (uint32_t i = 0; i < num_pending;) {
+    // A claim covers a single block or a run of adjacent blocks.
+    uint32_t end = i + 1;
+    bool urgent_claim = pending_blocks[i]->timeout < urgent_timeout;
+
+    while (config->claim_ranges && end < num_pending && pending_blocks[end]->index == pending_blocks[end - 1]->index + 1) {
+      urgent_claim |= pending_blocks[end]->timeout < urgent_timeout;
+      end++;
+    }
 
-      if (block->timeout < timeout_factor) {
-        DEBUG("block_update_claims(...): update claim for block %i needed\n", block->index);
-        send_packet = 1;
+    // Blocks close to their timeout, e.g. newly owned ones, can not wait.
+    // Otherwise send what is scheduled and fill up the last packet.
+    if (urgent_claim || sent < quota || (packet_tx_count(socket) > 0 && packet_tx_count(socket) < max_claims)) {
+      for (uint32_t j = i; j < end; j++) {
+        _block_update_claim_add(socket, max_claims, pending_blocks[j], new_block_timeout, config);
       }
 
-      packet->payload[index].block_index = block->index;
-      packet->payload[index].timeout     = config->block_timeout;
-      packet->payload[index].reserved    = 0;
+      sent++;
+    }
 
-      index++;
+    i = end;
+  }
 
-      if (index == UPDATE_CLAIM_MAX_BLOCKS) {
-        if (send_packet) {
-          packet->count = index;
-          send_packet = 0;
-          _block_update_claim_send(packet, new_block_timeout, config);
-        }
+  if (packet_tx_count(socket) > 0) {
+    _block_update_claim_send(socket, new_block_timeout, config);
+  }
 
-        index = 0;
-      }
+  // Schedule the next packet, so the remaining ones are spaced evenly
+  // and the last one is sent before the period ends.
+  uint32_t packets_left = (claims - sent + max_claims - 1) / max_claims;
+
+  if (packets_left == 0) {
+    config->claim_refresh_next = period_end;
+  } else {
+    time_t interval = (period_end - now) / (time_t)(packets_left + 1);
+    config->claim_refresh_next = now + (interval > 0 ? interval : 1);
+  }
+}
+
+ATTR_NONNULL_ALL void block_reannounce(ddhcp_block* block, ddhcp_config* config) {
+  if (block->reannounce) {
+    return;
+  }
+
+  if (config->reannounce_count == config->reannounce_size) {
+    uint32_t size = config->reannounce_size > 0 ? config->reannounce_size * 2 : 16;
+    ddhcp_block** blocks = (ddhcp_block**) realloc(config->reannounce_blocks, sizeof(ddhcp_block*) * size);
+
+    if (!blocks) {
+      // The block is still refreshed by the periodic claim updates.
+      WARNING("block_reannounce(...): Failed to queue block %i\n", block->index);
+      return;
+    }
+
+    config->reannounce_blocks = blocks;
+    config->reannounce_size = size;
+  }
+
+  DEBUG("block_reannounce(...): queue block %i\n", block->index);
+  block->reannounce = 1;
+  config->reannounce_blocks[config->reannounce_count++] = block;
+}
+
+ATTR_NONNULL_ALL void block_reannounce_flush(ddhcp_config* config) {
+  if (config->reannounce_count == 0) {
+    return;
+  }
+
+  DEBUG("block_reannounce_flush(config): %u blocks\n", config->reannounce_count);
+
+  uint8_t command = config->claim_ranges ? DDHCP_MSG_UPDATECLAIM_RANGE : DDHCP_MSG_UPDATECLAIM;
+  ddhcp_epoll_data* socket = DDHCP_SKT_MCAST(config);
+  uint8_t max_claims = packet_max_payload(command, socket);
+  time_t new_block_timeout = time(NULL) + config->block_timeout;
+
+  if (config->claim_ranges) {
+    qsort(config->reannounce_blocks, config->reannounce_count, sizeof(ddhcp_block*), _block_compare_index);
+  }
+
+  packet_tx_begin(socket, command, config);
+
+  for (uint32_t i = 0; i < config->reannounce_count; i++) {
+    ddhcp_block* block = config->reannounce_blocks[i];
+    block->reannounce = 0;
+
+    if (block->state == DDHCP_OURS) {
+      _block_update_claim_add(socket, max_claims, block, new_block_timeout, config);
     }
+  }
 
-    block++;
+  if (packet_tx_count(socket) > 0) {
+    _block_update_claim_send(socket, new_block_timeout, config);
   }
 
-  if (send_packet) {
-    packet->count = index;
-    _block_update_claim_send(packet, new_block_timeout, config);
+  config->reannounce_count = 0;
+}
+
+ATTR_NONNULL_ALL void block_send_heartbeat(ddhcp_config* config) {
+  time_t now = time(NULL);
+
+  if (now < config->heartbeat_next) {
+    return;
   }
 
-  free(packet->payload);
-  free(packet);
+  DEBUG("block_send_heartbeat(config)\n");
+  ddhcp_epoll_data* socket = DDHCP_SKT_MCAST(config);
+
+  packet_tx_begin(socket, DDHCP_MSG_UPDATECLAIM, config);
+  statistics_record(config, STAT_MCAST_SEND_PKG, 1);
+  statistics_record(config, STAT_MCAST_SEND_UPDATECLAIM, 1);
+  ssize_t bytes_send = packet_tx_send_mcast(socket);
+  statistics_record(config, STAT_MCAST_SEND_BYTE, (long int) bytes_send);
+  UNUSED(bytes_send);
+
+  config->heartbeat_next = now + block_heartbeat_interval(config);
+}
+
+ATTR_NONNULL_ALL void block_free_peer(uint16_t peer, ddhcp_config* config) {
+  ddhcp_block* block;
+  ddhcp_block* tmp;
+
+  // Freeing a block drops it from the blocks of its owner.
+  list_for_each_entry_safe(block, tmp, &peer_get(&config->peers, peer)->blocks, owner_list) {
+    DEBUG("block_free_peer(...): free block %i\n", block->index);
+    block_free(block, config);
+  }
+}
+
+ATTR_NONNULL_ALL void block_check_peers(ddhcp_config* config) {
+  DEBUG("block_check_peers(config)\n");
+  time_t now = time(NULL);
+  time_t deadline = now - DDHCP_HEARTBEAT_MISSES * block_heartbeat_interval(config);
+  ddhcp_peer_table* table = &config->peers;
+
+  for (uint32_t i = DDHCP_PEER_SELF + 1; i < table->size; i++) {
+    ddhcp_peer* peer = table->peers[i];
+
+    if (!peer || !peer->heartbeat || peer->num_blocks == 0 || peer->last_seen >= deadline) {
+      continue;
+    }
+
+    INFO("block_check_peers(...): node 0x%02x%02x%02x%02x%02x%02x%02x%02x is gone, free its %u blocks\n", HEX_NODE_ID(peer->node_id), peer->num_blocks);
+    block_free_peer((uint16_t) i, config);
+  }
 }
 
 ATTR_NONNULL_ALL void block_check_timeouts(ddhcp_config* config) {
   DEBUG("block_check_timeouts(config)\n");
-  ddhcp_block* block = config->blocks;
+  ddhcp_block* block;
+  ddhcp_timer timer;
   time_t now = time(NULL);
 
-  for (uint32_t i = 0; i < config->number_of_blocks; i++) {
-    if (block->timeout < now && block->state != DDHCP_BLOCKED && block->state != DDHCP_FREE) {
-      INFO("block_check_timeouts(...): Block %i FREE through timeout.\n", block->index);
-      block_free(block);
+  while (timer_queue_pop(&config->block_timers, now, &timer)) {
+    block = block_lookup(timer.id, config);
+
+    // The page of the block has been released since, the timer is stale.
+    if (!block) {
+      continue;
     }
 
-    if (block->state == DDHCP_OURS) {
-      dhcp_check_timeouts(block);
-    } else if (block->addresses) {
-      int free_leases = dhcp_check_timeouts(block);
+    block->timer_pending = 0;
 
-      if (free_leases == block->subnet_len) {
-        block_free(block);
-      }
+    if (block->state == DDHCP_FREE || block->state == DDHCP_BLOCKED) {
+      continue;
     }
 
-    block++;
+    if (block->timeout >= now) {
+      // The timeout has been extended since this timer was scheduled.
+      block_set_timeout(block, block->timeout, config);
+      continue;
+    }
+
+    INFO("block_check_timeouts(...): Block %i FREE through timeout.\n", block->index);
+    block_free(block, config);
   }
+
+  dhcp_check_timeouts(config);
 }
 
 ATTR_NONNULL_ALL void block_show_status(int fd, ddhcp_config* config) {
-  ddhcp_block* block = config->blocks;
   dprintf(fd, "block size/number\t%u/%u \n", config->block_size, config->number_of_blocks);
   dprintf(fd, "      tentative timeout\t%u\n", config->tentative_timeout);
   dprintf(fd, "      timeout\t%u\n", config->block_timeout);
   dprintf(fd, "      refresh factor\t%u\n", config->block_refresh_factor);
   dprintf(fd, "      spare leases needed\t%u\n", config->spare_leases_needed);
+  dprintf(fd, "      lease demand\t%.2f/min\n", demand_per_minute(&config->demand));
   dprintf(fd, "      network: %s/%i \n", inet_ntoa(config->prefix), config->prefix_len);
 
   char node_id[17];
@@ -511,6 +935,14 @@ ATTR_NONNULL_ALL void block_show_status(int fd, ddhcp_config* config) {
   uint32_t num_reserved_blocks = 0;
 
   for (uint32_t i = 0; i < config->number_of_blocks; i++) {
+    ddhcp_block* block = block_lookup(i, config);
+
+    // Blocks without a page have never been used.
+    if (!block) {
+      i += DDHCP_BLOCK_PAGE_SIZE - 1 - i % DDHCP_BLOCK_PAGE_SIZE;
+      continue;
+    }
+
     uint32_t free_leases = 0;
     uint32_t offered_leases = 0;
 
@@ -520,7 +952,7 @@ ATTR_NONNULL_ALL void block_show_status(int fd, ddhcp_config* config) {
     }
 
     for (uint32_t j = 0; j < 8; j++) {
-      sprintf(node_id + 2 * j, "%02X", block->node_id[j]);
+      sprintf(node_id + 2 * j, "%02X", block->owner != DDHCP_PEER_NONE ? block_owner(block, config)->node_id[j] : 0);
     }
 
     node_id[16] = '\0';
@@ -540,8 +972,6 @@ ATTR_NONNULL_ALL void block_show_status(int fd, ddhcp_config* config) {
       num_reserved_blocks++;
       dprintf(fd, "%i\t%i\t%s\t%u\t%s\t%lu\n", block->index, block->state, node_id, block->claiming_counts, leases, timeout);
     }
-
-    block++;
   }
 
   dprintf(fd, "\nblocks in use: %i\n", num_reserved_blocks);
@@ -549,15 +979,15 @@ ATTR_NONNULL_ALL void block_show_status(int fd, ddhcp_config* config) {
 
 void block_unmark_needless(ddhcp_config* config){
   DEBUG("block_unmark_needless(config)\n");
-  ddhcp_block* block = config->blocks;
-  for (uint32_t i = 0; i < config->number_of_blocks; i++) {
+  ddhcp_block* block;
+  // Only our blocks are ever marked as needless.
+  block_for_each_in_state(block, DDHCP_OURS, config) {
 #if LOG_LEVEL_LIMIT >= LOG_DEBUG
     if (block->needless_since > 0) {
       DEBUG("block_unmark_needless(...): Unmark block %i\n",block->index);
     }
 #endif
     block->needless_since = 0;
-    block++;
   }
   // Remove needless marks flag
   config->needless_marks = 0;
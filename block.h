@@ -3,12 +3,41 @@
 
 #include "types.h"
 #include "packet.h"
+#include "peer.h"
 
 /**
  * Allocate block.
  * This will also malloc and prepare a dhcp_lease_block inside the given block.
  */
-int block_alloc(ddhcp_block* block);
+ATTR_NONNULL(2) int block_alloc(ddhcp_block* block, ddhcp_config* config);
+
+/**
+ * Owning peer of the given block, which has to have an owner.
+ */
+#define block_owner(block, config) peer_get(&(config)->peers, (block)->owner)
+
+/**
+ * Return the block with the given index or NULL, when its page of the
+ * block table has not been allocated. In that case the block is FREE.
+ */
+ATTR_NONNULL_ALL ddhcp_block* block_lookup(uint32_t index, ddhcp_config* config);
+
+/**
+ * Return the block with the given index, its page of the block table is
+ * allocated when necessary. Returns NULL if the allocation fails.
+ */
+ATTR_NONNULL_ALL ddhcp_block* block_get(uint32_t index, ddhcp_config* config);
+
+/**
+ * Release the pages of the block table, which only hold FREE blocks
+ * without any pending timer or claim.
+ */
+ATTR_NONNULL_ALL void block_collect_pages(ddhcp_config* config);
+
+/**
+ * Offset of the first address of the given block within the prefix.
+ */
+#define block_subnet_offset(block, config) ((block)->index * (config)->block_size)
 
 /**
  * Own a block, possibly after you have claimed it an amount of times.
@@ -19,7 +48,55 @@ ATTR_NONNULL(2) int block_own(ddhcp_block* block, ddhcp_config* config);
 /**
  * Free a block and release dhcp_lease_block when allocated.
  */
-ATTR_NONNULL_ALL void block_free(ddhcp_block* block);
+ATTR_NONNULL_ALL void block_free(ddhcp_block* block, ddhcp_config* config);
+
+/**
+ * Move a block into another state and update the per-state block sets.
+ * Every state transition of a block has to go through this function.
+ */
+ATTR_NONNULL_ALL void block_set_state(ddhcp_block* block, enum ddhcp_block_state state, ddhcp_config* config);
+
+/**
+ * Set the owning peer of a block, blocks only have an owner while they are
+ * CLAIMED or OURS. Every change of a block owner has to go through this function.
+ */
+ATTR_NONNULL_ALL void block_set_owner(ddhcp_block* block, uint16_t owner, ddhcp_config* config);
+
+/**
+ * Set the timeout of a block and schedule its expiry in the block timers.
+ * Every change of a block timeout has to go through this function.
+ */
+ATTR_NONNULL_ALL void block_set_timeout(ddhcp_block* block, time_t timeout, ddhcp_config* config);
+
+/**
+ * Allocate the set of FREE blocks with every block in it.
+ * Returns 0 on success.
+ */
+ATTR_NONNULL_ALL int block_free_set_init(ddhcp_config* config);
+
+/**
+ * Release the memory held by the set of FREE blocks.
+ */
+ATTR_NONNULL_ALL void block_free_set_free(ddhcp_config* config);
+
+/**
+ * Add or remove a block from the set of our blocks with free leases.
+ * Has to be called whenever the state of the block or of one of its leases changes.
+ */
+ATTR_NONNULL_ALL void block_update_free_leases(ddhcp_block* block, ddhcp_config* config);
+
+/**
+ * Number of blocks currently in the given state.
+ */
+#define block_num_in_state(config, state) ((config)->num_blocks_by_state[state])
+
+/**
+ * Iterate over all blocks in the given state, except FREE. The loop body
+ * must not change the state of the current block, use list_for_each_entry_safe
+ * on config->blocks_by_state for that.
+ */
+#define block_for_each_in_state(block, state, config) \
+  list_for_each_entry(block, &(config)->blocks_by_state[state], state_list)
 
 /**
  * Find a free block and return it or otherwise NULL.
@@ -62,14 +139,54 @@ ATTR_NONNULL_ALL void block_drop_unused(ddhcp_config* config);
  *  Update the timeout of claimed blocks and send packets to
  *  distribute the continuations of that claim.
  *
- *  Due to fragmented timeouts this packet may send 2 times more packets
- *  than optimal. TODO fixthis
+ *  Every block is refreshed once per period of block_timeout / block_refresh_factor
+ *  seconds, the packets of a period are spread evenly over it. Blocks close to
+ *  their timeout are announced at once. Call again at config->claim_refresh_next.
  */
 ATTR_NONNULL_ALL void block_update_claims(ddhcp_config* config);
 
 /**
- * Check the timeout of all blocks, and mark timed out once as FREE.
+ * Queue one of our blocks for re-announcement, e.g. because another node
+ * inquired or claimed it. Queued blocks are announced together by
+ * block_reannounce_flush, once the current receive batch is processed.
+ */
+ATTR_NONNULL_ALL void block_reannounce(ddhcp_block* block, ddhcp_config* config);
+
+/**
+ * Send a single claim update for all blocks queued by block_reannounce,
+ * which are still ours.
+ */
+ATTR_NONNULL_ALL void block_reannounce_flush(ddhcp_config* config);
+
+/**
+ * Nodes announce that they are alive by an update claim without any claims
+ * once per house keeping interval. A node missing DDHCP_HEARTBEAT_MISSES
+ * heartbeats in a row is considered dead. All nodes of a network are
+ * expected to run with the same tentative timeout.
+ */
+#define DDHCP_HEARTBEAT_MISSES 3
+#define block_heartbeat_interval(config) ((time_t)((config)->tentative_timeout >> 1))
+
+/**
+ * Send our heartbeat, if it is due.
+ */
+ATTR_NONNULL_ALL void block_send_heartbeat(ddhcp_config* config);
+
+/**
+ * Free all blocks owned by the given peer.
+ */
+ATTR_NONNULL_ALL void block_free_peer(uint16_t peer, ddhcp_config* config);
+
+/**
+ * Free the blocks of the peers, which send heartbeats but missed
+ * DDHCP_HEARTBEAT_MISSES of them, instead of waiting for their claims to time out.
+ */
+ATTR_NONNULL_ALL void block_check_peers(ddhcp_config* config);
+
+/**
+ * Process the expired block timers, and mark timed out blocks as FREE.
  * Blocks which are marked as BLOCKED are ignored in this process.
+ * Afterwards the expired dhcp leases are released.
  */
 ATTR_NONNULL_ALL void block_check_timeouts(ddhcp_config* config);
 
@@ -0,0 +1,470 @@
+#include "checkpoint.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stddef.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "block.h"
+#include "dhcp.h"
+#include "logger.h"
+
+#define CHECKPOINT_MAGIC "DDHCPCK"
+#define CHECKPOINT_VERSION 1
+
+// Number of the latest updates kept in the journal.
+#define CHECKPOINT_JOURNAL_SIZE 16
+// Size of the largest record, updates of a record go through the journal.
+#define CHECKPOINT_RECORD_MAX 40
+// Slots start on the page following the header.
+#define CHECKPOINT_SLOTS_OFFSET 4096
+#define CHECKPOINT_MIN_SLOTS 16
+
+struct checkpoint_journal_entry {
+  uint64_t seq;
+  uint32_t offset;
+  uint16_t length;
+  uint16_t reserved;
+  uint8_t data[CHECKPOINT_RECORD_MAX];
+  // Checksum of the fields above, a torn entry is never replayed.
+  uint32_t checksum;
+  uint32_t reserved2;
+};
+
+struct checkpoint_header {
+  char magic[8];
+  uint32_t version;
+  uint32_t number_of_blocks;
+  struct in_addr prefix;
+  uint8_t prefix_len;
+  uint8_t block_size;
+  uint16_t reserved;
+  uint32_t slot_size;
+  uint32_t num_slots;
+  ddhcp_node_id node_id;
+  struct checkpoint_journal_entry journal[CHECKPOINT_JOURNAL_SIZE];
+};
+
+// First record of a slot, the slot belongs to block index iff used is set.
+// Every use of a slot has a new generation.
+struct checkpoint_block {
+  uint32_t index;
+  uint32_t used;
+  int64_t timeout;
+  uint64_t generation;
+};
+
+// Followed by one record per lease of the block, leases of a former
+// generation of the slot are free.
+struct checkpoint_lease {
+  int64_t lease_end;
+  uint64_t generation;
+  uint32_t xid;
+  uint8_t state;
+  uint8_t reserved[3];
+  uint8_t chaddr[16];
+};
+
+_Static_assert(sizeof(struct checkpoint_header) <= CHECKPOINT_SLOTS_OFFSET, "checkpoint header exceeds its page");
+_Static_assert(sizeof(struct checkpoint_block) <= CHECKPOINT_RECORD_MAX, "checkpoint block record too large");
+_Static_assert(sizeof(struct checkpoint_lease) <= CHECKPOINT_RECORD_MAX, "checkpoint lease record too large");
+
+#define _checkpoint_header(cp) ((struct checkpoint_header*) (cp)->map)
+#define _checkpoint_record(cp, slot, config) ((struct checkpoint_block*) ((cp)->map + _checkpoint_slot_offset(slot, config)))
+#define _checkpoint_slot_size(config) (sizeof(struct checkpoint_block) + sizeof(struct checkpoint_lease) * (config)->block_size)
+#define _checkpoint_slot_offset(slot, config) (CHECKPOINT_SLOTS_OFFSET + (size_t)(slot) * _checkpoint_slot_size(config))
+
+static uint32_t _checkpoint_checksum(const struct checkpoint_journal_entry* entry) {
+  const uint8_t* data = (const uint8_t*) entry;
+  uint32_t hash = 2166136261u;
+
+  // FNV-1a
+  for (size_t i = 0; i < offsetof(struct checkpoint_journal_entry, checksum); i++) {
+    hash = (hash ^ data[i]) * 16777619u;
+  }
+
+  return hash;
+}
+
+/**
+ * Write length bytes of the mapping at offset to disk, the kernel writes
+ * back dirty pages in any order otherwise.
+ */
+ATTR_NONNULL_ALL static void _checkpoint_sync(ddhcp_checkpoint* cp, size_t offset, size_t length) {
+  // msync takes page aligned addresses only.
+  size_t start = offset & ~((size_t) CHECKPOINT_SLOTS_OFFSET - 1);
+
+  if (msync(cp->map + start, offset + length - start, MS_SYNC)) {
+    ERROR("_checkpoint_sync(...): Failed to write checkpoint (%i): %s\n", errno, strerror(errno));
+  }
+}
+
+/**
+ * Write a record of the checkpoint through the journal.
+ */
+ATTR_NONNULL_ALL static void _checkpoint_write(ddhcp_checkpoint* cp, size_t offset, const void* data, uint16_t length) {
+  // An entry is reused after a full round through the journal, the records
+  // of the last round have to be on disk before.
+  if (cp->seq > 0 && cp->seq % CHECKPOINT_JOURNAL_SIZE == 0) {
+    _checkpoint_sync(cp, CHECKPOINT_SLOTS_OFFSET, cp->size - CHECKPOINT_SLOTS_OFFSET);
+  }
+
+  struct checkpoint_journal_entry* entry = _checkpoint_header(cp)->journal + (cp->seq % CHECKPOINT_JOURNAL_SIZE);
+
+  entry->seq = ++cp->seq;
+  entry->offset = (uint32_t) offset;
+  entry->length = length;
+  memcpy(entry->data, data, length);
+  entry->checksum = _checkpoint_checksum(entry);
+
+  // The record is changed only once its journal entry is on disk.
+  _checkpoint_sync(cp, 0, CHECKPOINT_SLOTS_OFFSET);
+
+  memcpy(cp->map + offset, data, length);
+}
+
+/**
+ * Apply the journal entries in order of their sequence number, this completes
+ * an update interrupted by a crash.
+ */
+ATTR_NONNULL_ALL static void _checkpoint_replay(ddhcp_checkpoint* cp) {
+  struct checkpoint_journal_entry* journal = _checkpoint_header(cp)->journal;
+  struct checkpoint_journal_entry* valid[CHECKPOINT_JOURNAL_SIZE];
+  uint32_t num_valid = 0;
+
+  cp->seq = 0;
+
+  for (uint32_t i = 0; i < CHECKPOINT_JOURNAL_SIZE; i++) {
+    struct checkpoint_journal_entry* entry = journal + i;
+
+    if (entry->seq == 0 || entry->checksum != _checkpoint_checksum(entry) ||
+        entry->length > CHECKPOINT_RECORD_MAX || entry->offset < CHECKPOINT_SLOTS_OFFSET ||
+        entry->offset + entry->length > cp->size) {
+      continue;
+    }
+
+    // Insertion sort by sequence number.
+    uint32_t j = num_valid++;
+
+    while (j > 0 && valid[j - 1]->seq > entry->seq) {
+      valid[j] = valid[j - 1];
+      j--;
+    }
+
+    valid[j] = entry;
+  }
+
+  for (uint32_t i = 0; i < num_valid; i++) {
+    memcpy(cp->map + valid[i]->offset, valid[i]->data, valid[i]->length);
+  }
+
+  if (num_valid > 0) {
+    cp->seq = valid[num_valid - 1]->seq;
+    // The journal entries are reused from now on.
+    _checkpoint_sync(cp, CHECKPOINT_SLOTS_OFFSET, cp->size - CHECKPOINT_SLOTS_OFFSET);
+  }
+
+  DEBUG("checkpoint_replay(...): replayed %u journal entries\n", num_valid);
+}
+
+/**
+ * Start an empty checkpoint of the current configuration.
+ */
+ATTR_NONNULL_ALL static int _checkpoint_create(ddhcp_config* config) {
+  ddhcp_checkpoint* cp = &config->checkpoint;
+  size_t size = _checkpoint_slot_offset(CHECKPOINT_MIN_SLOTS, config);
+
+  if (ftruncate(cp->fd, 0) || ftruncate(cp->fd, (off_t) size)) {
+    return -errno;
+  }
+
+  cp->map = (uint8_t*) mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, cp->fd, 0);
+
+  if (cp->map == MAP_FAILED) {
+    cp->map = NULL;
+    return -errno;
+  }
+
+  cp->size = size;
+  cp->num_slots = CHECKPOINT_MIN_SLOTS;
+  cp->seq = 0;
+
+  struct checkpoint_header* header = _checkpoint_header(cp);
+  header->version = CHECKPOINT_VERSION;
+  header->number_of_blocks = config->number_of_blocks;
+  memcpy(&header->prefix, &config->prefix, sizeof(struct in_addr));
+  header->prefix_len = config->prefix_len;
+  header->block_size = config->block_size;
+  header->slot_size = (uint32_t) _checkpoint_slot_size(config);
+  header->num_slots = cp->num_slots;
+  memcpy(header->node_id, config->node_id, sizeof(ddhcp_node_id));
+
+  // The magic comes last, once the header is on disk, a file without is
+  // started anew.
+  _checkpoint_sync(cp, 0, CHECKPOINT_SLOTS_OFFSET);
+  memcpy(header->magic, CHECKPOINT_MAGIC, sizeof(CHECKPOINT_MAGIC));
+  _checkpoint_sync(cp, 0, CHECKPOINT_SLOTS_OFFSET);
+
+  return 0;
+}
+
+ATTR_NONNULL_ALL int checkpoint_open(ddhcp_config* config) {
+  ddhcp_checkpoint* cp = &config->checkpoint;
+
+  cp->fd = -1;
+  cp->map = NULL;
+  cp->size = 0;
+  cp->num_slots = 0;
+  cp->free_slots = NULL;
+  cp->num_free_slots = 0;
+  cp->seq = 0;
+  cp->restoring = 0;
+
+  if (!config->checkpoint_path) {
+    return 0;
+  }
+
+  cp->fd = open(config->checkpoint_path, O_RDWR | O_CREAT | O_CLOEXEC, 0600);
+
+  if (cp->fd < 0) {
+    return -errno;
+  }
+
+  struct stat st;
+  struct checkpoint_header header;
+
+  if (fstat(cp->fd, &st)) {
+    return -errno;
+  }
+
+  if (st.st_size < CHECKPOINT_SLOTS_OFFSET || pread(cp->fd, &header, sizeof(header), 0) != sizeof(header) ||
+      memcmp(header.magic, CHECKPOINT_MAGIC, sizeof(CHECKPOINT_MAGIC)) != 0 ||
+      header.version != CHECKPOINT_VERSION ||
+      header.number_of_blocks != config->number_of_blocks ||
+      memcmp(&header.prefix, &config->prefix, sizeof(struct in_addr)) != 0 ||
+      header.prefix_len != config->prefix_len ||
+      header.block_size != config->block_size ||
+      header.slot_size != _checkpoint_slot_size(config)) {
+    INFO("checkpoint_open(...): Start a new checkpoint in %s\n", config->checkpoint_path);
+    return _checkpoint_create(config);
+  }
+
+  // The file is grown before the number of slots is updated.
+  uint32_t num_slots = (uint32_t)(((size_t) st.st_size - CHECKPOINT_SLOTS_OFFSET) / header.slot_size);
+
+  if (header.num_slots < num_slots) {
+    num_slots = header.num_slots;
+  }
+
+  cp->size = (size_t) st.st_size;
+  cp->map = (uint8_t*) mmap(NULL, cp->size, PROT_READ | PROT_WRITE, MAP_SHARED, cp->fd, 0);
+
+  if (cp->map == MAP_FAILED) {
+    cp->map = NULL;
+    return -errno;
+  }
+
+  cp->num_slots = num_slots;
+  _checkpoint_replay(cp);
+
+  // Keep our node id, other nodes still know our blocks by it.
+  memcpy(config->node_id, header.node_id, sizeof(ddhcp_node_id));
+
+  return 0;
+}
+
+/**
+ * Double the number of slots of the checkpoint.
+ */
+ATTR_NONNULL_ALL static int _checkpoint_grow(ddhcp_config* config) {
+  ddhcp_checkpoint* cp = &config->checkpoint;
+  uint32_t num_slots = cp->num_slots * 2;
+  size_t size = _checkpoint_slot_offset(num_slots, config);
+
+  uint32_t* free_slots = (uint32_t*) realloc(cp->free_slots, sizeof(uint32_t) * num_slots);
+
+  if (!free_slots) {
+    return -ENOMEM;
+  }
+
+  cp->free_slots = free_slots;
+
+  if (ftruncate(cp->fd, (off_t) size)) {
+    return -errno;
+  }
+
+  uint8_t* map = (uint8_t*) mremap(cp->map, cp->size, size, MREMAP_MAYMOVE);
+
+  if (map == MAP_FAILED) {
+    return -errno;
+  }
+
+  cp->map = map;
+  cp->size = size;
+
+  // New slots are pushed in reverse, so they are used in order.
+  for (uint32_t slot = num_slots; slot > cp->num_slots; slot--) {
+    cp->free_slots[cp->num_free_slots++] = slot - 1;
+  }
+
+  cp->num_slots = num_slots;
+  _checkpoint_header(cp)->num_slots = num_slots;
+
+  return 0;
+}
+
+/**
+ * Release the slot of a block and mark it unused in the file.
+ */
+ATTR_NONNULL_ALL static void _checkpoint_free_slot(uint32_t slot, ddhcp_config* config) {
+  ddhcp_checkpoint* cp = &config->checkpoint;
+  struct checkpoint_block record = { 0, 0, 0, 0 };
+
+  _checkpoint_write(cp, _checkpoint_slot_offset(slot, config), &record, sizeof(record));
+  cp->free_slots[cp->num_free_slots++] = slot;
+}
+
+ATTR_NONNULL_ALL void checkpoint_restore(ddhcp_config* config) {
+  ddhcp_checkpoint* cp = &config->checkpoint;
+
+  if (!cp->map) {
+    return;
+  }
+
+  cp->free_slots = (uint32_t*) calloc(cp->num_slots, sizeof(uint32_t));
+
+  if (!cp->free_slots) {
+    ERROR("checkpoint_restore(...): Failed to allocate memory, disable checkpoint\n");
+    checkpoint_close(config);
+    return;
+  }
+
+  time_t now = time(NULL);
+  uint32_t num_blocks = 0;
+  uint32_t num_leases = 0;
+
+  // Restoring a block changes it like any other block of ours, but
+  // the checkpoint holds this state already.
+  cp->restoring = 1;
+
+  for (uint32_t slot = cp->num_slots; slot > 0; slot--) {
+    struct checkpoint_block* record = _checkpoint_record(cp, slot - 1, config);
+
+    if (!record->used) {
+      cp->free_slots[cp->num_free_slots++] = slot - 1;
+      continue;
+    }
+
+    ddhcp_block* block = NULL;
+
+    if (record->index < config->number_of_blocks && record->timeout > now) {
+      block = block_get(record->index, config);
+    }
+
+    if (!block || block->state == DDHCP_OURS || block_own(block, config)) {
+      DEBUG("checkpoint_restore(...): drop slot %u\n", slot - 1);
+      _checkpoint_free_slot(slot - 1, config);
+      continue;
+    }
+
+    block->checkpoint_slot = slot;
+    block_set_timeout(block, (time_t) record->timeout, config);
+    num_blocks++;
+
+    struct checkpoint_lease* leases = (struct checkpoint_lease*)(record + 1);
+
+    for (uint32_t i = 0; i < config->block_size; i++) {
+      if (leases[i].generation == record->generation && leases[i].state != FREE &&
+          leases[i].state < DHCP_LEASE_STATES && leases[i].lease_end > now) {
+        dhcp_lease_restore(block, i, (enum dhcp_lease_state) leases[i].state, leases[i].chaddr, leases[i].xid, (time_t) leases[i].lease_end, config);
+        num_leases++;
+      }
+    }
+  }
+
+  cp->restoring = 0;
+
+  INFO("checkpoint_restore(...): Restored %u blocks with %u leases\n", num_blocks, num_leases);
+}
+
+ATTR_NONNULL_ALL void checkpoint_block(ddhcp_block* block, ddhcp_config* config) {
+  ddhcp_checkpoint* cp = &config->checkpoint;
+
+  if (!cp->map || cp->restoring) {
+    return;
+  }
+
+  struct checkpoint_block record = { block->index, 1, (int64_t) block->timeout, 0 };
+
+  if (block->checkpoint_slot == 0) {
+    if (cp->num_free_slots == 0 && _checkpoint_grow(config)) {
+      ERROR("checkpoint_block(...): Failed to grow checkpoint, block %i is not saved\n", block->index);
+      return;
+    }
+
+    block->checkpoint_slot = cp->free_slots[--cp->num_free_slots] + 1;
+    // The sequence number of this write is unique.
+    record.generation = cp->seq + 1;
+  } else {
+    record.generation = _checkpoint_record(cp, block->checkpoint_slot - 1, config)->generation;
+  }
+
+  _checkpoint_write(cp, _checkpoint_slot_offset(block->checkpoint_slot - 1, config), &record, sizeof(record));
+}
+
+ATTR_NONNULL_ALL void checkpoint_drop(ddhcp_block* block, ddhcp_config* config) {
+  if (block->checkpoint_slot == 0) {
+    return;
+  }
+
+  if (config->checkpoint.map) {
+    _checkpoint_free_slot(block->checkpoint_slot - 1, config);
+  }
+
+  block->checkpoint_slot = 0;
+}
+
+ATTR_NONNULL_ALL void checkpoint_lease(ddhcp_block* block, uint32_t lease_index, enum dhcp_lease_state state, const uint8_t* chaddr, uint32_t xid, time_t lease_end, ddhcp_config* config) {
+  ddhcp_checkpoint* cp = &config->checkpoint;
+
+  if (!cp->map || cp->restoring || block->checkpoint_slot == 0) {
+    return;
+  }
+
+  struct checkpoint_lease record;
+  memset(&record, 0, sizeof(record));
+  record.lease_end = (int64_t) lease_end;
+  record.generation = _checkpoint_record(cp, block->checkpoint_slot - 1, config)->generation;
+  record.xid = xid;
+  record.state = (uint8_t) state;
+  memcpy(record.chaddr, chaddr, sizeof(record.chaddr));
+
+  size_t offset = _checkpoint_slot_offset(block->checkpoint_slot - 1, config) + sizeof(struct checkpoint_block) + sizeof(struct checkpoint_lease) * lease_index;
+  _checkpoint_write(cp, offset, &record, sizeof(record));
+}
+
+ATTR_NONNULL_ALL void checkpoint_close(ddhcp_config* config) {
+  ddhcp_checkpoint* cp = &config->checkpoint;
+
+  if (cp->map) {
+    if (msync(cp->map, cp->size, MS_SYNC)) {
+      ERROR("checkpoint_close(...): Failed to write checkpoint (%i): %s\n", errno, strerror(errno));
+    }
+
+    munmap(cp->map, cp->size);
+    cp->map = NULL;
+  }
+
+  if (cp->fd >= 0) {
+    close(cp->fd);
+    cp->fd = -1;
+  }
+
+  free(cp->free_slots);
+  cp->free_slots = NULL;
+  cp->num_free_slots = 0;
+}
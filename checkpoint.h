@@ -0,0 +1,51 @@
+#ifndef _CHECKPOINT_H
+#define _CHECKPOINT_H
+
+#include "types.h"
+
+/**
+ * The checkpoint is a memory mapped file holding our blocks and their
+ * leases, so a restarted daemon continues with the blocks it owned and the
+ * leases it handed out. Each of our blocks has a slot in the file, which is
+ * updated in place on every change. Updates are written to a small journal
+ * first, which is synced to disk before the record is changed, and replayed
+ * on startup. A crash of the daemon or the system in the middle of an update
+ * leaves no torn records behind, every update costs a synchronous write.
+ */
+
+/**
+ * Open the checkpoint file of config->checkpoint_path and adopt the node id
+ * stored in it. A file of another network configuration is started anew.
+ * Has to be called before ddhcp_block_init, does nothing without a path.
+ * Returns 0 on success and a negative error code otherwise.
+ */
+ATTR_NONNULL_ALL int checkpoint_open(ddhcp_config* config);
+
+/**
+ * Take the blocks of the checkpoint, which have not yet timed out, as ours
+ * together with their unexpired leases.
+ */
+ATTR_NONNULL_ALL void checkpoint_restore(ddhcp_config* config);
+
+/**
+ * Write the timeout of one of our blocks, a block without a slot gets one.
+ */
+ATTR_NONNULL_ALL void checkpoint_block(ddhcp_block* block, ddhcp_config* config);
+
+/**
+ * Drop a block, which is no longer ours, from the checkpoint.
+ */
+ATTR_NONNULL_ALL void checkpoint_drop(ddhcp_block* block, ddhcp_config* config);
+
+/**
+ * Write a lease of one of our blocks, chaddr is the full hardware address.
+ */
+ATTR_NONNULL_ALL void checkpoint_lease(ddhcp_block* block, uint32_t lease_index, enum dhcp_lease_state state, const uint8_t* chaddr, uint32_t xid, time_t lease_end, ddhcp_config* config);
+
+/**
+ * Flush the checkpoint to disk and close it. The blocks remain in the file
+ * for the next start.
+ */
+ATTR_NONNULL_ALL void checkpoint_close(ddhcp_config* config);
+
+#endif
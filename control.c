@@ -2,6 +2,7 @@
 #include "logger.h"
 #include "block.h"
 #include "dhcp_options.h"
+#include "peer.h"
 #include "statistics.h"
 
 extern int log_level;
@@ -26,6 +27,16 @@ ATTR_NONNULL_ALL int handle_command(int socket, uint8_t* buffer, ssize_t msglen,
     block_show_status(socket, config);
     return 0;
 
+  case DDHCPCTL_PEERS_SHOW:
+    if (msglen != 1) {
+      DEBUG("handle_command(...): message length mismatch\n");
+      return -2;
+    }
+
+    DEBUG("handle_command(...): show peers\n");
+    peer_show(socket, &config->peers);
+    return 0;
+
   case DDHCPCTL_DHCP_OPTIONS_SHOW:
     if (msglen != 1) {
       DEBUG("handle_command(...): message length mismatch\n");
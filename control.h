@@ -11,6 +11,7 @@ enum {
   DDHCPCTL_LOG_LEVEL_SET,
   DDHCPCTL_STATISTICS,
   DDHCPCTL_STATISTICS_RESET,
+  DDHCPCTL_PEERS_SHOW,
 };
 
 ATTR_NONNULL_ALL int handle_command(int socket, uint8_t* buffer, ssize_t msglen, ddhcp_config* config);
@@ -3,8 +3,11 @@
 #include "ddhcp.h"
 #include "dhcp.h"
 #include "logger.h"
+#include "peer.h"
+#include "pool.h"
 #include "tools.h"
 #include "statistics.h"
+#include "timer.h"
 
 ATTR_NONNULL_ALL int ddhcp_block_init(ddhcp_config* config) {
   DEBUG("ddhcp_block_init(config)\n");
@@ -14,43 +17,96 @@ ATTR_NONNULL_ALL int ddhcp_block_init(ddhcp_config* config) {
     return 1;
   }
 
-  config->blocks = (struct ddhcp_block*) calloc(sizeof(struct ddhcp_block), config->number_of_blocks);
+  // Pages of the block table are only allocated on first use, so the
+  // cost of a large prefix is limited to the page table and free block set.
+  config->number_of_block_pages = (config->number_of_blocks + DDHCP_BLOCK_PAGE_SIZE - 1) / DDHCP_BLOCK_PAGE_SIZE;
+  config->block_pages = (struct ddhcp_block_page**) calloc(sizeof(struct ddhcp_block_page*), config->number_of_block_pages);
 
-  if (!config->blocks) {
+  if (!config->block_pages) {
     FATAL("ddhcp_block_init(...): Can't allocate memory for block structure\n");
     return 1;
   }
 
-  time_t now = time(NULL);
+  INIT_LIST_HEAD(&config->idle_block_pages);
+  pool_init(&config->block_page_pool, sizeof(struct ddhcp_block_page));
+
+  for (int state = 0; state < DDHCP_BLOCK_STATES; state++) {
+    INIT_LIST_HEAD(&config->blocks_by_state[state]);
+    config->num_blocks_by_state[state] = 0;
+  }
+
+  config->num_blocks_by_state[DDHCP_FREE] = config->number_of_blocks;
+
+  if (block_free_set_init(config)) {
+    FATAL("ddhcp_block_init(...): Can't allocate memory for free block set\n");
+    free(config->block_pages);
+    return 1;
+  }
 
-  // TODO Maybe we should allocate number_of_blocks dhcp_lease_blocks previous
-  //      and assign one here instead of NULL. Performance boost, Memory defrag?
-  struct ddhcp_block* block = config->blocks;
-
-  for (uint32_t index = 0; index < config->number_of_blocks; index++) {
-    block->index = index;
-    block->state = DDHCP_FREE;
-    addr_add(&config->prefix, &block->subnet, (int)(index * config->block_size));
-    block->subnet_len = config->block_size;
-    memset(&block->owner_address, 0, sizeof(struct in6_addr));
-    block->timeout = now + config->block_timeout;
-    block->claiming_counts = 0;
-    block->addresses = NULL;
-    block++;
+  if (peer_table_init(&config->peers, config->node_id)) {
+    FATAL("ddhcp_block_init(...): Can't allocate memory for peer table\n");
+    block_free_set_free(config);
+    free(config->block_pages);
+    return 1;
   }
 
+  INIT_LIST_HEAD(&config->blocks_with_free_leases);
+  config->claim_refresh_start = 0;
+  config->claim_refresh_next = 0;
+  config->heartbeat_next = 0;
+  memset(&config->state_sync, 0, sizeof(ddhcp_state_sync));
+  config->claim_scratch = NULL;
+  config->claim_scratch_size = 0;
+  config->reannounce_blocks = NULL;
+  config->reannounce_count = 0;
+  config->reannounce_size = 0;
+  timer_queue_init(&config->block_timers);
+  timer_queue_init(&config->lease_timers);
+
+  pool_init(&config->lease_blocks, sizeof(struct dhcp_lease_block) + sizeof(struct dhcp_lease) * config->block_size);
+
+  if (config->lease_blocks_prealloc > 0) {
+    uint32_t prealloc = config->lease_blocks_prealloc;
+
+    if (prealloc > config->number_of_blocks) {
+      prealloc = config->number_of_blocks;
+    }
+
+    if (pool_reserve(&config->lease_blocks, prealloc)) {
+      WARNING("ddhcp_block_init(...): Failed to preallocate %u lease blocks\n", prealloc);
+    }
+  }
+
+  config->lease_epoch = time(NULL);
+  INIT_LIST_HEAD(&config->lease_hwaddrs);
+
   return 0;
 }
 
 ATTR_NONNULL_ALL void ddhcp_block_free(ddhcp_config* config) {
-  ddhcp_block* block = config->blocks;
+  for (uint32_t i = 0; i < config->number_of_block_pages; i++) {
+    ddhcp_block_page* page = config->block_pages[i];
 
-  for (uint32_t i = 0; i < config->number_of_blocks; i++) {
-    block_free(block++);
+    if (!page) {
+      continue;
+    }
+
+    for (uint32_t j = 0; j < DDHCP_BLOCK_PAGE_SIZE; j++) {
+      block_free(page->block + j, config);
+    }
   }
 
   block_free_claims(config);
-  free(config->blocks);
+  block_free_set_free(config);
+  pool_free(&config->lease_blocks);
+  timer_queue_free(&config->block_timers);
+  timer_queue_free(&config->lease_timers);
+  pool_free(&config->block_page_pool);
+  free(config->block_pages);
+  free(config->claim_scratch);
+  free(config->reannounce_blocks);
+  free(config->state_sync.seen);
+  peer_table_free(&config->peers);
 }
 
 ATTR_NONNULL_ALL int ddhcp_check_packet(struct ddhcp_mcast_packet* packet, ddhcp_config* config) {
@@ -72,115 +128,369 @@ ATTR_NONNULL_ALL void ddhcp_block_process(uint8_t* buffer, ssize_t len, struct s
     // Check if this packet is for our swarm
     if (ddhcp_check_packet(&packet, config)) {
       DEBUG("ddhcp_block_process(...): drop foreign packet before processing");
-      free(packet.payload);
       return;
     }
 
+    ddhcp_payload_iter payload;
+    packet_payload_iter_init(&packet, &payload);
+
     switch (packet.command) {
     case DDHCP_MSG_UPDATECLAIM:
+    case DDHCP_MSG_UPDATECLAIM_RANGE:
       statistics_record(config, STAT_MCAST_RECV_UPDATECLAIM, 1);
-      ddhcp_block_process_claims(&packet, config);
+      ddhcp_block_process_claims(&packet, &payload, config);
       break;
 
     case DDHCP_MSG_INQUIRE:
       statistics_record(config, STAT_MCAST_RECV_INQUIRE, 1);
-      ddhcp_block_process_inquire(&packet, config);
+      ddhcp_block_process_inquire(&packet, &payload, config);
+      break;
+
+    case DDHCP_MSG_STATEREQUEST:
+      ddhcp_state_respond(&packet, config);
       break;
 
     default:
       break;
     }
-
-    free(packet.payload);
   } else {
     DEBUG("ddhcp_block_process(...): epoll returned status %i\n", ret);
   }
 }
 
-ATTR_NONNULL_ALL void ddhcp_block_process_claims(struct ddhcp_mcast_packet* packet, ddhcp_config* config) {
+/**
+ * Process the claim of a single block, our blocks are defended by a re-announcement.
+ */
+ATTR_NONNULL_ALL static void _ddhcp_block_process_claim(uint32_t block_index, uint16_t timeout, time_t now, uint16_t peer, uint8_t* node_id, ddhcp_config* config) {
+  ddhcp_block* block = block_get(block_index, config);
+
+  if (!block) {
+    WARNING("ddhcp_block_process_claims(...): Failed to allocate block %i\n", block_index);
+    return;
+  }
+
+  if (block->state == DDHCP_OURS && NODE_ID_CMP(node_id, config->node_id) < 0) {
+    INFO("ddhcp_block_process_claims(...): node 0x%02x%02x%02x%02x%02x%02x%02x%02x claims our block %i\n", HEX_NODE_ID(node_id), block_index);
+    // TODO Decide when and if we reclaim this block
+    //      Which node has more leases in this block, ..., who has the better node_id.
+    // Unrelated from the above, the original concept is claiming the block now.
+    block_reannounce(block, config);
+    return;
+  }
+
+  // Notice the ownership, the peer table holds the connection details
+  // of the claiming node, we need to contact him for dhcp forwarding actions.
+  block_set_state(block, DDHCP_CLAIMED, config);
+  block_set_owner(block, peer, config);
+  block_set_timeout(block, now + timeout, config);
+
+  INFO("ddhcp_block_process_claims(...): node 0x%02x%02x%02x%02x%02x%02x%02x%02x claims block %i with TTL %i\n", HEX_NODE_ID(node_id), block_index, timeout);
+}
+
+ATTR_NONNULL_ALL void ddhcp_block_process_claims(struct ddhcp_mcast_packet* packet, ddhcp_payload_iter* claims, ddhcp_config* config) {
   DEBUG("ddhcp_block_process_claims(packet,config)\n");
 
-  assert(packet->command == 1);
+  assert(packet->command == DDHCP_MSG_UPDATECLAIM || packet->command == DDHCP_MSG_UPDATECLAIM_RANGE);
   time_t now = time(NULL);
+  struct ddhcp_payload claim;
+  uint16_t peer = peer_register(&config->peers, packet->node_id, &packet->sender->sin6_addr, now);
 
-  ddhcp_block* blocks = config->blocks;
+  if (peer == DDHCP_PEER_NONE) {
+    WARNING("ddhcp_block_process_claims(...): Failed to register node 0x%02x%02x%02x%02x%02x%02x%02x%02x\n", HEX_NODE_ID(packet->node_id));
+    return;
+  }
 
-  for (unsigned int i = 0; i < packet->count; i++) {
-    struct ddhcp_payload* claim = &packet->payload[i];
-    uint32_t block_index = claim->block_index;
+  // An update claim without any claims is a heartbeat.
+  if (packet->count == 0) {
+    DEBUG("ddhcp_block_process_claims(...): heartbeat of node 0x%02x%02x%02x%02x%02x%02x%02x%02x\n", HEX_NODE_ID(packet->node_id));
+    peer_get(&config->peers, peer)->heartbeat = 1;
+    return;
+  }
 
-    if (block_index >= config->number_of_blocks) {
+#if LOG_LEVEL_LIMIT >= LOG_DEBUG
+  char ipv6_sender[INET6_ADDRSTRLEN];
+  DEBUG("ddhcp_block_process_claims(...): Register blocks to %s\n",
+        inet_ntop(AF_INET6, &packet->sender->sin6_addr, ipv6_sender, INET6_ADDRSTRLEN));
+#endif
+
+  while (packet_payload_next(claims, &claim)) {
+    if (claim.block_index >= config->number_of_blocks || claim.length > config->number_of_blocks - claim.block_index) {
       WARNING("ddhcp_block_process_claims(...): Malformed block number\n");
       continue;
     }
 
-    if (blocks[block_index].state == DDHCP_OURS && NODE_ID_CMP(packet->node_id, config->node_id) < 0) {
-      INFO("ddhcp_block_process_claims(...): node 0x%02x%02x%02x%02x%02x%02x%02x%02x claims our block %i\n", HEX_NODE_ID(packet->node_id), block_index);
-      // TODO Decide when and if we reclaim this block
-      //      Which node has more leases in this block, ..., who has the better node_id.
-      // Unrelated from the above, the original concept is claiming the block now.
-      blocks[block_index].timeout = 0;
-      block_update_claims(config);
-    } else {
-      // Notice the ownership
-      blocks[block_index].state = DDHCP_CLAIMED;
-      blocks[block_index].timeout = now + claim->timeout;
-      // Save the connection details for the claiming node
-      // We need to contact him, for dhcp forwarding actions.
-      memcpy(&blocks[block_index].owner_address, &packet->sender->sin6_addr, sizeof(struct in6_addr));
-      memcpy(&blocks[block_index].node_id, &packet->node_id, sizeof(ddhcp_node_id));
-
-#if LOG_LEVEL_LIMIT >= LOG_DEBUG
-      char ipv6_sender[INET6_ADDRSTRLEN];
-      DEBUG("ddhcp_block_process_claims(...): Register block to %s\n",
-            inet_ntop(AF_INET6, &blocks[block_index].owner_address, ipv6_sender, INET6_ADDRSTRLEN));
-#endif
-
-      INFO("ddhcp_block_process_claims(...): node 0x%02x%02x%02x%02x%02x%02x%02x%02x claims block %i with TTL %i\n", HEX_NODE_ID(packet->node_id), block_index, claim->timeout);
+    for (uint32_t block_index = claim.block_index; block_index < claim.block_index + claim.length; block_index++) {
+      _ddhcp_block_process_claim(block_index, claim.timeout, now, peer, packet->node_id, config);
     }
   }
 }
 
-ATTR_NONNULL_ALL void ddhcp_block_process_inquire(struct ddhcp_mcast_packet* packet, ddhcp_config* config) {
+ATTR_NONNULL_ALL void ddhcp_block_process_inquire(struct ddhcp_mcast_packet* packet, ddhcp_payload_iter* inquiries, ddhcp_config* config) {
   DEBUG("ddhcp_block_process_inquire(packet,config)\n");
 
   assert(packet->command == 2);
   time_t now = time(NULL);
 
-  ddhcp_block* blocks = config->blocks;
+  // The inquiring node is alive, even if it does not own any blocks yet.
+  peer_register(&config->peers, packet->node_id, &packet->sender->sin6_addr, now);
 
-  for (unsigned int i = 0; i < packet->count; i++) {
-    struct ddhcp_payload* tmp = &packet->payload[i];
+  struct ddhcp_payload inquiry;
+  struct ddhcp_payload* tmp = &inquiry;
 
+  while (packet_payload_next(inquiries, &inquiry)) {
     if (tmp->block_index >= config->number_of_blocks) {
       WARNING("ddhcp_block_process_inquire(...): Malformed block number\n");
       continue;
     }
 
+    ddhcp_block* block = block_get(tmp->block_index, config);
+
+    if (!block) {
+      WARNING("ddhcp_block_process_inquire(...): Failed to allocate block %i\n", tmp->block_index);
+      continue;
+    }
+
     INFO("ddhcp_block_process_inquire(...): node 0x%02x%02x%02x%02x%02x%02x%02x%02x inquires block %i\n", HEX_NODE_ID(packet->node_id), tmp->block_index);
 
-    if (blocks[tmp->block_index].state == DDHCP_OURS) {
+    if (block->state == DDHCP_OURS) {
       // Update Claims
       INFO("ddhcp_block_process_inquire(...): block %i is ours, notify network\n", tmp->block_index);
-      blocks[tmp->block_index].timeout = 0;
-      block_update_claims(config);
-    } else if (blocks[tmp->block_index].state == DDHCP_CLAIMING) {
+      block_reannounce(block, config);
+    } else if (block->state == DDHCP_CLAIMING) {
       INFO("ddhcp_block_process_inquire(...): we are furthermore interested in block %i\n", tmp->block_index);
 
       // QUESTION Why do we need multiple states for the same process?
       if (NODE_ID_CMP(packet->node_id, config->node_id) > 0) {
         INFO("ddhcp_block_process_inquire(...): ... but other node wins.\n");
-        blocks[tmp->block_index].state = DDHCP_TENTATIVE;
-        blocks[tmp->block_index].timeout = now + config->tentative_timeout;
+        block_set_state(block, DDHCP_TENTATIVE, config);
+        block_set_timeout(block, now + config->tentative_timeout, config);
       }
 
       // otherwise keep inquiring, the other node should see our inquires and step back.
     } else {
       INFO("ddhcp_block_process_inquire(...): set block %i to tentative\n", tmp->block_index);
-      blocks[tmp->block_index].state = DDHCP_TENTATIVE;
-      blocks[tmp->block_index].timeout = now + config->tentative_timeout;
+      block_set_state(block, DDHCP_TENTATIVE, config);
+      block_set_timeout(block, now + config->tentative_timeout, config);
+    }
+  }
+}
+
+ATTR_NONNULL_ALL void ddhcp_state_request(ddhcp_config* config) {
+  ddhcp_state_sync* sync = &config->state_sync;
+  time_t now = time(NULL);
+
+  if (sync->requests >= DDHCP_STATE_REQUESTS || now < sync->next_request) {
+    return;
+  }
+
+  // A new nonce invalidates the answers to former requests.
+  sync->nonce = (uint32_t) rand();
+  sync->has_responder = 0;
+  sync->total = 0;
+  sync->received = 0;
+  free(sync->seen);
+  sync->seen = NULL;
+
+  DEBUG("ddhcp_state_request(config): request %i with nonce %u\n", sync->requests, sync->nonce);
+  ddhcp_epoll_data* socket = DDHCP_SKT_MCAST(config);
+
+  // The number of the request widens the set of nodes, which answer it.
+  packet_tx_begin(socket, DDHCP_MSG_STATEREQUEST, config);
+  packet_tx_state_header(socket, sync->nonce, sync->requests, 0);
+  statistics_record(config, STAT_MCAST_SEND_PKG, 1);
+  ssize_t bytes_send = packet_tx_send_mcast(socket);
+  statistics_record(config, STAT_MCAST_SEND_BYTE, (long int) bytes_send);
+  UNUSED(bytes_send);
+
+  sync->requests++;
+  sync->next_request = now + 1;
+}
+
+/**
+ * Decide whether we are among the nodes answering a state request, the
+ * choice depends on the requesting node, the nonce and our node id.
+ * Only peers sending heartbeats are known to be alive and to answer.
+ */
+ATTR_NONNULL_ALL static int _ddhcp_state_responder(struct ddhcp_mcast_packet* packet, ddhcp_config* config) {
+  // The last request is answered by every node.
+  if (packet->state.seq >= DDHCP_STATE_REQUESTS - 1) {
+    return 1;
+  }
+
+  ddhcp_peer_table* table = &config->peers;
+  uint32_t alive = 1;
+
+  for (uint32_t i = DDHCP_PEER_SELF + 1; i < table->size; i++) {
+    if (table->peers[i] && table->peers[i]->heartbeat) {
+      alive++;
+    }
+  }
+
+  uint64_t key;
+  uint64_t requester;
+  memcpy(&key, config->node_id, sizeof(key));
+  memcpy(&requester, packet->node_id, sizeof(requester));
+
+  key = (key ^ requester ^ packet->state.nonce) * 0x9E3779B97F4A7C15ull;
+
+  // About two nodes answer the first request, twice as many the next one.
+  uint32_t responders = 2u << packet->state.seq;
+
+  return (uint32_t)(key >> 32) % alive < responders;
+}
+
+ATTR_NONNULL_ALL void ddhcp_state_respond(struct ddhcp_mcast_packet* packet, ddhcp_config* config) {
+  DEBUG("ddhcp_state_respond(packet,config)\n");
+
+  // A node without a complete block table has nothing to tell.
+  if (config->learning_phase || !_ddhcp_state_responder(packet, config)) {
+    return;
+  }
+
+  time_t now = time(NULL);
+  peer_register(&config->peers, packet->node_id, &packet->sender->sin6_addr, now);
+
+  ddhcp_epoll_data* socket = DDHCP_SKT_SERVER(config);
+  uint32_t max_entries = packet_max_payload(DDHCP_MSG_STATE, socket);
+  uint32_t num_entries = config->num_blocks_by_state[DDHCP_OURS] + config->num_blocks_by_state[DDHCP_CLAIMED];
+  uint32_t total = (num_entries + max_entries - 1) / max_entries;
+
+  if (total == 0) {
+    total = 1;
+  } else if (total > UINT16_MAX) {
+    WARNING("ddhcp_state_respond(...): Too many blocks for a state answer\n");
+    return;
+  }
+
+  INFO("ddhcp_state_respond(...): send %i blocks in %i messages to node 0x%02x%02x%02x%02x%02x%02x%02x%02x\n", num_entries, total, HEX_NODE_ID(packet->node_id));
+
+  // Our own blocks are sent with an unspecified address, the requesting
+  // node knows ours from the sender of the message.
+  struct in6_addr unspecified = IN6ADDR_ANY_INIT;
+  uint16_t seq = 0;
+  uint8_t states[] = { DDHCP_OURS, DDHCP_CLAIMED };
+
+  packet_tx_begin(socket, DDHCP_MSG_STATE, config);
+  packet_tx_state_header(socket, packet->state.nonce, seq, (uint16_t) total);
+
+  for (uint32_t i = 0; i < sizeof(states); i++) {
+    ddhcp_block* block;
+
+    list_for_each_entry(block, &config->blocks_by_state[states[i]], state_list) {
+      if (packet_tx_count(socket) == max_entries) {
+        packet_tx_send_direct(socket, &packet->sender->sin6_addr);
+        packet_tx_begin(socket, DDHCP_MSG_STATE, config);
+        packet_tx_state_header(socket, packet->state.nonce, ++seq, (uint16_t) total);
+      }
+
+      if (block->state == DDHCP_OURS) {
+        packet_tx_add_state(socket, block->index, config->block_timeout, config->node_id, &unspecified);
+      } else {
+        ddhcp_peer* owner = block_owner(block, config);
+        time_t timeout = block->timeout - now;
+
+        if (timeout > UINT16_MAX) {
+          timeout = UINT16_MAX;
+        } else if (timeout < 1) {
+          timeout = 1;
+        }
+
+        packet_tx_add_state(socket, block->index, (uint16_t) timeout, owner->node_id, &owner->address);
+      }
     }
   }
+
+  packet_tx_send_direct(socket, &packet->sender->sin6_addr);
+}
+
+ATTR_NONNULL_ALL void ddhcp_state_process(struct ddhcp_mcast_packet* packet, ddhcp_config* config) {
+  DEBUG("ddhcp_state_process(packet,config)\n");
+  ddhcp_state_sync* sync = &config->state_sync;
+
+  if (!config->learning_phase || packet->state.nonce != sync->nonce || sync->requests == 0) {
+    DEBUG("ddhcp_state_process(...): drop unrequested state\n");
+    return;
+  }
+
+  if (packet->state.total == 0 || packet->state.seq >= packet->state.total) {
+    WARNING("ddhcp_state_process(...): Malformed state message\n");
+    return;
+  }
+
+  // Only the state of a single node is consistent, the first one
+  // answering wins.
+  if (!sync->has_responder) {
+    sync->seen = (uint8_t*) calloc((size_t)(packet->state.total + 7) / 8, sizeof(uint8_t));
+
+    if (!sync->seen) {
+      WARNING("ddhcp_state_process(...): Failed to allocate memory\n");
+      return;
+    }
+
+    memcpy(sync->responder, packet->node_id, sizeof(ddhcp_node_id));
+    sync->has_responder = 1;
+    sync->total = packet->state.total;
+    sync->received = 0;
+  } else if (NODE_ID_CMP(sync->responder, packet->node_id) != 0 || packet->state.total != sync->total) {
+    return;
+  }
+
+  uint16_t seq = packet->state.seq;
+
+  if (sync->seen[seq / 8] & (1 << (seq % 8))) {
+    return;
+  }
+
+  time_t now = time(NULL);
+  ddhcp_payload_iter entries;
+  struct ddhcp_state_entry entry;
+  packet_payload_iter_init(packet, &entries);
+
+  while (packet_state_next(&entries, &entry)) {
+    if (entry.block_index >= config->number_of_blocks) {
+      WARNING("ddhcp_state_process(...): Malformed block number\n");
+      continue;
+    }
+
+    if (NODE_ID_CMP(entry.node_id, config->node_id) == 0) {
+      continue;
+    }
+
+    ddhcp_block* block = block_get(entry.block_index, config);
+
+    if (!block) {
+      WARNING("ddhcp_state_process(...): Failed to allocate block %i\n", entry.block_index);
+      continue;
+    }
+
+    // Blocks we are about to claim ourselves are settled by the claim process.
+    if (block->state == DDHCP_OURS || block->state == DDHCP_CLAIMING) {
+      continue;
+    }
+
+    if (IN6_IS_ADDR_UNSPECIFIED(&entry.address)) {
+      memcpy(&entry.address, &packet->sender->sin6_addr, sizeof(struct in6_addr));
+    }
+
+    uint16_t peer = peer_register(&config->peers, entry.node_id, &entry.address, now);
+
+    if (peer == DDHCP_PEER_NONE) {
+      WARNING("ddhcp_state_process(...): Failed to register node 0x%02x%02x%02x%02x%02x%02x%02x%02x\n", HEX_NODE_ID(entry.node_id));
+      continue;
+    }
+
+    _ddhcp_block_process_claim(entry.block_index, entry.timeout, now, peer, entry.node_id, config);
+  }
+
+  sync->seen[seq / 8] |= (uint8_t)(1 << (seq % 8));
+  sync->received++;
+
+  if (sync->received == sync->total) {
+    INFO("ddhcp_state_process(...): received the state of node 0x%02x%02x%02x%02x%02x%02x%02x%02x, end learning phase\n", HEX_NODE_ID(sync->responder));
+    config->learning_phase = 0;
+    free(sync->seen);
+    sync->seen = NULL;
+  }
 }
 
 ATTR_NONNULL_ALL void ddhcp_dhcp_process(uint8_t* buffer, ssize_t len, struct sockaddr_in6 sender, ddhcp_config* config) {
@@ -192,7 +502,6 @@ ATTR_NONNULL_ALL void ddhcp_dhcp_process(uint8_t* buffer, ssize_t len, struct so
     // Check if this packet is for our swarm
     if (ddhcp_check_packet(&packet, config)) {
       DEBUG("ddhcp_dhcp_process(...): drop foreign packet before processing");
-      free(packet.renew_payload);
       return;
     }
 
@@ -217,6 +526,10 @@ ATTR_NONNULL_ALL void ddhcp_dhcp_process(uint8_t* buffer, ssize_t len, struct so
       ddhcp_dhcp_release(&packet, config);
       break;
 
+    case DDHCP_MSG_STATE:
+      ddhcp_state_process(&packet, config);
+      break;
+
     default:
       break;
     }
@@ -227,22 +540,22 @@ ATTR_NONNULL_ALL void ddhcp_dhcp_renewlease(struct ddhcp_mcast_packet* packet, d
   DEBUG("ddhcp_dhcp_renewlease(request,config)\n");
 
 #if LOG_LEVEL_LIMIT >= LOG_DEBUG
-  char* hwaddr = hwaddr2c(packet->renew_payload->chaddr);
-  DEBUG("ddhcp_dhcp_renewlease(...): Request for xid: %u chaddr: %s\n", packet->renew_payload->xid, hwaddr);
+  char* hwaddr = hwaddr2c(packet->renew_payload.chaddr);
+  DEBUG("ddhcp_dhcp_renewlease(...): Request for xid: %u chaddr: %s\n", packet->renew_payload.xid, hwaddr);
   free(hwaddr);
 #endif
 
-  int ret = dhcp_rhdl_request(&(packet->renew_payload->address), config);
+  int ret = dhcp_rhdl_request(&packet->renew_payload.address, config);
 
-  ddhcp_mcast_packet* answer = NULL;
+  ddhcp_epoll_data* socket = DDHCP_SKT_SERVER(config);
 
   if (ret == 0) {
     DEBUG("ddhcp_dhcp_renewlease(...): %i ACK\n", ret);
-    answer = new_ddhcp_packet(DDHCP_MSG_LEASEACK, config);
+    packet_tx_begin(socket, DDHCP_MSG_LEASEACK, config);
     statistics_record(config, STAT_DIRECT_SEND_LEASEACK, 1);
   } else if (ret == 1) {
     DEBUG("ddhcp_dhcp_renewlease(...): %i NAK\n", ret);
-    answer = new_ddhcp_packet(DDHCP_MSG_LEASENAK, config);
+    packet_tx_begin(socket, DDHCP_MSG_LEASENAK, config);
     statistics_record(config, STAT_DIRECT_SEND_LEASENAK, 1);
     // TODO Can we hand over the block?
   } else {
@@ -251,20 +564,12 @@ ATTR_NONNULL_ALL void ddhcp_dhcp_renewlease(struct ddhcp_mcast_packet* packet, d
     return;
   }
 
-  if (!answer) {
-    WARNING("ddhcp_dhcp_renewlease(...): Failed to allocate memory for ddhcpd mcast packet.\n");
-    return;
-  }
-
-  answer->renew_payload = packet->renew_payload;
+  packet_tx_add_renew(socket, &packet->renew_payload);
 
   statistics_record(config, STAT_DIRECT_SEND_PKG, 1);
-  ssize_t bytes_send = send_packet_direct(answer, &packet->sender->sin6_addr, DDHCP_SKT_SERVER(config));
+  ssize_t bytes_send = packet_tx_send_direct(socket, &packet->sender->sin6_addr);
   statistics_record(config, STAT_DIRECT_SEND_BYTE, (long int) bytes_send);
   UNUSED(bytes_send);
-
-  free(answer->renew_payload);
-  free(answer);
 }
 
 ATTR_NONNULL_ALL void ddhcp_dhcp_leaseack(struct ddhcp_mcast_packet* request, ddhcp_config* config) {
@@ -272,24 +577,22 @@ ATTR_NONNULL_ALL void ddhcp_dhcp_leaseack(struct ddhcp_mcast_packet* request, dd
   DEBUG("ddhcp_dhcp_leaseack(request,config)\n");
 
 #if LOG_LEVEL_LIMIT >= LOG_DEBUG
-  char* hwaddr = hwaddr2c(request->renew_payload->chaddr);
-  DEBUG("ddhcp_dhcp_leaseack(...): ACK for xid: %u chaddr: %s\n", request->renew_payload->xid, hwaddr);
+  char* hwaddr = hwaddr2c(request->renew_payload.chaddr);
+  DEBUG("ddhcp_dhcp_leaseack(...): ACK for xid: %u chaddr: %s\n", request->renew_payload.xid, hwaddr);
   free(hwaddr);
 #endif
 
-  dhcp_packet* packet = dhcp_packet_list_find(&config->dhcp_packet_cache, request->renew_payload->xid, request->renew_payload->chaddr);
+  dhcp_packet* packet = dhcp_packet_list_find(&config->dhcp_packet_cache, request->renew_payload.xid, request->renew_payload.chaddr);
 
   if (!packet) {
     // Ignore packet
     DEBUG("ddhcp_dhcp_leaseack(...): No matching packet found, message ignored\n");
   } else {
     // Process packet
-    dhcp_rhdl_ack(DDHCP_SKT_DHCP(config)->fd, packet, config);
+    dhcp_rhdl_ack(DDHCP_SKT_DHCP(config), packet, config);
     dhcp_packet_free(packet, 1);
     free(packet);
   }
-
-  free(request->renew_payload);
 }
 
 ATTR_NONNULL_ALL void ddhcp_dhcp_leasenak(struct ddhcp_mcast_packet* request, ddhcp_config* config) {
@@ -297,28 +600,25 @@ ATTR_NONNULL_ALL void ddhcp_dhcp_leasenak(struct ddhcp_mcast_packet* request, dd
   DEBUG("ddhcp_dhcp_leasenak(request,config)\n");
 
 #if LOG_LEVEL_LIMIT >= LOG_DEBUG
-  char* hwaddr = hwaddr2c(request->renew_payload->chaddr);
-  DEBUG("ddhcp_dhcp_leaseack(...): NAK for xid: %u chaddr: %s\n", request->renew_payload->xid, hwaddr);
+  char* hwaddr = hwaddr2c(request->renew_payload.chaddr);
+  DEBUG("ddhcp_dhcp_leaseack(...): NAK for xid: %u chaddr: %s\n", request->renew_payload.xid, hwaddr);
   free(hwaddr);
 #endif
 
-  dhcp_packet* packet = dhcp_packet_list_find(&config->dhcp_packet_cache, request->renew_payload->xid, request->renew_payload->chaddr);
+  dhcp_packet* packet = dhcp_packet_list_find(&config->dhcp_packet_cache, request->renew_payload.xid, request->renew_payload.chaddr);
 
   if (!packet) {
     // Ignore packet
     DEBUG("ddhcp_dhcp_leaseack(...): No matching packet found, message ignored\n");
   } else {
     // Process packet
-    dhcp_nack(DDHCP_SKT_DHCP(config)->fd, packet, config);
+    dhcp_nack(DDHCP_SKT_DHCP(config), packet, config);
     dhcp_packet_free(packet, 1);
     free(packet);
   }
-
-  free(request->renew_payload);
 }
 
 ATTR_NONNULL_ALL void ddhcp_dhcp_release(struct ddhcp_mcast_packet* packet, ddhcp_config* config) {
   DEBUG("ddhcp_dhcp_release(packet,config)\n");
-  dhcp_release_lease(packet->renew_payload->address, config);
-  free(packet->renew_payload);
+  dhcp_release_lease(packet->renew_payload.address, config);
 }
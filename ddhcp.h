@@ -21,15 +21,37 @@ ATTR_NONNULL_ALL void ddhcp_block_free(ddhcp_config* config);
  */
 ATTR_NONNULL_ALL void ddhcp_block_process(uint8_t* buffer, ssize_t len, struct sockaddr_in6 sender, ddhcp_config* config);
 /**
- * A node sends a claim message for each block he thinks he owns, handling these
- * message is handled in ddhcp_block_process_claims.
+ * A node sends a claim message for each block he thinks he owns, or a range
+ * claim for runs of adjacent blocks, handling these message is handled in
+ * ddhcp_block_process_claims. The claims are read with an iterator from the
+ * receive buffer.
  */
-ATTR_NONNULL_ALL void ddhcp_block_process_claims(struct ddhcp_mcast_packet* packet, ddhcp_config* config);
+ATTR_NONNULL_ALL void ddhcp_block_process_claims(struct ddhcp_mcast_packet* packet, ddhcp_payload_iter* claims, ddhcp_config* config);
 /**
  * Before claiming a block, a node inquires that block three times, by sending
  * an inquire message. Handling these messages is done in ddhcp_block_process_inquire.
  */
-ATTR_NONNULL_ALL void ddhcp_block_process_inquire(struct ddhcp_mcast_packet* packet, ddhcp_config* config);
+ATTR_NONNULL_ALL void ddhcp_block_process_inquire(struct ddhcp_mcast_packet* packet, ddhcp_payload_iter* inquiries, ddhcp_config* config);
+
+// Number of state requests sent, before we fall back to listening.
+#define DDHCP_STATE_REQUESTS 3
+
+/**
+ * A starting node requests the block table from the network instead of
+ * listening for a whole block timeout. The request is multicast, only a few
+ * nodes selected by the nonce answer with a series of unicast state messages.
+ * The learning phase ends, once the state of one node is complete.
+ * ddhcp_state_request sends the next request, when it is due.
+ */
+ATTR_NONNULL_ALL void ddhcp_state_request(ddhcp_config* config);
+/**
+ * Answer a state request with our block table.
+ */
+ATTR_NONNULL_ALL void ddhcp_state_respond(struct ddhcp_mcast_packet* packet, ddhcp_config* config);
+/**
+ * Take the blocks of a state message into our block table.
+ */
+ATTR_NONNULL_ALL void ddhcp_state_process(struct ddhcp_mcast_packet* packet, ddhcp_config* config);
 
 /**
  * ddhcp_dhcp_process is part of the network message processing chain.
@@ -33,7 +33,7 @@ int main(int argc, char** argv) {
     exit(1);
   }
 
-  while ((c = getopt(argc, argv, "bC:dhl:o:r:sSt:v:V")) != -1) {
+  while ((c = getopt(argc, argv, "bC:dhl:o:pr:sSt:v:V")) != -1) {
     switch (c) {
     case 'h':
       show_usage = 1;
@@ -45,6 +45,12 @@ int main(int argc, char** argv) {
       buffer[0] = (uint8_t) DDHCPCTL_BLOCK_SHOW;
       break;
 
+    case 'p':
+      // show peers
+      msglen = 1;
+      buffer[0] = (uint8_t) DDHCPCTL_PEERS_SHOW;
+      break;
+
     case 'd':
       // show dhcp
       msglen = 1;
@@ -115,11 +121,12 @@ int main(int argc, char** argv) {
   }
 
   if (show_usage) {
-    printf("Usage: ddhcpctl [-h|-V|-b|-d|-o <option>|-C PATH|-l TIMEOUT|-v VERBOSITY]\n");
+    printf("Usage: ddhcpctl [-h|-V|-b|-p|-d|-o <option>|-C PATH|-l TIMEOUT|-v VERBOSITY]\n");
     printf("\n");
     printf("-h                     This usage information.\n");
     printf("-V                     Print build revision\n");
     printf("-b                     Show current block usage.\n");
+    printf("-p                     Show the nodes seen in the network.\n");
     printf("-d                     Show the current dhcp options store.\n");
     printf("-l TIMEOUT             Set the dhcp lease time.\n");
     printf("-o CODE:LEN:P1. .. .Pn Set DHCP Option with code,len and #len chars in decimal\n");
@@ -0,0 +1,65 @@
+#include "demand.h"
+
+#include <math.h>
+
+#include "logger.h"
+
+// Time constant of the moving average in seconds.
+#define DEMAND_RATE_TAU 60.0
+// Number of days the hour of day history averages over.
+#define DEMAND_HISTORY_DAYS 7.0
+#define DEMAND_SLOT_SECONDS (86400 / DEMAND_HISTORY_SLOTS)
+
+// Cap on the expected leases, so a bogus rate can not claim the network.
+#define DEMAND_EXPECTED_MAX 4096
+
+#define _demand_slot(time) ((uint32_t)(((time) % 86400) / DEMAND_SLOT_SECONDS))
+
+ATTR_NONNULL_ALL void demand_init(ddhcp_demand* demand, time_t now) {
+  demand->arrivals = 0;
+  demand->sampled = now;
+  demand->rate = 0.0;
+
+  for (uint32_t i = 0; i < DEMAND_HISTORY_SLOTS; i++) {
+    demand->history[i] = 0.0;
+  }
+}
+
+ATTR_NONNULL_ALL void demand_sample(ddhcp_demand* demand, time_t now) {
+  if (now <= demand->sampled) {
+    // Keep the arrivals for the next sample.
+    return;
+  }
+
+  double elapsed = (double)(now - demand->sampled);
+  double rate = demand->arrivals / elapsed;
+
+  // The weight of a sample grows with its length, so the average does not
+  // depend on how often house keeping runs.
+  demand->rate += (rate - demand->rate) * (1.0 - exp(-elapsed / DEMAND_RATE_TAU));
+
+  double* slot = &demand->history[_demand_slot(now)];
+  double weight = fmin(elapsed / (DEMAND_SLOT_SECONDS * DEMAND_HISTORY_DAYS), 1.0);
+  *slot += (demand->rate - *slot) * weight;
+
+  DEBUG("demand_sample(demand,now): %u leases in %.0fs, rate %.3f/s, hour %.3f/s\n", demand->arrivals, elapsed, demand->rate, *slot);
+
+  demand->arrivals = 0;
+  demand->sampled = now;
+}
+
+ATTR_NONNULL_ALL uint32_t demand_expected(ddhcp_demand* demand, time_t now, time_t horizon) {
+  // Expect the higher of the current rate and the usual rate of the hours
+  // the horizon covers.
+  double rate = demand->rate;
+  rate = fmax(rate, demand->history[_demand_slot(now)]);
+  rate = fmax(rate, demand->history[_demand_slot(now + horizon)]);
+
+  double expected = ceil(rate * (double)horizon);
+
+  if (expected > DEMAND_EXPECTED_MAX) {
+    return DEMAND_EXPECTED_MAX;
+  }
+
+  return (uint32_t)expected;
+}
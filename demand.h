@@ -0,0 +1,38 @@
+#ifndef _DEMAND_H
+#define _DEMAND_H
+
+#include "types.h"
+
+/**
+ * The demand estimator tracks the rate at which leases are handed out as an
+ * exponentially weighted moving average. Additionally the rate of every hour
+ * of the day is averaged over several days, so recurring peaks are
+ * anticipated before they start.
+ */
+
+/**
+ * Initialise an estimator without any observed demand.
+ */
+ATTR_NONNULL_ALL void demand_init(ddhcp_demand* demand, time_t now);
+
+/**
+ * Record leases handed out to clients.
+ */
+#define demand_record(demand, leases) ((demand)->arrivals += (leases))
+
+/**
+ * Fold the leases recorded since the last sample into the averages.
+ */
+ATTR_NONNULL_ALL void demand_sample(ddhcp_demand* demand, time_t now);
+
+/**
+ * Expected number of leases handed out within the next horizon seconds.
+ */
+ATTR_NONNULL_ALL uint32_t demand_expected(ddhcp_demand* demand, time_t now, time_t horizon);
+
+/**
+ * Current estimate in leases per minute, for status output.
+ */
+#define demand_per_minute(demand) ((demand)->rate * 60.0)
+
+#endif
@@ -3,31 +3,38 @@
 #include <string.h>
 
 #include "block.h"
+#include "checkpoint.h"
+#include "demand.h"
 #include "dhcp.h"
 #include "dhcp_options.h"
 #include "hook.h"
 #include "logger.h"
 #include "packet.h"
 #include "statistics.h"
+#include "timer.h"
 #include "tools.h"
 
 // Free an offered lease after 12 seconds.
 uint16_t DHCP_OFFER_TIMEOUT = 12;
 uint16_t DHCP_LEASE_SERVER_DELTA = 10;
+// Park at most 64 DISCOVERs while we are out of free leases.
+uint16_t DHCP_DISCOVER_QUEUE_MAX = 64;
 
 #if LOG_LEVEL_LIMIT >= LOG_DEBUG
 #define DEBUG_DHCP_LEASE(...) do { \
-  DEBUG("DHCP LEASE [ state %i, xid %u, end %i ]\n",lease->state,lease->xid,lease->lease_end);\
+  DEBUG("DHCP LEASE [ xid %u, end %u ]\n",lease->xid,lease->lease_end);\
 } while (0);
 #else
 #define DEBUG_LEASE(...)
 #endif
 
+static const uint8_t dhcp_no_chaddr[16] = {0};
+
 /**
  * Search for block and lease for given address, returns a status code and found
  * results.
  * A status code of 0 is returned, iff the result is in one of our blocks.
- * Of 1, iff result is non in our blocks.
+ * Of 1, iff result is non in our blocks, the block is NULL if it was never used.
  * And 2 on failure.
  */
 ATTR_NONNULL(1,2) uint8_t find_lease_from_address(struct in_addr* addr, ddhcp_config* config, ddhcp_block** lease_block, uint32_t* lease_index) {
@@ -35,26 +42,27 @@ ATTR_NONNULL(1,2) uint8_t find_lease_from_address(struct in_addr* addr, ddhcp_co
   DEBUG("find_lease_from_address(%s, ...)\n", inet_ntoa(*addr));
 #endif
 
-  ddhcp_block* blocks = config->blocks;
   uint32_t address = (uint32_t) addr->s_addr;
 
   uint32_t block_number = (ntohl(address) - ntohl((uint32_t) config->prefix.s_addr)) / config->block_size;
   uint32_t lease_number = (ntohl(address) - ntohl((uint32_t) config->prefix.s_addr)) % config->block_size;
 
   if (block_number < config->number_of_blocks) {
-    DEBUG("find_lease_from_address(...): found block %i and lease %i with state %i\n", block_number, lease_number, blocks[block_number].state);
+    // A block without a page of the block table is FREE.
+    ddhcp_block* block = block_lookup(block_number, config);
+    enum ddhcp_block_state state = block ? block->state : DDHCP_FREE;
+
+    DEBUG("find_lease_from_address(...): found block %i and lease %i with state %i\n", block_number, lease_number, state);
 
     if (lease_block) {
-      *lease_block = blocks + block_number;
+      *lease_block = block;
     }
 
     if (lease_index) {
       *lease_index = lease_number;
     }
 
-    DEBUG("find_lease_from_address(...): state: %i\n", blocks[block_number].state);
-
-    if (blocks[block_number].state == DDHCP_OURS) {
+    if (state == DDHCP_OURS) {
       return 0;
     } else {
       // TODO Try to aquire address for client
@@ -67,16 +75,190 @@ ATTR_NONNULL(1,2) uint8_t find_lease_from_address(struct in_addr* addr, ddhcp_co
   return 2;
 }
 
-ATTR_NONNULL_ALL static void _dhcp_release_lease(ddhcp_block* block, uint32_t lease_index) {
+ATTR_NONNULL_ALL static enum dhcp_lease_state _dhcp_lease_state(ddhcp_block* block, uint32_t lease_index) {
+  dhcp_lease_block* leases = block->addresses;
+  uint64_t bit = (uint64_t) 1 << (lease_index % 64);
+  uint32_t word = lease_index / 64;
+
+  if (leases->bitmap[FREE][word] & bit) {
+    return FREE;
+  } else if (leases->bitmap[OFFERED][word] & bit) {
+    return OFFERED;
+  }
+
+  return LEASED;
+}
+
+ATTR_NONNULL_ALL static void _dhcp_set_lease_state(ddhcp_block* block, uint32_t lease_index, enum dhcp_lease_state state, ddhcp_config* config) {
+  dhcp_lease_block* leases = block->addresses;
+  enum dhcp_lease_state old_state = _dhcp_lease_state(block, lease_index);
+  uint64_t bit = (uint64_t) 1 << (lease_index % 64);
+  uint32_t word = lease_index / 64;
+
+  leases->bitmap[old_state][word] &= ~bit;
+  leases->num[old_state]--;
+
+  leases->bitmap[state][word] |= bit;
+  leases->num[state]++;
+
+  block_update_free_leases(block, config);
+}
+
+ATTR_NONNULL_ALL static dhcp_lease_hwaddr* _dhcp_find_hwaddr(ddhcp_block* block, uint32_t lease_index, ddhcp_config* config) {
+  dhcp_lease_hwaddr* hwaddr;
+
+  list_for_each_entry(hwaddr, &config->lease_hwaddrs, hwaddr_list) {
+    if (hwaddr->block_index == block->index && hwaddr->lease_index == lease_index) {
+      return hwaddr;
+    }
+  }
+
+  return NULL;
+}
+
+/**
+ * Store the hardware address of a client in a lease. Addresses longer than
+ * DHCP_LEASE_HWADDR_LEN are put into the side table of the config.
+ */
+ATTR_NONNULL_ALL static int _dhcp_set_lease_chaddr(ddhcp_block* block, uint32_t lease_index, const uint8_t* chaddr, ddhcp_config* config) {
+  dhcp_lease_block* leases = block->addresses;
+  uint64_t bit = (uint64_t) 1 << (lease_index % 64);
+  uint32_t word = lease_index / 64;
+  uint8_t is_long = memcmp(chaddr + DHCP_LEASE_HWADDR_LEN, dhcp_no_chaddr, 16 - DHCP_LEASE_HWADDR_LEN) != 0;
+  dhcp_lease_hwaddr* hwaddr = NULL;
+
+  memcpy(leases->lease[lease_index].chaddr, chaddr, DHCP_LEASE_HWADDR_LEN);
+
+  if (leases->long_hwaddr[word] & bit) {
+    hwaddr = _dhcp_find_hwaddr(block, lease_index, config);
+
+    if (hwaddr && !is_long) {
+      list_del(&hwaddr->hwaddr_list);
+      free(hwaddr);
+      hwaddr = NULL;
+    }
+  }
+
+  if (is_long && !hwaddr) {
+    hwaddr = (dhcp_lease_hwaddr*) calloc(sizeof(dhcp_lease_hwaddr), 1);
+
+    if (!hwaddr) {
+      WARNING("dhcp_set_lease_chaddr(...): Failed to allocate memory for hardware address\n");
+      leases->long_hwaddr[word] &= ~bit;
+      return -ENOMEM;
+    }
+
+    hwaddr->block_index = block->index;
+    hwaddr->lease_index = lease_index;
+    list_add(&hwaddr->hwaddr_list, &config->lease_hwaddrs);
+  }
+
+  if (is_long) {
+    memcpy(hwaddr->chaddr, chaddr, 16);
+    leases->long_hwaddr[word] |= bit;
+  } else {
+    leases->long_hwaddr[word] &= ~bit;
+  }
+
+  return 0;
+}
+
+/**
+ * Compare the hardware address stored in a lease with the given one,
+ * returns 0 iff they are equal.
+ */
+ATTR_NONNULL_ALL static int _dhcp_lease_chaddr_cmp(ddhcp_block* block, uint32_t lease_index, const uint8_t* chaddr, ddhcp_config* config) {
+  dhcp_lease_block* leases = block->addresses;
+
+  if (leases->long_hwaddr[lease_index / 64] & ((uint64_t) 1 << (lease_index % 64))) {
+    dhcp_lease_hwaddr* hwaddr = _dhcp_find_hwaddr(block, lease_index, config);
+    return hwaddr ? memcmp(hwaddr->chaddr, chaddr, 16) : 1;
+  }
+
+  if (memcmp(leases->lease[lease_index].chaddr, chaddr, DHCP_LEASE_HWADDR_LEN) != 0) {
+    return 1;
+  }
+
+  return memcmp(chaddr + DHCP_LEASE_HWADDR_LEN, dhcp_no_chaddr, 16 - DHCP_LEASE_HWADDR_LEN);
+}
+
+ATTR_NONNULL_ALL void dhcp_free_hwaddrs(ddhcp_block* block, ddhcp_config* config) {
+  dhcp_lease_block* leases = block->addresses;
+  uint8_t has_long = 0;
+
+  for (uint32_t word = 0; word < DHCP_LEASE_BITMAP_WORDS; word++) {
+    has_long |= leases->long_hwaddr[word] != 0;
+    leases->long_hwaddr[word] = 0;
+  }
+
+  if (!has_long) {
+    return;
+  }
+
+  dhcp_lease_hwaddr* hwaddr, *next;
+
+  list_for_each_entry_safe(hwaddr, next, &config->lease_hwaddrs, hwaddr_list) {
+    if (hwaddr->block_index == block->index) {
+      list_del(&hwaddr->hwaddr_list);
+      free(hwaddr);
+    }
+  }
+}
+
+/**
+ * Write a lease of one of our blocks to the checkpoint.
+ */
+ATTR_NONNULL_ALL static void _dhcp_checkpoint_lease(ddhcp_block* block, uint32_t lease_index, ddhcp_config* config) {
+  if (block->checkpoint_slot == 0) {
+    return;
+  }
+
+  dhcp_lease* lease = block->addresses->lease + lease_index;
+  uint8_t chaddr[16] = {0};
+
+  if (block->addresses->long_hwaddr[lease_index / 64] & ((uint64_t) 1 << (lease_index % 64))) {
+    dhcp_lease_hwaddr* hwaddr = _dhcp_find_hwaddr(block, lease_index, config);
+
+    if (hwaddr) {
+      memcpy(chaddr, hwaddr->chaddr, 16);
+    }
+  } else {
+    memcpy(chaddr, lease->chaddr, DHCP_LEASE_HWADDR_LEN);
+  }
+
+  checkpoint_lease(block, lease_index, _dhcp_lease_state(block, lease_index), chaddr, lease->xid, config->lease_epoch + lease->lease_end, config);
+}
+
+ATTR_NONNULL_ALL static void _dhcp_release_lease(ddhcp_block* block, uint32_t lease_index, ddhcp_config* config) {
   INFO("dhcp_release_lease(...): Releasing lease %i in block %i\n", lease_index, block->index);
-  dhcp_lease* lease = block->addresses + lease_index;
+  dhcp_lease* lease = block->addresses->lease + lease_index;
 
   // TODO Should we really reset the chaddr or xid, RFC says we
   // ''SHOULD retain a record of the client's initialization parameters for possible reuse''
-  memset(lease->chaddr, 0, 16);
+  _dhcp_set_lease_chaddr(block, lease_index, dhcp_no_chaddr, config);
 
   lease->xid   = 0;
-  lease->state = FREE;
+  _dhcp_set_lease_state(block, lease_index, FREE, config);
+  _dhcp_checkpoint_lease(block, lease_index, config);
+}
+
+ATTR_NONNULL_ALL static void _dhcp_set_lease_end(ddhcp_block* block, uint32_t lease_index, time_t lease_end, ddhcp_config* config) {
+  block->addresses->lease[lease_index].lease_end = (uint32_t)(lease_end - config->lease_epoch);
+
+  // Every change of the lease end schedules a new timer, outdated
+  // timers are dropped in dhcp_check_timeouts.
+  if (timer_queue_add(&config->lease_timers, lease_end, block->index, lease_index)) {
+    ERROR("dhcp_set_lease_end(...): Failed to schedule expiry of lease %i in block %i\n", lease_index, block->index);
+  }
+
+  _dhcp_checkpoint_lease(block, lease_index, config);
+}
+
+ATTR_NONNULL_ALL void dhcp_lease_restore(ddhcp_block* block, uint32_t lease_index, enum dhcp_lease_state state, const uint8_t* chaddr, uint32_t xid, time_t lease_end, ddhcp_config* config) {
+  _dhcp_set_lease_chaddr(block, lease_index, chaddr, config);
+  block->addresses->lease[lease_index].xid = xid;
+  _dhcp_set_lease_state(block, lease_index, state, config);
+  _dhcp_set_lease_end(block, lease_index, lease_end, config);
 }
 
 ATTR_NONNULL_ALL dhcp_packet* build_initial_packet(dhcp_packet* from_client) {
@@ -108,41 +290,58 @@ ATTR_NONNULL_ALL dhcp_packet* build_initial_packet(dhcp_packet* from_client) {
   return packet;
 }
 
-uint8_t _ddo[1] = { 0 };
-
-ATTR_NONNULL_ALL static int16_t _dhcp_default_options(uint8_t msg_type, dhcp_packet* packet, dhcp_packet* request, ddhcp_config* config, bool include_lease_time) {
-  int16_t num_options;
-  // TODO We need a more extendable way to build up options
-  // TODO Proper error handling
+ATTR_NONNULL_ALL static ssize_t _dhcp_reply(ddhcp_epoll_data* socket, uint8_t msg_type, dhcp_packet* request, struct in_addr* yiaddr, bool include_lease_time, ddhcp_config* config) {
+  dhcp_reply_template* template = dhcp_options_template(config);
 
-  // Fill options list with requested options, allocate memory and reserve for additonal
-  // dhcp options.
-  if ((num_options = fill_options(request->options, request->options_len, &config->options, 3, &packet->options)) < 0) {
-    return num_options;
+  if (!template) {
+    return -ENOMEM;
   }
 
-  packet->options_len = (uint8_t)num_options;
+  // The head of the template is copied into the transmit queue of the
+  // socket and the fields of the request are set in place.
+  uint8_t* buffer = socket->tx_buffer;
+  size_t len = include_lease_time ? template->head_lease_time_len : template->head_len;
+  uint16_t tmp16;
+  uint32_t tmp32;
 
-  // DHCP Message Type
-  _ddo[0] = msg_type;
-  set_option(packet->options, packet->options_len, DHCP_CODE_MESSAGE_TYPE, 1, _ddo);
+  if (len + 1 > socket->tx_size) {
+    ERROR("_dhcp_reply(...): Reply exceeds the transmit buffer\n");
+    return -EMSGSIZE;
+  }
 
-  // To support DHCPINFORM (as of RFC 2132) we need to be able to omit the lease time
-  if (include_lease_time) {
-    // DHCP Lease Time
-    set_option_from_store(&config->options, packet->options, packet->options_len, DHCP_CODE_ADDRESS_LEASE_TIME);
+  memcpy(buffer, template->buffer, len);
+  buffer[1] = request->htype;
+  buffer[2] = request->hlen;
+  buffer[3] = request->hops;
+  tmp32 = htonl(request->xid);
+  memcpy(buffer + 4, &tmp32, 4);
+  tmp16 = htons(request->flags);
+  memcpy(buffer + 10, &tmp16, 2);
+  memcpy(buffer + 12, &request->ciaddr, 4);
+  memcpy(buffer + 16, yiaddr, 4);
+  memcpy(buffer + 24, &request->giaddr, 4);
+  memcpy(buffer + 28, &request->chaddr, 16);
+  buffer[DHCP_REPLY_MESSAGE_TYPE_OFFSET] = msg_type;
+
+  // Requested options of the store follow.
+  ssize_t options_len = dhcp_options_requested(template, request, buffer + len, socket->tx_size - len - 1);
+
+  if (options_len < 0) {
+    ERROR("_dhcp_reply(...): Reply exceeds the transmit buffer\n");
+    return options_len;
   }
 
-  // DHCP Server identifier
-  set_option_from_store(&config->options, packet->options, packet->options_len, DHCP_CODE_SERVER_IDENTIFIER);
+  len += (size_t) options_len;
+  buffer[len++] = DHCP_CODE_END;
 
-  return 0;
+  return dhcp_packet_send_serialised(socket, request, len);
 }
 
 ATTR_NONNULL_ALL int dhcp_process(uint8_t* buffer, ssize_t len, ddhcp_config* config) {
   // TODO Error Handling
   struct dhcp_packet dhcp_packet_buf;
   ssize_t ret = ntoh_dhcp_packet(&dhcp_packet_buf, buffer, len);
+  int need_blocks = 0;
 
   if (ret == 0) {
     int message_type = dhcp_packet_message_type(&dhcp_packet_buf);
@@ -150,18 +349,18 @@ ATTR_NONNULL_ALL int dhcp_process(uint8_t* buffer, ssize_t len, ddhcp_config* co
     switch (message_type) {
     case DHCPDISCOVER:
       statistics_record(config, STAT_DHCP_RECV_DISCOVER, 1);
-      ret = dhcp_hdl_discover(DDHCP_SKT_DHCP(config)->fd, &dhcp_packet_buf, config);
+      ret = dhcp_hdl_discover(DDHCP_SKT_DHCP(config), &dhcp_packet_buf, config);
 
       if (ret == 1) {
         INFO("dhcp_process(...): we need to inquire new blocks\n");
-        return 1;
+        need_blocks = 1;
       }
 
       break;
 
     case DHCPREQUEST:
       statistics_record(config, STAT_DHCP_RECV_REQUEST, 1);
-      dhcp_hdl_request(DDHCP_SKT_DHCP(config)->fd, &dhcp_packet_buf, config);
+      dhcp_hdl_request(DDHCP_SKT_DHCP(config), &dhcp_packet_buf, config);
       break;
 
     case DHCPRELEASE:
@@ -171,87 +370,150 @@ ATTR_NONNULL_ALL int dhcp_process(uint8_t* buffer, ssize_t len, ddhcp_config* co
 
     case DHCPINFORM:
       statistics_record(config, STAT_DHCP_RECV_INFORM, 1);
-      dhcp_hdl_inform(DDHCP_SKT_DHCP(config)->fd, &dhcp_packet_buf, config);
+      dhcp_hdl_inform(DDHCP_SKT_DHCP(config), &dhcp_packet_buf, config);
       break;
 
     default:
       WARNING("dhcp_process(...): Unknown DHCP message of type %i\n", message_type);
       break;
     }
-
-    if (dhcp_packet_buf.options_len > 0) {
-      free(dhcp_packet_buf.options);
-    }
   } else {
     WARNING("dhcp_process(...): Malformed packet!? errcode: %li\n", ret);
   }
 
-  return 0;
+  return need_blocks;
 }
 
-ATTR_NONNULL_ALL int dhcp_hdl_discover(int socket, dhcp_packet* discover, ddhcp_config* config) {
-  DEBUG("dhcp_hdl_discover(socket:%i, packet, config)\n", socket);
+ATTR_NONNULL_ALL static int _dhcp_park_discover(dhcp_packet* discover, ddhcp_config* config) {
+  dhcp_packet* parked;
 
-  time_t now = time(NULL);
-  ddhcp_block* lease_block = block_find_free_leases(config);
+  // A retransmission replaces the DISCOVER of the client parked before.
+  list_for_each_entry(parked, &config->dhcp_discover_queue, packet_list) {
+    if (memcmp(parked->chaddr, discover->chaddr, 16) == 0) {
+      list_del(&parked->packet_list);
+      dhcp_packet_free(parked, 1);
+      free(parked);
+      config->dhcp_discover_parked--;
+      break;
+    }
+  }
 
-  if (!lease_block) {
-    DEBUG("dhcp_hdl_discover(...): no block with free leases found\n");
+  int was_empty = list_empty(&config->dhcp_discover_queue);
+
+  if (config->dhcp_discover_parked >= DHCP_DISCOVER_QUEUE_MAX) {
+    DEBUG("_dhcp_park_discover(...): queue is full, dropping DISCOVER\n");
     return 3;
   }
 
-  uint32_t lease_index = dhcp_get_free_lease(lease_block);
-  dhcp_lease* lease = lease_block->addresses + lease_index;
-
-  if (!lease) {
-    DEBUG("dhcp_hdl_discover(...): no free leases found, this should not happen!\n");
-    return 2;
+  if (dhcp_packet_list_add(&config->dhcp_discover_queue, discover)) {
+    return -ENOMEM;
   }
 
-  dhcp_packet* packet = build_initial_packet(discover);
+  // Keep the DISCOVER for the time a full claim of a block takes.
+  parked = list_last_entry(&config->dhcp_discover_queue, dhcp_packet, packet_list);
+  parked->timeout = time(NULL) + 2 * config->tentative_timeout;
+  config->dhcp_discover_parked++;
 
-  if (!packet) {
-    WARNING("dhcp_hdl_discover(...): packet memory allocation failed\n");
+  DEBUG("_dhcp_park_discover(...): parked DISCOVER, %u waiting\n", config->dhcp_discover_parked);
+
+  // Only the first parked client triggers a claim, while one is running
+  // further clients just wait for it.
+  if (was_empty && config->claiming_blocks_amount == 0) {
     return 1;
   }
 
+  return 3;
+}
+
+ATTR_NONNULL_ALL static int _dhcp_offer(ddhcp_epoll_data* socket, dhcp_packet* discover, ddhcp_block* lease_block, ddhcp_config* config) {
+  time_t now = time(NULL);
+  uint32_t lease_index = dhcp_get_free_lease(lease_block);
+
+  if (lease_index >= config->block_size) {
+    DEBUG("_dhcp_offer(...): no free leases found, this should not happen!\n");
+    return 2;
+  }
+
+  dhcp_lease* lease = lease_block->addresses->lease + lease_index;
+
   // Mark lease as offered and register client
-  memcpy(&lease->chaddr, &discover->chaddr, 16);
+  _dhcp_set_lease_chaddr(lease_block, lease_index, (uint8_t*) discover->chaddr, config);
   lease->xid = discover->xid;
-  lease->state = OFFERED;
-  lease->lease_end = now + DHCP_OFFER_TIMEOUT;
+  _dhcp_set_lease_state(lease_block, lease_index, OFFERED, config);
+  _dhcp_set_lease_end(lease_block, lease_index, now + DHCP_OFFER_TIMEOUT, config);
 
-  addr_add(&lease_block->subnet, &packet->yiaddr, (int)lease_index);
+  struct in_addr yiaddr;
+  addr_add(&config->prefix, &yiaddr, (int)(block_subnet_offset(lease_block, config) + lease_index));
 
-  DEBUG("dhcp_hdl_discover(...): offering address %i %s\n", lease_index, inet_ntoa(lease_block->subnet));
-
-  if (_dhcp_default_options(DHCPOFFER, packet, discover, config, true)) {
-    WARNING("dhcp_hdl_discover(...): option memory allocation failed\n");
-    free(packet);
-    return 1;
-  }
+  DEBUG("_dhcp_offer(...): offering address %i %s\n", lease_index, inet_ntoa(yiaddr));
 
   statistics_record(config, STAT_DHCP_SEND_PKG, 1);
   statistics_record(config, STAT_DHCP_SEND_OFFER, 1);
-  ssize_t bytes_send = dhcp_packet_send(socket, packet);
+  ssize_t bytes_send = _dhcp_reply(socket, DHCPOFFER, discover, &yiaddr, true, config);
   statistics_record(config, STAT_DHCP_SEND_BYTE, (long int) bytes_send);
 
+  if (bytes_send == -ENOMEM) {
+    WARNING("_dhcp_offer(...): reply template allocation failed\n");
+    return -ENOMEM;
+  }
+
   if (bytes_send > 0) {
+    demand_record(&config->demand, 1);
+
     // We needed the block, hence remove a possible needless marking.
 #if LOG_LEVEL_LIMIT >= LOG_DEBUG
     if ( lease_block->needless_since > 0 ) {
-      DEBUG("dhcp_hdl_discover(...): Reset needless marker for block %i\n",lease_block->index);
+      DEBUG("_dhcp_offer(...): Reset needless marker for block %i\n",lease_block->index);
     }
 #endif
     lease_block->needless_since = 0;
   }
 
-  free(packet->options);
-  free(packet);
-
   return 0;
 }
 
+ATTR_NONNULL_ALL int dhcp_hdl_discover(ddhcp_epoll_data* socket, dhcp_packet* discover, ddhcp_config* config) {
+  DEBUG("dhcp_hdl_discover(socket:%i, packet, config)\n", socket->fd);
+
+  ddhcp_block* lease_block = block_find_free_leases(config);
+
+  if (!lease_block) {
+    DEBUG("dhcp_hdl_discover(...): no block with free leases found\n");
+    return _dhcp_park_discover(discover, config);
+  }
+
+  return _dhcp_offer(socket, discover, lease_block, config);
+}
+
+ATTR_NONNULL_ALL void dhcp_hdl_parked(ddhcp_epoll_data* socket, ddhcp_config* config) {
+  DEBUG("dhcp_hdl_parked(socket:%i, config)\n", socket->fd);
+  time_t now = time(NULL);
+  dhcp_packet* parked, *tmp;
+
+  list_for_each_entry_safe(parked, tmp, &config->dhcp_discover_queue, packet_list) {
+    if (parked->timeout >= now) {
+      ddhcp_block* lease_block = block_find_free_leases(config);
+
+      if (!lease_block) {
+        DEBUG("dhcp_hdl_parked(...): still no free leases, %u waiting\n", config->dhcp_discover_parked);
+        return;
+      }
+
+      if (_dhcp_offer(socket, parked, lease_block, config) < 0) {
+        WARNING("dhcp_hdl_parked(...): failed to offer, %u waiting\n", config->dhcp_discover_parked);
+        return;
+      }
+    } else {
+      DEBUG("dhcp_hdl_parked(...): drop timed out DISCOVER\n");
+    }
+
+    list_del(&parked->packet_list);
+    dhcp_packet_free(parked, 1);
+    free(parked);
+    config->dhcp_discover_parked--;
+  }
+}
+
 ATTR_NONNULL_ALL int dhcp_rhdl_request(uint32_t* address, ddhcp_config* config) {
   DEBUG("dhcp_rhdl_request(address,config)\n");
 
@@ -267,8 +529,7 @@ ATTR_NONNULL_ALL int dhcp_rhdl_request(uint32_t* address, ddhcp_config* config)
   if (found == 0) {
     // Update lease information
     // TODO Check for validity of request (chaddr)
-    dhcp_lease* lease = lease_block->addresses + lease_index;
-    lease->lease_end = now + find_in_option_store_address_lease_time(&config->options)  + DHCP_LEASE_SERVER_DELTA;
+    _dhcp_set_lease_end(lease_block, lease_index, now + find_in_option_store_address_lease_time(&config->options) + DHCP_LEASE_SERVER_DELTA, config);
     // Report ack
     return 0;
   } else if (found == 1) {
@@ -280,13 +541,13 @@ ATTR_NONNULL_ALL int dhcp_rhdl_request(uint32_t* address, ddhcp_config* config)
   }
 }
 
-ATTR_NONNULL_ALL int dhcp_rhdl_ack(int socket, struct dhcp_packet* request, ddhcp_config* config) {
+ATTR_NONNULL_ALL int dhcp_rhdl_ack(ddhcp_epoll_data* socket, struct dhcp_packet* request, ddhcp_config* config) {
 
   ddhcp_block* lease_block = NULL;
   uint32_t lease_index = 0;
   struct in_addr requested_address = {0};
 
-  uint8_t* address = find_option_requested_address(request->options, request->options_len);
+  uint8_t* address = find_option_requested_address(request);
 
   if (address) {
     memcpy(&requested_address, address, sizeof(struct in_addr));
@@ -294,7 +555,7 @@ ATTR_NONNULL_ALL int dhcp_rhdl_ack(int socket, struct dhcp_packet* request, ddhc
     memcpy(&requested_address, &request->ciaddr.s_addr, sizeof(struct in_addr));
   }
 
-  if (find_lease_from_address(&requested_address, config, &lease_block, &lease_index) != 1) {
+  if (find_lease_from_address(&requested_address, config, &lease_block, &lease_index) != 1 || !lease_block) {
     DEBUG("dhcp_rhdl_ack(...): lease not found\n");
     return 1;
   }
@@ -302,8 +563,8 @@ ATTR_NONNULL_ALL int dhcp_rhdl_ack(int socket, struct dhcp_packet* request, ddhc
   return dhcp_ack(socket, request, lease_block, lease_index, config);
 }
 
-ATTR_NONNULL_ALL int dhcp_hdl_request(int socket, struct dhcp_packet* request, ddhcp_config* config) {
-  DEBUG("dhcp_hdl_request(socket:%i, dhcp_packet, config)\n", socket);
+ATTR_NONNULL_ALL int dhcp_hdl_request(ddhcp_epoll_data* socket, struct dhcp_packet* request, ddhcp_config* config) {
+  DEBUG("dhcp_hdl_request(socket:%i, dhcp_packet, config)\n", socket->fd);
 
   // search the lease we may have offered
 
@@ -312,7 +573,7 @@ ATTR_NONNULL_ALL int dhcp_hdl_request(int socket, struct dhcp_packet* request, d
   ddhcp_block* lease_block = NULL;
   uint32_t lease_index = 0;
 
-  uint8_t* address = find_option_requested_address(request->options, request->options_len);
+  uint8_t* address = find_option_requested_address(request);
 
   struct in_addr requested_address;
   uint8_t found_address = 0;
@@ -330,24 +591,23 @@ ATTR_NONNULL_ALL int dhcp_hdl_request(int socket, struct dhcp_packet* request, d
     uint8_t found = find_lease_from_address(&requested_address, config, &lease_block, &lease_index);
 
     if (found != 2) {
-      lease = lease_block->addresses + lease_index;
       DEBUG("dhcp_hdl_request(...): Lease found.\n");
 
-      if (lease_block->state == DDHCP_CLAIMED) {
-        if (block_alloc(lease_block)) {
+      if (lease_block && lease_block->state == DDHCP_CLAIMED) {
+        if (block_alloc(lease_block, config)) {
           ERROR("dhcp_hdl_request(...): can't allocate requested block\n");
           dhcp_nack(socket, request, config);
         }
 
-        lease = lease_block->addresses + lease_index;
+        lease = lease_block->addresses->lease + lease_index;
         // This lease block is not ours so we have to forward the request
         DEBUG("dhcp_hdl_request(...): Requested lease is owned by another node. Sent request.\n");
         // Register client information in lease
         // TODO This isn't a good idea, because of multi request on the same address from various clients, register it elsewhere and append xid.
         lease->xid = request->xid;
-        lease->state = OFFERED;
-        lease->lease_end = now + find_in_option_store_address_lease_time(&config->options)  + DHCP_LEASE_SERVER_DELTA;
-        memcpy(&lease->chaddr, &request->chaddr, 16);
+        _dhcp_set_lease_state(lease_block, lease_index, OFFERED, config);
+        _dhcp_set_lease_end(lease_block, lease_index, now + find_in_option_store_address_lease_time(&config->options) + DHCP_LEASE_SERVER_DELTA, config);
+        _dhcp_set_lease_chaddr(lease_block, lease_index, (uint8_t*) request->chaddr, config);
 
         // Build packet and send it
         ddhcp_renew_payload payload;
@@ -363,14 +623,9 @@ ATTR_NONNULL_ALL int dhcp_hdl_request(int socket, struct dhcp_packet* request, d
 #endif
 
         // Send packet
-        ddhcp_mcast_packet* packet = new_ddhcp_packet(DDHCP_MSG_RENEWLEASE, config);
-
-        if (!packet) {
-          WARNING("dhcp_hdl_request(...): Failed to allocate memory for ddhcpd mcast packet\n");
-          return -ENOMEM;
-        }
-
-        packet->renew_payload = &payload;
+        ddhcp_epoll_data* server = DDHCP_SKT_SERVER(config);
+        packet_tx_begin(server, DDHCP_MSG_RENEWLEASE, config);
+        packet_tx_add_renew(server, &payload);
 
         // Store packet for later usage.
         // TODO Error handling
@@ -378,17 +633,19 @@ ATTR_NONNULL_ALL int dhcp_hdl_request(int socket, struct dhcp_packet* request, d
 
         statistics_record(config, STAT_DIRECT_SEND_PKG, 1);
         statistics_record(config, STAT_DIRECT_SEND_RENEWLEASE, 1);
-        ssize_t bytes_send = send_packet_direct(packet, &lease_block->owner_address, DDHCP_SKT_SERVER(config));
+        ssize_t bytes_send = packet_tx_send_direct(server, &block_owner(lease_block, config)->address);
         statistics_record(config, STAT_DIRECT_SEND_BYTE, (long int) bytes_send);
         UNUSED(bytes_send);
-        free(packet);
         return 2;
 
-      } else if (lease_block->state == DDHCP_OURS) {
-        if (lease->state != OFFERED || lease->xid != request->xid) {
-          if (memcmp(request->chaddr, lease->chaddr, 16) != 0) {
+      } else if (lease_block && lease_block->state == DDHCP_OURS) {
+        lease = lease_block->addresses->lease + lease_index;
+        enum dhcp_lease_state lease_state = _dhcp_lease_state(lease_block, lease_index);
+
+        if (lease_state != OFFERED || lease->xid != request->xid) {
+          if (_dhcp_lease_chaddr_cmp(lease_block, lease_index, (uint8_t*) request->chaddr, config) != 0) {
             // Check if lease is free
-            if (lease->state != FREE) {
+            if (lease_state != FREE) {
               DEBUG("dhcp_hdl_request(...): Requested lease offered to other client\n");
               // Send DHCP_NACK
               dhcp_nack(socket, request, config);
@@ -409,35 +666,37 @@ ATTR_NONNULL_ALL int dhcp_hdl_request(int socket, struct dhcp_packet* request, d
       }
     }
   } else {
-    ddhcp_block* block = config->blocks;
+    ddhcp_block* block;
 
-    // Find lease from xid
-    for (uint32_t i = 0; i < config->number_of_blocks; i++) {
-      if (block->state == DDHCP_OURS) {
-        dhcp_lease* lease_iter = block->addresses;
+    // Find lease from xid, only offered leases are of interest.
+    block_for_each_in_state(block, DDHCP_OURS, config) {
+      if (!dhcp_num_offered(block)) {
+        continue;
+      }
 
-        for (unsigned int j = 0 ; j < block->subnet_len ; j++) {
-          if (lease_iter->state == OFFERED && lease_iter->xid == request->xid) {
-            if (memcmp(request->chaddr, lease_iter->chaddr, 16) == 0) {
-              DEBUG("dhcp_hdl_request(...): Found requested lease\n");
+      for (uint32_t word = 0; word < DHCP_LEASE_BITMAP_WORDS && !lease; word++) {
+        uint64_t offered = block->addresses->bitmap[OFFERED][word];
 
-              lease = lease_iter;
-              lease_block = block;
-              lease_index = j;
+        while (offered) {
+          uint32_t j = word * 64 + (uint32_t) __builtin_ctzll(offered);
+          dhcp_lease* lease_iter = block->addresses->lease + j;
+          offered &= offered - 1;
 
-              break;
-            }
-          }
+          if (lease_iter->xid == request->xid && _dhcp_lease_chaddr_cmp(block, j, (uint8_t*) request->chaddr, config) == 0) {
+            DEBUG("dhcp_hdl_request(...): Found requested lease\n");
 
-          lease_iter++;
-        }
+            lease = lease_iter;
+            lease_block = block;
+            lease_index = j;
 
-        if (lease) {
-          break;
+            break;
+          }
         }
       }
 
-      block++;
+      if (lease) {
+        break;
+      }
     }
   }
 
@@ -461,15 +720,11 @@ ATTR_NONNULL_ALL void dhcp_hdl_release(dhcp_packet* packet, ddhcp_config* config
   memcpy(&addr, &packet->ciaddr, sizeof(struct in_addr));
   uint8_t found = find_lease_from_address(&addr, config, &lease_block, &lease_index);
 
-  dhcp_lease* lease;
-
   switch (found) {
   case 0:
-    lease = lease_block->addresses + lease_index;
-
     // Check Hardware Address of client
-    if (memcmp(packet->chaddr, lease->chaddr, 16) == 0) {
-      _dhcp_release_lease(lease_block, lease_index);
+    if (_dhcp_lease_chaddr_cmp(lease_block, lease_index, (uint8_t*) packet->chaddr, config) == 0) {
+      _dhcp_release_lease(lease_block, lease_index, config);
       hook_address(HOOK_RELEASE, &packet->yiaddr, (uint8_t*) &packet->chaddr, config);
     } else {
       ERROR("dhcp_hdl_release(...): Hardware address transmitted by client did not match with our record, doing nothing.\n");
@@ -486,8 +741,8 @@ ATTR_NONNULL_ALL void dhcp_hdl_release(dhcp_packet* packet, ddhcp_config* config
   }
 }
 
-ATTR_NONNULL_ALL void dhcp_hdl_inform(int socket, dhcp_packet* request, ddhcp_config* config) {
-  DEBUG("dhcp_hdl_inform(socket:%i, dhcp_packet,config)\n", socket);
+ATTR_NONNULL_ALL void dhcp_hdl_inform(ddhcp_epoll_data* socket, dhcp_packet* request, ddhcp_config* config) {
+  DEBUG("dhcp_hdl_inform(socket:%i, dhcp_packet,config)\n", socket->fd);
 
   ddhcp_block* lease_block = NULL;
   uint32_t lease_index = 0;
@@ -496,33 +751,18 @@ ATTR_NONNULL_ALL void dhcp_hdl_inform(int socket, dhcp_packet* request, ddhcp_co
   memcpy(&addr, &request->ciaddr, sizeof(struct in_addr));
   find_lease_from_address(&addr, config, &lease_block, &lease_index);
 
-  dhcp_packet* packet = build_initial_packet(request);
-
-  if (!packet) {
-    WARNING("dhcp_hdl_inform(...): packed memory allocation failed\n");
-    return;
-  }
-
-  if (_dhcp_default_options(DHCPACK, packet, request, config, false)) {
-    WARNING("dhcp_hdl_inform(...): option memory allocation failed\n");
-    free(packet);
-    return;
-  }
-
-  DEBUG("dhcp_hdl_inform(...): informing address %i %s\n", lease_index, inet_ntoa(packet->ciaddr));
+  DEBUG("dhcp_hdl_inform(...): informing address %i %s\n", lease_index, inet_ntoa(request->ciaddr));
   statistics_record(config, STAT_DHCP_SEND_PKG, 1);
   statistics_record(config, STAT_DHCP_SEND_ACK, 1);
-  ssize_t bytes_send = dhcp_packet_send(socket, packet);
+  struct in_addr yiaddr = { INADDR_ANY };
+  ssize_t bytes_send = _dhcp_reply(socket, DHCPACK, request, &yiaddr, false, config);
   statistics_record(config, STAT_DHCP_SEND_BYTE, (long int) bytes_send);
   UNUSED(bytes_send);
 
-  hook_address(HOOK_INFORM, &packet->ciaddr, (uint8_t*) &packet->chaddr, config);
-
-  free(packet->options);
-  free(packet);
+  hook_address(HOOK_INFORM, &request->ciaddr, (uint8_t*) &request->chaddr, config);
 }
 
-ATTR_NONNULL_ALL int dhcp_nack(int socket, dhcp_packet* from_client, ddhcp_config* config) {
+ATTR_NONNULL_ALL int dhcp_nack(ddhcp_epoll_data* socket, dhcp_packet* from_client, ddhcp_config* config) {
   dhcp_packet* packet = build_initial_packet(from_client);
 
   if (!packet) {
@@ -556,103 +796,59 @@ ATTR_NONNULL_ALL int dhcp_nack(int socket, dhcp_packet* from_client, ddhcp_confi
   return 0;
 }
 
-ATTR_NONNULL_ALL int dhcp_ack(int socket, dhcp_packet* request, ddhcp_block* lease_block, uint32_t lease_index, ddhcp_config* config) {
+ATTR_NONNULL_ALL int dhcp_ack(ddhcp_epoll_data* socket, dhcp_packet* request, ddhcp_block* lease_block, uint32_t lease_index, ddhcp_config* config) {
   time_t now = time(NULL);
-  dhcp_lease* lease = lease_block->addresses + lease_index;
-
-  dhcp_packet* packet = build_initial_packet(request);
-
-  if (!packet) {
-    WARNING("dhcp_ack(...): packed memory allocation failed\n");
-    return 1;
-  }
+  dhcp_lease* lease = lease_block->addresses->lease + lease_index;
 
   // Mark lease as leased and register client
-  memcpy(&lease->chaddr, &request->chaddr, 16);
+  _dhcp_set_lease_chaddr(lease_block, lease_index, (uint8_t*) request->chaddr, config);
   lease->xid = request->xid;
-  lease->state = LEASED;
-  lease->lease_end = now + find_in_option_store_address_lease_time(&config->options)  + DHCP_LEASE_SERVER_DELTA;
-
-  addr_add(&lease_block->subnet, &packet->yiaddr, (int)lease_index);
+  _dhcp_set_lease_state(lease_block, lease_index, LEASED, config);
+  _dhcp_set_lease_end(lease_block, lease_index, now + find_in_option_store_address_lease_time(&config->options) + DHCP_LEASE_SERVER_DELTA, config);
 
-  if (_dhcp_default_options(DHCPACK, packet, request, config, true)) {
-    WARNING("dhcp_ack(...): option memory allocation failed\n");
-    free(packet);
-    return 1;
-  }
+  struct in_addr yiaddr;
+  addr_add(&config->prefix, &yiaddr, (int)(block_subnet_offset(lease_block, config) + lease_index));
 
-  DEBUG("dhcp_ack(...): offering address %i %s\n", lease_index, inet_ntoa(packet->yiaddr));
+  DEBUG("dhcp_ack(...): offering address %i %s\n", lease_index, inet_ntoa(yiaddr));
   statistics_record(config, STAT_DHCP_SEND_PKG, 1);
   statistics_record(config, STAT_DHCP_SEND_ACK, 1);
-  ssize_t bytes_send = dhcp_packet_send(socket, packet);
+  ssize_t bytes_send = _dhcp_reply(socket, DHCPACK, request, &yiaddr, true, config);
   statistics_record(config, STAT_DHCP_SEND_BYTE, (long int) bytes_send);
-  UNUSED(bytes_send);
 
-  hook_address(HOOK_LEASE, &packet->yiaddr, (uint8_t*) &packet->chaddr, config);
+  if (bytes_send == -ENOMEM) {
+    WARNING("dhcp_ack(...): reply template allocation failed\n");
+    return 1;
+  }
+
+  hook_address(HOOK_LEASE, &yiaddr, (uint8_t*) &request->chaddr, config);
 
-  free(packet->options);
-  free(packet);
   return 0;
 }
 
 ATTR_NONNULL_ALL int dhcp_has_free(struct ddhcp_block* block) {
-  dhcp_lease* lease = block->addresses;
-
-  for (unsigned int i = 0; i < block->subnet_len; i++) {
-    if (lease->state == FREE) {
-      return 1;
-    }
-
-    lease++;
-  }
-
-  return 0;
+  return block->addresses->num[FREE] > 0;
 }
 
 ATTR_NONNULL_ALL uint32_t dhcp_num_free(struct ddhcp_block* block) {
-  uint32_t num = 0;
-  dhcp_lease* lease = block->addresses;
-
-  for (unsigned int i = 0 ; i < block->subnet_len ; i++) {
-    if (lease->state == FREE) {
-      num++;
-    }
-
-    lease++;
-  }
-
-  return num;
+  return block->addresses->num[FREE];
 }
 
 ATTR_NONNULL_ALL uint32_t dhcp_num_offered(struct ddhcp_block* block) {
-  uint32_t num = 0;
-  dhcp_lease* lease = block->addresses;
-
-  for (unsigned int i = 0 ; i < block->subnet_len ; i++) {
-    if (lease->state == OFFERED) {
-      num++;
-    }
-
-    lease++;
-  }
-
-  return num;
+  return block->addresses->num[OFFERED];
 }
 
 ATTR_NONNULL_ALL uint32_t dhcp_get_free_lease(ddhcp_block* block) {
-  dhcp_lease* lease = block->addresses;
+  uint64_t* free_leases = block->addresses->bitmap[FREE];
 
-  for (uint32_t i = 0 ; i < block->subnet_len ; i++) {
-    if (lease->state == FREE) {
-      return i;
+  for (uint32_t word = 0; word < DHCP_LEASE_BITMAP_WORDS; word++) {
+    if (free_leases[word]) {
+      return word * 64 + (uint32_t) __builtin_ctzll(free_leases[word]);
     }
-
-    lease++;
   }
 
-  ERROR("dhcp_get_free_lease(...): no free leases found");
+  ERROR("dhcp_get_free_lease(...): no free leases found\n");
 
-  return block->subnet_len;
+  return DHCP_LEASE_BLOCK_MAX;
 }
 
 ATTR_NONNULL_ALL void dhcp_release_lease(uint32_t address, ddhcp_config* config) {
@@ -664,30 +860,34 @@ ATTR_NONNULL_ALL void dhcp_release_lease(uint32_t address, ddhcp_config* config)
   uint8_t found = find_lease_from_address(&addr, config, &lease_block, &lease_index);
 
   if (found == 0) {
-    _dhcp_release_lease(lease_block, lease_index);
+    _dhcp_release_lease(lease_block, lease_index, config);
   } else {
     DEBUG("dhcp_release_lease(...): No lease for address %s found.\n", inet_ntoa(addr));
   }
 }
 
-ATTR_NONNULL_ALL int dhcp_check_timeouts(ddhcp_block* block) {
-  DEBUG("dhcp_check_timeouts(block)\n");
-  dhcp_lease* lease = block->addresses;
+ATTR_NONNULL_ALL void dhcp_check_timeouts(ddhcp_config* config) {
+  DEBUG("dhcp_check_timeouts(config)\n");
+  ddhcp_timer timer;
   time_t now = time(NULL);
 
-  int free_leases = 0;
+  while (timer_queue_pop(&config->lease_timers, now, &timer)) {
+    ddhcp_block* block = block_lookup(timer.id, config);
 
-  for (unsigned int i = 0 ; i < block->subnet_len ; i++) {
-    if (lease->state != FREE && lease->lease_end < now) {
-      _dhcp_release_lease(block, i);
+    // The block may have been freed since the timer was scheduled.
+    if (!block || !block->addresses) {
+      continue;
     }
 
-    if (lease->state == FREE) {
-      free_leases++;
+    dhcp_lease* lease = block->addresses->lease + timer.arg;
+
+    // Only the timer matching the current lease end is valid.
+    if (_dhcp_lease_state(block, timer.arg) != FREE && config->lease_epoch + lease->lease_end == timer.due) {
+      _dhcp_release_lease(block, timer.arg, config);
     }
 
-    lease++;
+    if (block->state != DDHCP_OURS && dhcp_num_free(block) == config->block_size) {
+      block_free(block, config);
+    }
   }
-
-  return free_leases;
 }
@@ -6,6 +6,7 @@
 
 #include "types.h"
 #include "dhcp_packet.h"
+#include "epoll.h"
 
 /**
  * DHCP Process Packet
@@ -15,18 +16,28 @@ ATTR_NONNULL_ALL int dhcp_process(uint8_t* buffer, ssize_t len, ddhcp_config* co
 /**
  * DHCP Discover
  * Performs a search for a available, not already offered address in the
- * available block. When the block has no further available addresses 0 is returned,
- * otherwise the then reserved address. Will set a lease_timout on the lease.
+ * available block. Will set a lease_timout on the lease.
  *
  * In a second step a dhcp_packet is created an send back.
+ *
+ * When there is no free lease, a copy of the DISCOVER is parked until
+ * dhcp_hdl_parked can answer it. Returns 0 on success, 1 if the DISCOVER was
+ * parked and new blocks have to be claimed right away, 3 if no OFFER
+ * was sent otherwise and -ENOMEM on allocation failure.
  */
-ATTR_NONNULL_ALL int dhcp_hdl_discover(int socket, dhcp_packet* discover, ddhcp_config* config);
+ATTR_NONNULL_ALL int dhcp_hdl_discover(ddhcp_epoll_data* socket, dhcp_packet* discover, ddhcp_config* config);
+
+/**
+ * HouseKeeping: Answer parked DISCOVERs with OFFERs as long as there are
+ * free leases and drop the ones, whose client has given up on them.
+ */
+ATTR_NONNULL_ALL void dhcp_hdl_parked(ddhcp_epoll_data* socket, ddhcp_config* config);
 
 /**
  * DHCP Request
  * Performs on base of de
  */
-ATTR_NONNULL_ALL int dhcp_hdl_request(int socket, struct dhcp_packet* request, ddhcp_config* config);
+ATTR_NONNULL_ALL int dhcp_hdl_request(ddhcp_epoll_data* socket, struct dhcp_packet* request, ddhcp_config* config);
 
 /**
  * DDHCP Remote Request (Renew)
@@ -35,7 +46,7 @@ ATTR_NONNULL_ALL int dhcp_rhdl_request(uint32_t* address, ddhcp_config* config);
 /**
  * DDHCP Remote Answer (Ack)
  */
-ATTR_NONNULL_ALL int dhcp_rhdl_ack(int socket, struct dhcp_packet* request, ddhcp_config* config);
+ATTR_NONNULL_ALL int dhcp_rhdl_ack(ddhcp_epoll_data* socket, struct dhcp_packet* request, ddhcp_config* config);
 
 /**
  * DHCP Release
@@ -45,10 +56,10 @@ ATTR_NONNULL_ALL void dhcp_hdl_release(dhcp_packet* packet, ddhcp_config* config
 /**
  * DHCP Inform
  */
-ATTR_NONNULL_ALL void dhcp_hdl_inform(int socket, dhcp_packet* packet, ddhcp_config* config);
+ATTR_NONNULL_ALL void dhcp_hdl_inform(ddhcp_epoll_data* socket, dhcp_packet* packet, ddhcp_config* config);
 
-ATTR_NONNULL_ALL int dhcp_nack(int socket, dhcp_packet* from_client, ddhcp_config* config);
-ATTR_NONNULL_ALL int dhcp_ack(int socket, dhcp_packet* request, ddhcp_block* lease_block, uint32_t lease_index, ddhcp_config* config);
+ATTR_NONNULL_ALL int dhcp_nack(ddhcp_epoll_data* socket, dhcp_packet* from_client, ddhcp_config* config);
+ATTR_NONNULL_ALL int dhcp_ack(ddhcp_epoll_data* socket, dhcp_packet* request, ddhcp_block* lease_block, uint32_t lease_index, ddhcp_config* config);
 
 /**
  * DHCP Lease Available
@@ -70,7 +81,7 @@ ATTR_NONNULL_ALL uint32_t dhcp_num_offered(struct ddhcp_block* block);
 /**
  * Find first free lease in lease block and return its index.
  * This function asserts that there is a free lease, otherwise
- * it returns the value of block_subnet_len.
+ * it returns DHCP_LEASE_BLOCK_MAX.
  */
 ATTR_NONNULL_ALL uint32_t dhcp_get_free_lease(ddhcp_block* block);
 
@@ -83,9 +94,20 @@ ATTR_NONNULL_ALL uint32_t dhcp_get_free_lease(ddhcp_block* block);
 ATTR_NONNULL_ALL void dhcp_release_lease(uint32_t address, ddhcp_config* config);
 
 /**
- * HouseKeeping: Check for timed out leases.
- * Return the number of free leases in the block.
+ * Drop the entries of the leases of a block from the side table
+ * of long hardware addresses.
+ */
+ATTR_NONNULL_ALL void dhcp_free_hwaddrs(ddhcp_block* block, ddhcp_config* config);
+
+/**
+ * Set a lease of one of our blocks as read from the checkpoint.
+ */
+ATTR_NONNULL_ALL void dhcp_lease_restore(ddhcp_block* block, uint32_t lease_index, enum dhcp_lease_state state, const uint8_t* chaddr, uint32_t xid, time_t lease_end, ddhcp_config* config);
+
+/**
+ * HouseKeeping: Release the leases whose expiry timer is due.
+ * Foreign blocks are freed once all of their leases are free.
  */
-ATTR_NONNULL_ALL int dhcp_check_timeouts(ddhcp_block* block);
+ATTR_NONNULL_ALL void dhcp_check_timeouts(ddhcp_config* config);
 
 #endif
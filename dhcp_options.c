@@ -4,7 +4,6 @@
 #include <errno.h>
 
 #include "dhcp_options.h"
-#include "list.h"
 #include "logger.h"
 #include "tools.h"
 
@@ -41,25 +40,14 @@ ATTR_NONNULL_ALL int set_option(dhcp_option* options, uint8_t len, uint8_t code,
   return 1;
 }
 
-ATTR_NONNULL_ALL int set_option_from_store(dhcp_option_list* store, dhcp_option* options, uint8_t len, uint8_t code) {
-  dhcp_option* option = find_in_option_store(store, code);
-
-  if (!option) {
-    DEBUG("set_option_from_store(...): Option %u not found in store\n", code);
-    return 1;
-  }
-
-  return set_option(options, len, code, option->len, option->payload);
-}
-
-ATTR_NONNULL(1) int find_option_parameter_request_list(dhcp_option* options, uint8_t len, uint8_t** requested) {
-  dhcp_option* option = find_option(options, len, DHCP_CODE_PARAMETER_REQUEST_LIST);
+ATTR_NONNULL(1) int find_option_parameter_request_list(dhcp_packet* packet, uint8_t** requested) {
+  uint8_t* option = dhcp_packet_option(packet, DHCP_CODE_PARAMETER_REQUEST_LIST);
 
   if (requested) {
-    *requested = option ? (uint8_t*) option->payload : NULL;
+    *requested = option ? option + 2 : NULL;
   }
 
-  int optlen = option ? option->len : 0;
+  int optlen = option ? option[1] : 0;
 
   DEBUG("find_option_parameter_request_list(...): Length %i\n", optlen);
 
@@ -67,142 +55,109 @@ ATTR_NONNULL(1) int find_option_parameter_request_list(dhcp_option* options, uin
 }
 
 
-ATTR_NONNULL_ALL uint8_t* find_option_requested_address(dhcp_option* options, uint8_t len) {
-  dhcp_option* option = find_option(options, len, DHCP_CODE_REQUESTED_ADDRESS);
+ATTR_NONNULL_ALL uint8_t* find_option_requested_address(dhcp_packet* packet) {
+  uint8_t* option = dhcp_packet_option(packet, DHCP_CODE_REQUESTED_ADDRESS);
+
+  if (option && option[1] != 4) {
+    option = NULL;
+  }
 
   DEBUG("find_option_requested_address(...): address %s\n", option ? "found" : "not found");
 
-  return option ? option->payload : NULL;
+  return option ? option + 2 : NULL;
 }
 
-ATTR_NONNULL_ALL dhcp_option* find_in_option_store(dhcp_option_list* options, uint8_t code) {
-  DEBUG("find_in_option_store(store, code:%i)\n", code);
-
-  dhcp_option* option;
-
-  list_for_each_entry(option, options, option_list) {
-    if (option->code == code) {
-      DEBUG("find_in_option_store(...): Found option with code %i\n", code);
-      return option;
-    }
+ATTR_NONNULL_ALL void free_option(struct dhcp_option* option) {
+  if (option->payload) {
+    free(option->payload);
   }
 
-  return NULL;
+  free(option);
 }
 
-ATTR_NONNULL_ALL uint32_t find_in_option_store_address_lease_time(dhcp_option_list* options) {
-  dhcp_option* lease_time_opt = find_in_option_store(options, DHCP_CODE_ADDRESS_LEASE_TIME);
+ATTR_NONNULL_ALL void init_option_store(dhcp_option_store* store) {
+  memset(store->option, 0, sizeof(store->option));
+  // A reply template of generation 0 is not built yet.
+  store->generation = 1;
+  store->lease_time = 0;
+}
 
-  if (lease_time_opt) {
-    uint32_t buf = 0;
+ATTR_NONNULL_ALL static void _option_store_lease_time(dhcp_option_store* store) {
+  dhcp_option* lease_time_opt = store->option[DHCP_CODE_ADDRESS_LEASE_TIME];
+  uint32_t buf = 0;
+
+  store->lease_time = 0;
 
+  if (lease_time_opt) {
     if (!lease_time_opt->payload || lease_time_opt->len < sizeof(buf)) {
-      WARNING("find_in_option_store(...): requested option had insufficient or no payload data specified.");
-      return 0;
+      WARNING("set_option_in_store(...): lease time option had insufficient or no payload data specified.\n");
+      return;
     }
 
     memcpy(&buf, lease_time_opt->payload, sizeof(buf));
-    return ntohl(buf);
+    store->lease_time = ntohl(buf);
   }
-
-  return 0;
 }
 
-ATTR_NONNULL_ALL dhcp_option* set_option_in_store(dhcp_option_list* store, dhcp_option* option) {
+ATTR_NONNULL_ALL dhcp_option* set_option_in_store(dhcp_option_store* store, dhcp_option* option) {
   DEBUG("set_in_option_store(store, code:%i, len%i)\n", option->code, option->len);
 
-  dhcp_option* current = find_in_option_store(store, option->code);
+  dhcp_option* current = store->option[option->code];
 
   if (current) {
     DEBUG("set_in_option_store(...): replace option\n");
-
-    // Replacing current with new option
-
-    if (current->payload) {
-      free(current->payload);
-    }
-
-    current->len = option->len;
-    current->payload = option->payload;
-
-    return current;
+    free_option(current);
   } else {
     DEBUG("set_in_option_store(...): inserting option\n");
-
-    list_add_tail(&option->option_list, store);
-
-    return option;
   }
-}
 
-ATTR_NONNULL_ALL void free_option(struct dhcp_option* option) {
-  if (option->payload) {
-    free(option->payload);
+  store->option[option->code] = option;
+  store->generation++;
+
+  if (option->code == DHCP_CODE_ADDRESS_LEASE_TIME) {
+    _option_store_lease_time(store);
   }
 
-  free(option);
+  return option;
 }
 
-ATTR_NONNULL_ALL void remove_option_in_store(dhcp_option_list* store, uint8_t code) {
-  dhcp_option* option = find_in_option_store(store, code);
+ATTR_NONNULL_ALL void remove_option_in_store(dhcp_option_store* store, uint8_t code) {
+  dhcp_option* option = store->option[code];
 
   if (option) {
-    list_del(&option->option_list);
+    store->option[code] = NULL;
+    store->generation++;
     free_option(option);
-  }
-}
 
-ATTR_NONNULL_ALL void free_option_store(dhcp_option_list* store) {
-  struct list_head* pos, *q;
-
-  list_for_each_safe(pos, q, store) {
-    dhcp_option* option = list_entry(pos, dhcp_option, option_list);
-    list_del(pos);
-    free_option(option);
+    if (code == DHCP_CODE_ADDRESS_LEASE_TIME) {
+      _option_store_lease_time(store);
+    }
   }
 }
 
-ATTR_NONNULL_ALL dhcp_option* remove_option_from_store(dhcp_option_list* store, uint8_t code);
-
-ATTR_NONNULL_ALL int16_t fill_options(dhcp_option* options, uint8_t len, dhcp_option_list* option_store, uint8_t additional, dhcp_option** fullfil) {
-  uint8_t num_found_options = 0;
-
-  uint8_t* requested = NULL;
-  int max_options = find_option_parameter_request_list(options, len, &requested);
-
-  *fullfil = (dhcp_option*) calloc(sizeof(dhcp_option), (size_t)(max_options + additional));
-
-  if (!*fullfil) {
-    return -ENOMEM;
-  }
-
-  if (! max_options) {
-    return additional;
-  }
-
-  for (uint8_t i = 0; i < max_options; i++) {
-    uint8_t code = requested[i];
-    // LOOP thought option_store
-    dhcp_option* option = find_in_option_store(option_store, code);
-
-    if (option) {
-      memcpy(*fullfil + num_found_options, option, sizeof(dhcp_option));
-      num_found_options++;
+ATTR_NONNULL_ALL void free_option_store(dhcp_option_store* store) {
+  for (int code = 0; code < 256; code++) {
+    if (store->option[code]) {
+      free_option(store->option[code]);
+      store->option[code] = NULL;
     }
   }
-
-  return (int16_t)(num_found_options + additional);
 }
 
 ATTR_NONNULL_ALL void dhcp_options_show(int fd, ddhcp_config* config) {
-  struct dhcp_option* option;
-  dhcp_option_list* store = &config->options;
+  dhcp_option_store* store = &config->options;
 
-  dprintf(fd, "DHCP Lease Time: %u\n\n", find_in_option_store_address_lease_time(&config->options));
+  dprintf(fd, "DHCP Lease Time: %u\n\n", find_in_option_store_address_lease_time(store));
   dprintf(fd, "DHCP Disabled: %u\n", config->disable_dhcp);
   dprintf(fd, "DHCP Option Store\ncode\tlen\tpayload\n");
 
-  list_for_each_entry(option, store, option_list) {
+  for (int code = 0; code < 256; code++) {
+    dhcp_option* option = store->option[code];
+
+    if (!option) {
+      continue;
+    }
+
     dprintf(fd, "%i\t%i\t", option->code, option->len);
 
     for (int i = 0; i < option->len; i++) {
@@ -341,5 +296,205 @@ ATTR_NONNULL_ALL int dhcp_options_init(ddhcp_config* config) {
     set_option_in_store(&config->options, option);
   }
 
+  config->reply_template.generation = 0;
+  config->reply_template.buffer = NULL;
+  config->reply_template.cache_next = 0;
+
+  for (int i = 0; i < DHCP_REPLY_CACHE_SIZE; i++) {
+    config->reply_template.cache[i].generation = 0;
+  }
+
   return 0;
 }
+
+ATTR_NONNULL_ALL static uint8_t* _dhcp_options_template_add(dhcp_reply_template* template, uint8_t* pos, dhcp_option* option) {
+  template->option_offset[option->code] = (uint16_t)(pos - template->buffer + 1);
+  pos[0] = option->code;
+  pos[1] = option->len;
+
+  if (option->len > 0) {
+    memcpy(pos + 2, option->payload, option->len);
+  }
+
+  return pos + 2 + option->len;
+}
+
+ATTR_NONNULL_ALL dhcp_reply_template* dhcp_options_template(ddhcp_config* config) {
+  dhcp_reply_template* template = &config->reply_template;
+
+  dhcp_option_store* store = &config->options;
+
+  if (template->generation == store->generation) {
+    return template;
+  }
+
+  DEBUG("dhcp_options_template(config): rebuild for option store generation %u\n", store->generation);
+
+  // BOOTP header, magic cookie and message type, followed by the store.
+  size_t len = DHCP_REPLY_MESSAGE_TYPE_OFFSET + 1;
+  dhcp_option* option;
+
+  for (int code = 0; code < 256; code++) {
+    if (store->option[code]) {
+      len += 2 + (size_t) store->option[code]->len;
+    }
+  }
+
+  if (len > UINT16_MAX) {
+    ERROR("dhcp_options_template(...): option store of %zu bytes is too large\n", len);
+    return NULL;
+  }
+
+  uint8_t* buffer = (uint8_t*) realloc(template->buffer, len);
+
+  if (!buffer) {
+    WARNING("dhcp_options_template(...): Unable to allocate memory\n");
+    return NULL;
+  }
+
+  template->buffer = buffer;
+  memset(template->option_offset, 0, sizeof(template->option_offset));
+
+  memset(buffer, 0, 240);
+  // BOOTREPLY
+  buffer[0] = 2;
+  // Magic Cookie
+  buffer[236] = 99;
+  buffer[237] = 130;
+  buffer[238] = 83;
+  buffer[239] = 99;
+  // The message type is set per reply.
+  buffer[DHCP_REPLY_MESSAGE_TYPE_OFFSET - 2] = DHCP_CODE_MESSAGE_TYPE;
+  buffer[DHCP_REPLY_MESSAGE_TYPE_OFFSET - 1] = 1;
+  buffer[DHCP_REPLY_MESSAGE_TYPE_OFFSET] = 0;
+
+  uint8_t* pos = buffer + DHCP_REPLY_MESSAGE_TYPE_OFFSET + 1;
+
+  option = find_in_option_store(store, DHCP_CODE_SERVER_IDENTIFIER);
+
+  if (option) {
+    pos = _dhcp_options_template_add(template, pos, option);
+  }
+
+  template->head_len = (uint16_t)(pos - buffer);
+
+  option = find_in_option_store(store, DHCP_CODE_ADDRESS_LEASE_TIME);
+
+  if (option) {
+    pos = _dhcp_options_template_add(template, pos, option);
+  }
+
+  template->head_lease_time_len = (uint16_t)(pos - buffer);
+
+  for (int code = 0; code < 256; code++) {
+    option = store->option[code];
+
+    if (!option) {
+      continue;
+    }
+
+    switch (option->code) {
+    case DHCP_CODE_PAD:
+    case DHCP_CODE_END:
+    case DHCP_CODE_MESSAGE_TYPE:
+    case DHCP_CODE_SERVER_IDENTIFIER:
+    case DHCP_CODE_ADDRESS_LEASE_TIME:
+      break;
+
+    default:
+      pos = _dhcp_options_template_add(template, pos, option);
+      break;
+    }
+  }
+
+  template->generation = store->generation;
+
+  return template;
+}
+
+ATTR_NONNULL_ALL ssize_t dhcp_options_requested(dhcp_reply_template* template, dhcp_packet* request, uint8_t* buffer, size_t size) {
+  uint8_t* requested = NULL;
+  int num_requested = find_option_parameter_request_list(request, &requested);
+
+  if (!num_requested) {
+    return 0;
+  }
+
+  uint32_t hash = 2166136261u;
+
+  // FNV-1a
+  for (int i = 0; i < num_requested; i++) {
+    hash = (hash ^ requested[i]) * 16777619u;
+  }
+
+  struct dhcp_reply_cache_entry* entry = template->cache;
+  struct dhcp_reply_cache_entry* unused = NULL;
+
+  for (; entry < template->cache + DHCP_REPLY_CACHE_SIZE; entry++) {
+    if (entry->generation != template->generation) {
+      if (!unused) {
+        unused = entry;
+      }
+
+      continue;
+    }
+
+    if (entry->hash == hash && entry->requested_len == num_requested && memcmp(entry->requested, requested, (size_t) num_requested) == 0) {
+      if (entry->len > size) {
+        return -EMSGSIZE;
+      }
+
+      memcpy(buffer, entry->options, entry->len);
+      return entry->len;
+    }
+  }
+
+  // Options of the template head are already part of every reply, the lease
+  // time is left out of the ones without.
+  size_t len = 0;
+  uint64_t added[4] = { 0, 0, 0, 0 };
+
+  for (int i = 0; i < num_requested; i++) {
+    uint8_t code = requested[i];
+    uint16_t offset = template->option_offset[code];
+
+    if (offset <= template->head_lease_time_len || added[code / 64] & (1ull << (code % 64))) {
+      continue;
+    }
+
+    uint8_t* option = template->buffer + offset - 1;
+    size_t option_len = 2 + (size_t) option[1];
+
+    if (len + option_len > size) {
+      return -EMSGSIZE;
+    }
+
+    memcpy(buffer + len, option, option_len);
+    len += option_len;
+    added[code / 64] |= 1ull << (code % 64);
+  }
+
+  if (len <= DHCP_REPLY_CACHE_OPTIONS_MAX) {
+    DEBUG("dhcp_options_requested(...): cache options of request list %08x\n", hash);
+
+    if (!unused) {
+      unused = template->cache + template->cache_next;
+      template->cache_next = (uint8_t)((template->cache_next + 1) % DHCP_REPLY_CACHE_SIZE);
+    }
+
+    unused->generation = template->generation;
+    unused->hash = hash;
+    unused->requested_len = (uint8_t) num_requested;
+    memcpy(unused->requested, requested, (size_t) num_requested);
+    unused->len = (uint16_t) len;
+    memcpy(unused->options, buffer, len);
+  }
+
+  return (ssize_t) len;
+}
+
+ATTR_NONNULL_ALL void dhcp_options_template_free(ddhcp_config* config) {
+  free(config->reply_template.buffer);
+  config->reply_template.buffer = NULL;
+  config->reply_template.generation = 0;
+}
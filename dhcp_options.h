@@ -23,58 +23,53 @@ ATTR_NONNULL_ALL int set_option(dhcp_option* options, uint8_t len, uint8_t code,
 ATTR_NONNULL_ALL void remove_option(dhcp_option* options, uint8_t code);
 
 /**
- * Search for the parameter request list option in a list of options.
+ * Search for the parameter request list option of a received packet.
  * On success the requested pointer is set and a positiv integer
  * is returned. Otherwise 0 is returned and requested is pointed to NULL.
  */
-ATTR_NONNULL(1) int find_option_parameter_request_list(dhcp_option* options, uint8_t len, uint8_t** requested);
+ATTR_NONNULL(1) int find_option_parameter_request_list(dhcp_packet* packet, uint8_t** requested);
 
-/** Search for the requested ip address option in a list of options.
- * On success the pointer to the payload is returned, which should be
- * of length 4. TODO Check this
+/** Search for the requested ip address option of a received packet.
+ * On success the pointer to the payload of length 4 is returned.
  * Otherwise the null-pointer is returned.
  */
-ATTR_NONNULL_ALL uint8_t* find_option_requested_address(dhcp_option* options, uint8_t len);
+ATTR_NONNULL_ALL uint8_t* find_option_requested_address(dhcp_packet* packet);
 
 /**
- * First searches the parameter request list in the given options list.
- * Then use the option_store to fulfill those request. The result is
- * left in the fullfil list. In front of the list additional many options are reserved.
- * On failure fullfil_list is the null-pointer and 0 is returned.
- *
- * Caller must handle memory deallocation.
+ * Return the option of code in an option store. Return null otherwise.
  */
-ATTR_NONNULL_ALL int16_t fill_options(dhcp_option* options, uint8_t len, dhcp_option_list* option_store, uint8_t additional, dhcp_option** fullfil);
+#define find_in_option_store(store, code) ((store)->option[code])
 
 /**
- * Search and Retrun a option in an option store. Return null otherwise.
+ * Return the lease time of an option store in seconds, 0 if not set.
  */
-ATTR_NONNULL_ALL dhcp_option* find_in_option_store(dhcp_option_list* options, uint8_t code);
+#define find_in_option_store_address_lease_time(store) ((store)->lease_time)
 
 /**
- * Search and return leasetime option
+ * Is a option defined in a option store
  */
-ATTR_NONNULL_ALL uint32_t find_in_option_store_address_lease_time(dhcp_option_list* options);
+#define has_in_option_store(store, code) (find_in_option_store(store, code) != NULL)
 
 /**
- * Is a option defined in a option store
+ * Initialize an empty option store.
  */
-#define has_in_option_store(options, code) (find_in_option_store(options, code) != NULL)
+ATTR_NONNULL_ALL void init_option_store(dhcp_option_store* store);
 
 /**
- * Search and replace a option in the store, otherwise append it to the store.
+ * Put an option into the store, replacing and freeing the option of the
+ * same code. The store takes ownership of the option.
  */
-ATTR_NONNULL_ALL dhcp_option* set_option_in_store(dhcp_option_list* store, dhcp_option* option);
+ATTR_NONNULL_ALL dhcp_option* set_option_in_store(dhcp_option_store* store, dhcp_option* option);
 
 /**
  * Search and remove a option in the store.
  */
-ATTR_NONNULL_ALL void remove_option_in_store(dhcp_option_list* store, uint8_t code);
+ATTR_NONNULL_ALL void remove_option_in_store(dhcp_option_store* store, uint8_t code);
 
 /**
  * Free option store and all contained dhcp_options.
  */
-ATTR_NONNULL_ALL void free_option_store(dhcp_option_list* store);
+ATTR_NONNULL_ALL void free_option_store(dhcp_option_store* store);
 
 /**
  * Print the inventory of a option store into given file descriptor.
@@ -87,8 +82,27 @@ ATTR_NONNULL_ALL void dhcp_options_show(int fd, ddhcp_config* config);
 ATTR_NONNULL_ALL int dhcp_options_init(ddhcp_config* config);
 
 /**
- * Search for option in store and if found store it in the options list.
+ * Offset of the message type byte in a reply built from the template.
+ */
+#define DHCP_REPLY_MESSAGE_TYPE_OFFSET 242
+
+/**
+ * Return the reply template of the option store, which is rebuilt after the
+ * store has changed, see the generation of the store. Returns NULL on failure.
+ */
+ATTR_NONNULL_ALL dhcp_reply_template* dhcp_options_template(ddhcp_config* config);
+
+/**
+ * Serialise the options of the template requested by the parameter request
+ * list of request into buffer, leaving out the ones of the template head.
+ * The result is cached per request list until the option store changes.
+ * Returns the length or -EMSGSIZE if size is exceeded.
+ */
+ATTR_NONNULL_ALL ssize_t dhcp_options_requested(dhcp_reply_template* template, dhcp_packet* request, uint8_t* buffer, size_t size);
+
+/**
+ * Free the reply template.
  */
-ATTR_NONNULL_ALL int set_option_from_store(dhcp_option_list* store, dhcp_option* options, uint8_t len, uint8_t code);
+ATTR_NONNULL_ALL void dhcp_options_template_free(ddhcp_config* config);
 
 #endif
@@ -5,6 +5,9 @@
 
 #include "types.h"
 #include "logger.h"
+#include "netsock.h"
+
+extern int log_level;
 
 struct sockaddr_in broadcast = {
   .sin_family = AF_INET,
@@ -47,24 +50,29 @@ ATTR_NONNULL_ALL void printf_dhcp(dhcp_packet* packet) {
         , packet->file
        );
 
-  dhcp_option* option = packet->options;
+  uint8_t* option = packet->option_buffer;
 
-  for (int i = 0; i < packet->options_len; i++) {
-    if (option->len == 1) {
-      DEBUG("DHCP OPTION [ code %i, length %i, value %i ]\n", option->code, option->len, option->payload[0]);
-    } else if (option->code == DHCP_CODE_PARAMETER_REQUEST_LIST) {
-      DEBUG("DHCP OPTION [ code %i, length %i, value ", option->code, option->len);
+  while (option < packet->option_buffer + packet->option_buffer_len) {
+    if (option[0] == DHCP_CODE_PAD) {
+      option++;
+      continue;
+    }
 
-      for (int k = 0; k < option->len; k++) {
-        LOG("%i ", option->payload[k]);
+    if (option[1] == 1) {
+      DEBUG("DHCP OPTION [ code %i, length %i, value %i ]\n", option[0], option[1], option[2]);
+    } else if (option[0] == DHCP_CODE_PARAMETER_REQUEST_LIST) {
+      DEBUG("DHCP OPTION [ code %i, length %i, value ", option[0], option[1]);
+
+      for (int k = 0; k < option[1]; k++) {
+        LOG("%i ", option[2 + k]);
       }
 
       LOG("]\n");
     } else {
-      DEBUG("DHCP OPTION [ code %i, length %i ]\n", option->code, option->len);
+      DEBUG("DHCP OPTION [ code %i, length %i ]\n", option[0], option[1]);
     }
 
-    option++;
+    option += 2 + option[1];
   }
 }
 # else
@@ -134,125 +142,84 @@ ATTR_NONNULL_ALL ssize_t ntoh_dhcp_packet(dhcp_packet* packet, uint8_t* buffer,
     return -7;
   }
 
-  uint8_t* option = buffer + 236 + 4;
+  // Index the options in a single pass, the first option of a code counts.
+  memset(packet->option_index, 0, sizeof(packet->option_index));
+  packet->options_len = 0;
+  packet->options = NULL;
+  packet->option_buffer = buffer + 240;
 
-  // Count options
-  size_t options = 0;
-  int exit = 0;
-  int dhcp_message_type = 0;
-  int dhcp_request_list = 0;
+  uint8_t* option = packet->option_buffer;
+  uint8_t* end = buffer + len;
 
-  while (option < buffer + len && exit == 0) {
-    switch ((uint8_t) option[0]) {
-    case DHCP_CODE_PAD:
-      // JUMP the padding
-      option += 1;
-      continue;
-      break;
+  while (option < end) {
+    uint8_t code = option[0];
 
-    case DHCP_CODE_END:
-      options++;
-      exit = 1;
+    if (code == DHCP_CODE_PAD) {
+      option++;
       continue;
-      break;
-
-    case DHCP_CODE_MESSAGE_TYPE:
-      dhcp_message_type = 1;
-      break;
-
-    case DHCP_CODE_PARAMETER_REQUEST_LIST:
-      dhcp_request_list = 1;
-      break;
+    }
 
-    default:
+    if (code == DHCP_CODE_END) {
       break;
     }
 
-    if (option + 1 > buffer + len) {
+    if (option + 2 > end) {
       WARNING("ntoh_dhcp_packet(...): DHCP options ended improperly, possible broken client.\n");
       return -4;
     }
 
-    if (option + option[1] + 2 > buffer + len) {
+    if (option + 2 + option[1] > end) {
       // Error: Malformed dhcp options
       WARNING("ntoh_dhcp_packet(...): DHCP options smaller than len of last option suggests, possible broken client.\n");
       return -5;
-    } else {
-      option += (uint8_t) option[1] + 2;
-      options++;
     }
+
+    if (!packet->option_index[code]) {
+      packet->option_index[code] = (uint16_t)(option - packet->option_buffer + 1);
+    }
+
+    option += 2 + option[1];
   }
 
-  if (dhcp_message_type != 1) {
+  packet->option_buffer_len = (uint16_t)(option - packet->option_buffer);
+
+  uint8_t* message_type = dhcp_packet_option(packet, DHCP_CODE_MESSAGE_TYPE);
+
+  if (!message_type || message_type[1] < 1) {
     INFO("ntoh_dhcp_packet(...): Message contains no message type - invalid!\n");
     return -6;
   }
 
-  if (dhcp_request_list != 1) {
+  if (!packet->option_index[DHCP_CODE_PARAMETER_REQUEST_LIST]) {
     DEBUG("ntoh_dhcp_packet(...): Message contains no DHCP request list - broken client?\n");
   }
 
-  packet->options_len = (uint8_t)options;
-  packet->options = (dhcp_option*) calloc(options, sizeof(dhcp_option));
+#if LOG_LEVEL_LIMIT >= LOG_INFO
 
-  if (!packet->options) {
-    WARNING("ntoh_dhcp_packet(...): option memory allocation failed.\n");
-    return -ENOMEM;
+  if (log_level >= LOG_DEBUG) {
+    printf_dhcp(packet);
   }
 
-  option = buffer + 236 + 4;
-
-  exit = 0;
-  uint8_t i = 0;
-
-  while (option < buffer + len && exit == 0) {
-    switch ((uint8_t) option[0]) {
-    case DHCP_CODE_END:
-      exit = 1;
-
-    /* fall through */
-
-    case DHCP_CODE_PAD:
-      // JUMP padding and end
-      packet->options[i].code = option[0];
-      packet->options[i].len  = 0;
-      packet->options[i].payload = NULL;
-
-      option += 1;
-      i++;
-      break;
-
-    default:
-      packet->options[i].code = option[0];
-      packet->options[i].len  = option[1];
-      packet->options[i].payload = option + 2;
-
-      option += (uint8_t) option[1] + 2;
-      i++;
-      break;
-    }
-  }
-
-  assert(i == options);
-
-#if LOG_LEVEL_LIMIT >= LOG_INFO
-  printf_dhcp(packet);
 #endif
 
   return 0;
 }
 
-ATTR_NONNULL_ALL ssize_t dhcp_packet_send(int socket, dhcp_packet* packet) {
-  DEBUG("dhcp_packet_send(socket:%i, dhcp_packet)\n", socket);
+ATTR_NONNULL_ALL ssize_t dhcp_packet_send(ddhcp_epoll_data* socket, dhcp_packet* packet) {
+  DEBUG("dhcp_packet_send(socket:%i, dhcp_packet)\n", socket->fd);
   uint16_t tmp16;
   uint32_t tmp32;
+  size_t len = _dhcp_packet_len(packet);
 
-  uint8_t* buffer = calloc(sizeof(char), _dhcp_packet_len(packet));
-
-  if (!buffer) {
-    return -ENOMEM;
+  if (len > socket->tx_size) {
+    ERROR("dhcp_packet_send(...): Packet of %zu bytes exceeds the transmit buffer\n", len);
+    return -EMSGSIZE;
   }
 
+  // The packet is serialised into the transmit queue of the socket.
+  uint8_t* buffer = socket->tx_buffer;
+  memset(buffer, 0, len);
+
   // Header
   buffer[0] = packet->op;
   buffer[1] = packet->htype;
@@ -301,10 +268,15 @@ ATTR_NONNULL_ALL ssize_t dhcp_packet_send(int socket, dhcp_packet* packet) {
     option++;
   }
 
-  buffer[_dhcp_packet_len(packet) - 1] = 255;
-  assert(obuf + 1 == buffer + _dhcp_packet_len(packet));
+  buffer[len - 1] = 255;
+  assert(obuf + 1 == buffer + len);
+
+  return dhcp_packet_send_serialised(socket, packet, len);
+}
+
+ATTR_NONNULL_ALL ssize_t dhcp_packet_send_serialised(ddhcp_epoll_data* socket, dhcp_packet* packet, size_t len) {
   // Network send
-  printf("Message LEN: %zu\n", _dhcp_packet_len(packet));
+  DEBUG("dhcp_packet_send_serialised(...): Message LEN: %zu\n", len);
 
   struct sockaddr_in *address = &broadcast;
   // Check the broadcast flag
@@ -314,7 +286,7 @@ ATTR_NONNULL_ALL ssize_t dhcp_packet_send(int socket, dhcp_packet* packet) {
     if ( memcmp(zeros,&packet->ciaddr,4) != 0) {
       #if LOG_LEVEL_LIMIT >= LOG_DEBUG
       char ipv4_sender[INET_ADDRSTRLEN];
-      DEBUG("dhcp_packet_send: Sending unicast to %s \n",inet_ntop(AF_INET, &packet->ciaddr, ipv4_sender, INET_ADDRSTRLEN));
+      DEBUG("dhcp_packet_send_serialised: Sending unicast to %s \n",inet_ntop(AF_INET, &packet->ciaddr, ipv4_sender, INET_ADDRSTRLEN));
       #endif
       address = &unicast;
       address->sin_addr = packet->ciaddr;
@@ -322,55 +294,26 @@ ATTR_NONNULL_ALL ssize_t dhcp_packet_send(int socket, dhcp_packet* packet) {
   } 
   address->sin_port = htons(68);
 
-  ssize_t bytes_send = sendto(socket, buffer, _dhcp_packet_len(packet), 0, (struct sockaddr*)address, sizeof(broadcast));
+  socket->tx_len = len;
 
-  if ( bytes_send < 0 ) {
-    ERROR("dhcp_packet_send(...): Failed (%i): %s\n",errno,strerror(errno));
-  }
-
-  free(buffer);
-
-  return bytes_send;
+  return netsock_tx_enqueue(socket, (struct sockaddr*)address, sizeof(broadcast));
 }
 
 ATTR_NONNULL_ALL int dhcp_packet_copy(dhcp_packet* dest, dhcp_packet* src) {
-  int err;
-
   memcpy(dest, src, sizeof(struct dhcp_packet));
-  dest->options = (struct dhcp_option*) calloc(src->options_len, sizeof(struct dhcp_option));
-
-  if (!dest->options) {
-    return 1;
-  }
-
-  dhcp_option* src_option = src->options;
-  dhcp_option* dest_option = dest->options;
-
-  for (; src_option < src->options + src->options_len; src_option++) {
-    uint8_t* dest_payload = (uint8_t*) calloc(src_option->len, sizeof(uint8_t));
+  dest->options_len = 0;
+  dest->options = NULL;
 
-    if (!dest_payload) {
-      err = -ENOMEM;
-      goto fail_options;
-    }
+  // The option index stays valid, its offsets are relative to the buffer.
+  dest->option_buffer = (uint8_t*) malloc(src->option_buffer_len);
 
-    memcpy(dest_payload, src_option->payload, src_option->len);
-    dest_option->code = src_option->code;
-    dest_option->len = src_option->len;
-    dest_option->payload = dest_payload;
-    dest_option++;
+  if (!dest->option_buffer) {
+    return -ENOMEM;
   }
 
-  return 0;
-
-fail_options:
-
-  while (dest_option-- > dest->options) {
-    free(dest_option->payload);
-  }
+  memcpy(dest->option_buffer, src->option_buffer, src->option_buffer_len);
 
-  free(dest->options);
-  return err;
+  return 0;
 }
 
 ATTR_NONNULL_ALL int dhcp_packet_list_add(dhcp_packet_list* list, dhcp_packet* packet) {
@@ -383,7 +326,12 @@ ATTR_NONNULL_ALL int dhcp_packet_list_add(dhcp_packet_list* list, dhcp_packet* p
     return 1;
   }
 
-  dhcp_packet_copy(copy, packet);
+  if (dhcp_packet_copy(copy, packet)) {
+    ERROR("dhcp_packet_list_add(...): Unable to allocate memory\n");
+    free(copy);
+    return 1;
+  }
+
   copy->timeout = now + 120;
   list_add_tail(&copy->packet_list, list);
   return 0;
@@ -425,17 +373,9 @@ ATTR_NONNULL_ALL void dhcp_packet_list_free(dhcp_packet_list* list) {
 }
 
 ATTR_NONNULL_ALL uint8_t dhcp_packet_message_type(dhcp_packet* packet) {
-  dhcp_option* option = packet->options;
-
-  for (int i = 0; i < packet->options_len; i++) {
-    if (option->code == DHCP_CODE_MESSAGE_TYPE) {
-      return (uint8_t) option->payload[0];
-    }
+  uint8_t* option = dhcp_packet_option(packet, DHCP_CODE_MESSAGE_TYPE);
 
-    option++;
-  }
-
-  return 0;
+  return option ? option[2] : 0;
 }
 
 ATTR_NONNULL_ALL void dhcp_packet_list_timeout(dhcp_packet_list* list) {
@@ -449,6 +389,7 @@ ATTR_NONNULL_ALL void dhcp_packet_list_timeout(dhcp_packet_list* list) {
     if (packet->timeout < now) {
       list_del(pos);
       dhcp_packet_free(packet, 1);
+      free(packet);
       DEBUG("dhcp_packet_list_timeout(...): drop packet from cache\n");
     }
   }
@@ -6,6 +6,8 @@
 #include <netinet/in.h>
 #include "types.h"
 
+struct ddhcp_epoll_data;
+
 // List of dhcp_packet
 typedef struct list_head dhcp_packet_list;
 
@@ -28,6 +30,12 @@ struct dhcp_packet {
   struct in_addr giaddr;
   struct dhcp_option* options;
 
+  // Options of a received packet in wire format, see ntoh_dhcp_packet.
+  uint8_t* option_buffer;
+  uint16_t option_buffer_len;
+  // Offset + 1 of the first option of each code in the option_buffer, 0 if absent.
+  uint16_t option_index[256];
+
   dhcp_packet_list packet_list;
 };
 typedef struct dhcp_packet dhcp_packet;
@@ -71,32 +79,46 @@ ATTR_NONNULL_ALL void dhcp_packet_list_free(dhcp_packet_list* list);
 ATTR_NONNULL_ALL void printf_dhcp(dhcp_packet* packet);
 
 /**
- * Memcpy a packet into another packet.
+ * Copy a received packet into another packet, the copy owns its option buffer.
  */
 ATTR_NONNULL_ALL int dhcp_packet_copy(dhcp_packet* dest, dhcp_packet* src);
 
 
 /**
- * Free a packet.
+ * Free a packet, the option buffer is freed for copies only.
  */
 #define dhcp_packet_free(packet,free_payload) do {\
     if ( free_payload > 0 ) {\
-      dhcp_option* _option = packet->options;\
-      for (; _option < packet->options + packet->options_len; _option++) {\
-        free(_option->payload);\
-      }\
+      free(packet->option_buffer);\
     }\
     free(packet->options);\
   } while(0)
 
+/**
+ * Return a pointer to the first option of code in a received packet, the
+ * length follows at offset 1 and the payload at offset 2. NULL if absent.
+ */
+#define dhcp_packet_option(packet,code) \
+  ((packet)->option_index[code] ? (packet)->option_buffer + (packet)->option_index[code] - 1 : NULL)
+
 /**
  * Reads and checks a dhcp_packet from buffer. Will return zero on success.
- * To reduce memory consumption and prevent further memcpy operations this will
- * make pointer to the buffer inside of the dhcp_packet structure. Do not free
- * the buffer before the last operation on that struture!
+ * The options are not copied, they are indexed by code in a single pass over
+ * the buffer and option_buffer points into it. Do not free the buffer before
+ * the last operation on that struture!
  */
 ATTR_NONNULL_ALL ssize_t ntoh_dhcp_packet(dhcp_packet* packet, uint8_t* buffer, ssize_t len);
-ATTR_NONNULL_ALL ssize_t dhcp_packet_send(int socket, dhcp_packet* packet);
+/**
+ * Serialise a dhcp_packet into the transmit queue of the socket.
+ * The packet is sent when the queue is flushed.
+ */
+ATTR_NONNULL_ALL ssize_t dhcp_packet_send(struct ddhcp_epoll_data* socket, dhcp_packet* packet);
+
+/**
+ * Send a reply of len bytes, which was serialised into the transmit buffer
+ * of the socket. The destination follows the flags and ciaddr of packet.
+ */
+ATTR_NONNULL_ALL ssize_t dhcp_packet_send_serialised(struct ddhcp_epoll_data* socket, dhcp_packet* packet, size_t len);
 
 ATTR_NONNULL_ALL uint8_t dhcp_packet_message_type(dhcp_packet* packet);
 
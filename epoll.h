@@ -12,6 +12,14 @@ struct ddhcp_epoll_data {
   int fd;
   int interface_id;
   char* interface_name;
+  // MTU of the interface, 0 if unknown.
+  uint32_t mtu;
+  // Transmit queue of the socket. Messages are serialised in place
+  // into the transmit buffer, which is the free slot of the queue.
+  struct netsock_tx_queue* tx_queue;
+  uint8_t* tx_buffer;
+  size_t tx_size;
+  size_t tx_len;
   void* data;
   ddhcpd_socket_init_t setup;
   ddhcpd_epoll_event_t epollin;
@@ -20,7 +28,11 @@ struct ddhcp_epoll_data {
 typedef struct ddhcp_epoll_data ddhcp_epoll_data;
 
 #define epoll_get_fd(data) (((ddhcp_epoll_data*) data.ptr)->fd)
-#define epoll_data_free(data) (free(data.ptr))
+#define epoll_data_free(data) \
+  do { \
+    free(((ddhcp_epoll_data*) data.ptr)->tx_queue); \
+    free(data.ptr); \
+  } while (0)
 #define epoll_data_call(data,method,config) data->method((epoll_data_t){.ptr=(void*)data},config)
 
 /**
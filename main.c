@@ -3,6 +3,7 @@
 #include <getopt.h>
 #include <math.h>
 #include <netinet/in.h>
+#include <sys/random.h>
 #include <sys/un.h>
 #include <sys/types.h>
 #include <sys/socket.h>
@@ -13,8 +14,10 @@
 #include <limits.h>
 
 #include "block.h"
+#include "checkpoint.h"
 #include "control.h"
 #include "ddhcp.h"
+#include "demand.h"
 #include "dhcp.h"
 #include "dhcp_options.h"
 #include "dhcp_packet.h"
@@ -24,7 +27,10 @@
 #include "netlink.h"
 #include "netsock.h"
 #include "packet.h"
+#include "peer.h"
+#include "pool.h"
 #include "statistics.h"
+#include "timer.h"
 #include "tools.h"
 #include "version.h"
 
@@ -35,7 +41,7 @@ extern int log_level;
 const int NET = 0;
 const int NET_LEN = 10;
 
-uint8_t* buffer = NULL;
+netsock_rx_ring* rx_ring = NULL;
 
 ATTR_NONNULL_ALL in_addr_storage get_in_addr(struct sockaddr* sa)
 {
@@ -59,21 +65,39 @@ ATTR_NONNULL_ALL in_addr_storage get_in_addr(struct sockaddr* sa)
  *
  * - Free timed-out DHCP leases.
  * - Refresh timed-out blocks.
- * + Claim new blocks if we are low on spare leases.
- * + Update our claims.
+ * - Free the blocks of nodes, which stopped sending heartbeats.
+ * + Claim new blocks if we are low on spare leases or expect to be soon.
+ * + Answer DISCOVERs parked for lack of free leases.
+ * + Update our claims and send our heartbeat.
+ * + Forget nodes without blocks, which have not been seen for a while.
  */
 ATTR_NONNULL_ALL void house_keeping(ddhcp_config* config) {
   DEBUG("house_keeping(blocks,config)\n");
+  time_t now = time(NULL);
   block_check_timeouts(config);
+  block_check_peers(config);
+  demand_sample(&config->demand, now);
+
+  // A block is ours after three inquiries, one per house keeping round.
+  time_t claim_latency = 3 * (config->tentative_timeout >> 1);
+  uint32_t expected_leases = demand_expected(&config->demand, now, claim_latency);
 
   uint32_t spare_leases = block_num_free_leases(config);
-  int32_t leases_needed = (int32_t)config->spare_leases_needed - (int32_t)spare_leases;
+  // Parked DISCOVERs and the leases expected until a claim completes
+  // are demand on top of the spare leases.
+  int32_t leases_needed = (int32_t)config->spare_leases_needed + (int32_t)config->dhcp_discover_parked
+                          + (int32_t)expected_leases - (int32_t)spare_leases;
   int32_t blocks_needed = leases_needed / config->block_size;
 
   if (leases_needed % config->block_size > 0) {
     blocks_needed++;
   }
 
+  // The number of blocks in claiming process is bounded.
+  if (blocks_needed > UINT8_MAX) {
+    blocks_needed = UINT8_MAX;
+  }
+
   if (blocks_needed < 0 ) {
     block_drop_unused(config);
   } else {
@@ -85,18 +109,74 @@ ATTR_NONNULL_ALL void house_keeping(ddhcp_config* config) {
     }
   }
 
+  // Answer the clients waiting for the blocks we just took ownership of.
+  if (config->dhcp_discover_parked > 0 && config->disable_dhcp == 0) {
+    dhcp_hdl_parked(DDHCP_SKT_DHCP(config), config);
+  }
+
+  // Reserve lease storage for the blocks in claiming process ahead,
+  // so taking ownership of them does not allocate.
+  pool_reserve(&config->lease_blocks, config->claiming_blocks_amount);
+
   block_update_claims(config);
+  block_send_heartbeat(config);
+
+  // Give back the pages of the block table, which are no longer used.
+  block_collect_pages(config);
+
+  // Forget the nodes, whose claims have all expired.
+  peer_collect(&config->peers, now, config->block_timeout);
 
   dhcp_packet_list_timeout(&config->dhcp_packet_cache);
   DEBUG("house_keeping(...) finish\n\n");
 }
 
 
-ATTR_NONNULL_ALL uint32_t get_loop_timeout(ddhcp_config* config) {
-  //Multiply by 500 to convert the timeout value given in seconds
-  //into milliseconds AND dividing the value by two at the same time.
-  //The integer overflow occuring for timeouts greater than 99.4 days is ignored here.
-  return config->tentative_timeout * 500u;
+/**
+ * Earliest time at which a timer of the queue has expired, or the given
+ * fallback when no timer is scheduled before it.
+ */
+ATTR_NONNULL_ALL static time_t next_timer_expiry(ddhcp_timer_queue* queue, time_t fallback) {
+  if (timer_queue_len(queue) == 0) {
+    return fallback;
+  }
+
+  // A timer expires once its due time lies in the past.
+  time_t due = timer_queue_next(queue) + 1;
+
+  return due < fallback ? due : fallback;
+}
+
+/**
+ * Milliseconds until either the next house keeping, the next timer or the next
+ * claim refresh is due.
+ * Timers are ignored during the learning phase, as they are not processed then,
+ * but the next state request is.
+ */
+ATTR_NONNULL_ALL int get_loop_timeout(ddhcp_config* config, time_t next_house_keeping) {
+  time_t next = next_house_keeping;
+
+  if (config->learning_phase) {
+    if (config->state_sync.requests < DDHCP_STATE_REQUESTS && config->state_sync.next_request < next) {
+      next = config->state_sync.next_request;
+    }
+  } else {
+    next = next_timer_expiry(&config->block_timers, next);
+    next = next_timer_expiry(&config->lease_timers, next);
+  }
+
+  if (config->claim_refresh_next < next) {
+    next = config->claim_refresh_next;
+  }
+
+  time_t now = time(NULL);
+
+  if (next <= now) {
+    return 0;
+  }
+
+  //The integer overflow occuring for timeouts greater than 24.8 days is ignored here.
+  return (int)(next - now) * 1000;
 }
 
 typedef void (*sighandler_t)(int);
@@ -126,54 +206,71 @@ void handle_signal_terminate(int sig_nr) {
 
 ATTR_NONNULL_ALL int hdl_ddhcp_dhcp(epoll_data_t data, ddhcp_config* config) {
   int fd = epoll_get_fd(data);
-  ssize_t len;
-  struct sockaddr_in6 sender;
-  socklen_t sender_len = sizeof sender;
+  int n;
+
+  do {
+    n = netsock_recv_batch(fd, rx_ring);
 
-  while ((len = recvfrom(fd, buffer, 1500, 0, (struct sockaddr*) &sender, &sender_len)) > 0) {
+    for (int i = 0; i < n; i++) {
+      ssize_t len = (ssize_t) rx_ring->msgs[i].msg_len;
 #if LOG_LEVEL_LIMIT >= LOG_DEBUG
-    in_addr_storage in_addr;
-    char ipv6_sender[INET6_ADDRSTRLEN];
-    in_addr = get_in_addr((struct sockaddr*)&sender);
-    DEBUG("Receive message from %s\n", inet_ntop(AF_INET6, &in_addr, ipv6_sender, INET6_ADDRSTRLEN));
+      in_addr_storage in_addr;
+      char ipv6_sender[INET6_ADDRSTRLEN];
+      in_addr = get_in_addr((struct sockaddr*)&rx_ring->sender[i]);
+      DEBUG("Receive message from %s\n", inet_ntop(AF_INET6, &in_addr, ipv6_sender, INET6_ADDRSTRLEN));
 #endif
-    statistics_record(config, STAT_DIRECT_RECV_BYTE, (long int)len);
-    statistics_record(config, STAT_DIRECT_RECV_PKG, 1);
-    ddhcp_dhcp_process(buffer, len, sender, config);
-  }
+      statistics_record(config, STAT_DIRECT_RECV_BYTE, (long int)len);
+      statistics_record(config, STAT_DIRECT_RECV_PKG, 1);
+      ddhcp_dhcp_process(rx_ring->buffer[i], len, rx_ring->sender[i], config);
+    }
+  } while (n == NETSOCK_BATCH_SIZE);
+
   return 0;
 }
 
 ATTR_NONNULL_ALL int hdl_ddhcp_block(epoll_data_t data, ddhcp_config* config) {
   int fd = epoll_get_fd(data);
-  ssize_t len;
-  struct sockaddr_in6 sender;
-  socklen_t sender_len = sizeof sender;
+  int n;
 
-  while ((len = recvfrom(fd, buffer, 1500, 0, (struct sockaddr*) &sender, &sender_len)) > 0) {
+  do {
+    n = netsock_recv_batch(fd, rx_ring);
+
+    for (int i = 0; i < n; i++) {
+      ssize_t len = (ssize_t) rx_ring->msgs[i].msg_len;
 #if LOG_LEVEL_LIMIT >= LOG_DEBUG
-    in_addr_storage in_addr;
-    char ipv6_sender[INET6_ADDRSTRLEN];
-    in_addr = get_in_addr((struct sockaddr*)&sender);
-    DEBUG("Receive message from %s\n", inet_ntop(AF_INET6, &in_addr, ipv6_sender, INET6_ADDRSTRLEN));
+      in_addr_storage in_addr;
+      char ipv6_sender[INET6_ADDRSTRLEN];
+      in_addr = get_in_addr((struct sockaddr*)&rx_ring->sender[i]);
+      DEBUG("Receive message from %s\n", inet_ntop(AF_INET6, &in_addr, ipv6_sender, INET6_ADDRSTRLEN));
 #endif
-    statistics_record(config, STAT_MCAST_RECV_BYTE, (long int)len);
-    statistics_record(config, STAT_MCAST_RECV_PKG, 1);
-    ddhcp_block_process(buffer, len, sender, config);
-  }
+      statistics_record(config, STAT_MCAST_RECV_BYTE, (long int)len);
+      statistics_record(config, STAT_MCAST_RECV_PKG, 1);
+      ddhcp_block_process(rx_ring->buffer[i], len, rx_ring->sender[i], config);
+    }
+  } while (n == NETSOCK_BATCH_SIZE);
+
+  // Answer all inquiries and conflicting claims of the batch at once.
+  block_reannounce_flush(config);
+
   return 1;
 }
 
 ATTR_NONNULL_ALL int hdl_dhcp(epoll_data_t data, ddhcp_config* config) {
   int fd = epoll_get_fd(data);
-  ssize_t len;
   int need_house_keeping = 0;
+  int n;
+
+  do {
+    n = netsock_recv_batch(fd, rx_ring);
+
+    for (int i = 0; i < n; i++) {
+      ssize_t len = (ssize_t) rx_ring->msgs[i].msg_len;
+      statistics_record(config, STAT_DHCP_RECV_BYTE, (long int)len);
+      statistics_record(config, STAT_DHCP_RECV_PKG, 1);
+      need_house_keeping |= dhcp_process(rx_ring->buffer[i], len, config);
+    }
+  } while (n == NETSOCK_BATCH_SIZE);
 
-  while ((len = read(fd, buffer, 1500)) > 0) {
-    statistics_record(config, STAT_DHCP_RECV_BYTE, (long int)len);
-    statistics_record(config, STAT_DHCP_RECV_PKG, 1);
-    need_house_keeping |= dhcp_process(buffer, len, config);
-  }
   return need_house_keeping;
 }
 
@@ -181,9 +278,9 @@ ATTR_NONNULL_ALL int hdl_ctrl_cmd(epoll_data_t data, ddhcp_config* config) {
   int fd = epoll_get_fd(data);
   ssize_t len;
   // Handle commands comming over a control_socket
-  len = read(fd, buffer, 1500);
+  len = read(fd, rx_ring->buffer[0], NETSOCK_BUFFER_SIZE);
 
-  if (handle_command(fd, buffer, len, config) < 0) {
+  if (handle_command(fd, rx_ring->buffer[0], len, config) < 0) {
     ERROR("Malformed command on control socket.\n");
   }
 
@@ -211,6 +308,14 @@ int main(int argc, char** argv) {
   srand((unsigned int)time(NULL));
 
   ddhcp_config config;
+
+  // Identify this node by a random node id.
+  if (getrandom(config.node_id, sizeof(ddhcp_node_id), 0) != sizeof(ddhcp_node_id)) {
+    for (uint32_t i = 0; i < sizeof(ddhcp_node_id); i++) {
+      config.node_id[i] = (uint8_t) rand();
+    }
+  }
+
   config.block_size = 32;
   config.claiming_blocks_amount = 0;
 
@@ -223,6 +328,10 @@ int main(int argc, char** argv) {
   config.tentative_timeout = 15;
   config.control_path = (char*)"/tmp/ddhcpd_ctl";
   config.disable_dhcp = 0;
+  config.lease_blocks_prealloc = 0;
+  config.claim_ranges = 0;
+  config.learning_phase = 1;
+  config.checkpoint_path = NULL;
 
   config.hook_command = NULL;
 
@@ -232,11 +341,14 @@ int main(int argc, char** argv) {
 
   // DHCP
   config.dhcp_port = 67;
-  INIT_LIST_HEAD(&config.options);
+  init_option_store(&config.options);
 
   INIT_LIST_HEAD(&config.claiming_blocks);
 
   INIT_LIST_HEAD(&config.dhcp_packet_cache);
+  INIT_LIST_HEAD(&config.dhcp_discover_queue);
+  config.dhcp_discover_parked = 0;
+  demand_init(&config.demand, time(NULL));
 
   char* interface = (char*)"server0";
   char* interface_client = (char*)"client0";
@@ -245,9 +357,8 @@ int main(int argc, char** argv) {
 
   int c;
   int show_usage = 0;
-  int learning_phase = 1;
 
-  while ((c = getopt(argc, argv, "C:c:i:St:dvVDhLb:B:N:o:s:H:n:")) != -1) {
+  while ((c = getopt(argc, argv, "C:c:i:St:dvVDhLb:B:N:o:s:H:n:P:RF:")) != -1) {
     switch (c) {
     case 'i':
       interface = optarg;
@@ -298,7 +409,7 @@ int main(int argc, char** argv) {
       break;
 
     case 'L':
-      learning_phase = 0;
+      config.learning_phase = 0;
       break;
 
     case 'V':
@@ -373,6 +484,18 @@ int main(int argc, char** argv) {
       config.block_needless_timeout = (uint16_t)(atoi(optarg));
       break;
 
+    case 'P':
+      config.lease_blocks_prealloc = (uint32_t)strtoul(optarg, NULL, 0);
+      break;
+
+    case 'R':
+      config.claim_ranges = 1;
+      break;
+
+    case 'F':
+      config.checkpoint_path = optarg;
+      break;
+
     default:
       printf("ARGC: %i\n", argc);
       show_usage = 1;
@@ -394,6 +517,9 @@ int main(int argc, char** argv) {
     printf("-B TIMEOUT             Block claim timeout\n");
     printf("-n NEEDLESS_TIMEOUT    Time until we release needless blocks\n");
     printf("-s SPARELEASES         Amount of spare leases (max: 256)\n");
+    printf("-P NUM                 Preallocate lease storage for NUM blocks\n");
+    printf("-R                     Announce adjacent blocks as range claims\n");
+    printf("-F FILE                Keep our blocks and leases in FILE across restarts\n");
     printf("-L                     Deactivate learning phase\n");
     printf("-d                     Run in background and daemonize\n");
     printf("-D                     Run in foreground and log to console (default)\n");
@@ -441,8 +567,17 @@ int main(int argc, char** argv) {
     //openlog("ddhcp", LOG_PID | LOG_CONS | LOG_NDELAY, LOG_DAEMON);
   }
 
+  // The checkpoint holds our node id, which is needed for the block structure.
+  int ret = checkpoint_open(&config);
+
+  if (ret) {
+    FATAL("Failed to open checkpoint %s: %s\n", config.checkpoint_path, strerror(-ret));
+    exit(1);
+  }
+
   // init block stucture
   ddhcp_block_init(&config);
+  checkpoint_restore(&config);
 
   if (dhcp_options_init(&config)) {
     FATAL("Failed to allocate memory for option store\n");
@@ -455,9 +590,9 @@ int main(int argc, char** argv) {
   // Initializing Network Buffer, EPOLL and Sockets 
   // Here all later event loop handling is initialized
   // --------------------------------------------------------------------------
-  buffer = (uint8_t*) malloc(sizeof(uint8_t) * 1500);
+  rx_ring = netsock_rx_ring_new();
 
-  if (!buffer) {
+  if (!rx_ring) {
     FATAL("Failed to allocate network buffer\n");
     abort();
   }
@@ -495,54 +630,51 @@ int main(int argc, char** argv) {
   // Main event loop && House keeping handler
   // --------------------------------------------------------------------------
   int need_house_keeping = 0;
-  uint32_t loop_timeout = config.loop_timeout = get_loop_timeout(&config);
   time_t now = time(NULL);
   // The first time we want to make housekeeping is after the learning phase, 
   // which is block_timeout long. 
   time_t timeout_time = now + config.block_timeout;
 
-  if (!learning_phase) {
+  if (!config.learning_phase) {
     // We want no learning phase, so reset all the timers
-    loop_timeout = 0;
     timeout_time = now;
     hook(HOOK_LEARNING_PHASE_END,&config);
   }
 
 
-  INFO("loop timeout: %i msecs\n", get_loop_timeout(&config));
+  INFO("house keeping interval: %i secs\n", config.tentative_timeout >> 1);
 
   do {
     int n = 0;
+    if (config.learning_phase) {
+      ddhcp_state_request(&config);
+    }
+
+    int loop_timeout = get_loop_timeout(&config, timeout_time);
     do {
-      n = epoll_wait(config.epoll_fd, events, (int)maxevents, (int)loop_timeout);
+      n = epoll_wait(config.epoll_fd, events, (int)maxevents, loop_timeout);
     } while (n < 0 && errno == EINTR);
 
     if (n < 0) {
       ERROR("epoll error (%i) %s",errno,strerror(errno));
     }
 
-#if LOG_LEVEL_LIMIT >= LOG_DEBUG
-    if (loop_timeout != config.loop_timeout) {
-      DEBUG("Increase loop timeout from %i to %i\n", loop_timeout, config.loop_timeout);
-    }
-#endif
-
-    loop_timeout = config.loop_timeout;
-
     now = time(NULL);
     if (timeout_time <= now) {
       // Our time for house keeping has come
       need_house_keeping = 1;
       // The next time for house keeping is in half the tentative timeout.
       timeout_time = now + (config.tentative_timeout >> 1);
-      if (learning_phase) {
-        learning_phase = 0;
+      if (config.learning_phase) {
+        config.learning_phase = 0;
         hook(HOOK_LEARNING_PHASE_END,&config);
       }
     } else { 
       need_house_keeping = 0;
     }
 
+    int was_learning = config.learning_phase;
+
     for (int i = 0; i < n; i++) {
       ddhcp_epoll_data* data = (ddhcp_epoll_data*) events[i].data.ptr;
       if ((events[i].events & EPOLLERR)) {
@@ -557,10 +689,37 @@ int main(int argc, char** argv) {
       } 
     }
 
-    if (need_house_keeping) {
-      if (!learning_phase) {
-        house_keeping(&config);
+    if (was_learning && !config.learning_phase) {
+      // The state of another node ended the learning phase early.
+      need_house_keeping = 1;
+      timeout_time = now + (config.tentative_timeout >> 1);
+      hook(HOOK_LEARNING_PHASE_END,&config);
+    }
+
+    if (config.learning_phase) {
+      // Blocks restored from the checkpoint stay claimed while we learn.
+      if (config.claim_refresh_next <= now) {
+        block_update_claims(&config);
+      }
+    } else if (need_house_keeping) {
+      house_keeping(&config);
+    } else {
+      now = time(NULL);
+
+      if (timer_queue_expired(&config.block_timers, now) || timer_queue_expired(&config.lease_timers, now)) {
+        block_check_timeouts(&config);
       }
+
+      if (config.claim_refresh_next <= now) {
+        block_update_claims(&config);
+      }
+    }
+
+    // Replies of this iteration are sent in one batch per socket.
+    netsock_tx_flush(config.sockets[SKT_SERVER]);
+
+    if (config.disable_dhcp == 0) {
+      netsock_tx_flush(config.sockets[SKT_DHCP]);
     }
   } while (daemon_running);
 
@@ -569,12 +728,16 @@ int main(int argc, char** argv) {
   // --------------------------------------------------------------------------
   // TODO free dhcp_leases
   free(events);
-  free(buffer);
+  free(rx_ring);
 
+  // Our blocks are kept in the checkpoint, before they are freed.
+  checkpoint_close(&config);
   ddhcp_block_free(&config);
 
   free_option_store(&config.options);
+  dhcp_options_template_free(&config);
   dhcp_packet_list_free(&config.dhcp_packet_cache);
+  dhcp_packet_list_free(&config.dhcp_discover_queue);
 
   // TODO Handle shutdown of sockets
   //close(config.mcast_socket);
@@ -130,6 +130,19 @@ ATTR_NONNULL_ALL void netsocket_unix_socket_close(ddhcp_config* config) {
   remove(config->control_path);
 }
 
+ATTR_NONNULL_ALL static uint32_t netsock_interface_mtu(int sock, char* interface) {
+  struct ifreq ifr = { 0 };
+
+  strncpy(ifr.ifr_name, interface, IFNAMSIZ - 1);
+
+  if (ioctl(sock, SIOCGIFMTU, &ifr) < 0) {
+    WARNING("netsock_interface_mtu(...): unable to get mtu of %s\n", interface);
+    return 0;
+  }
+
+  return (uint32_t) ifr.ifr_mtu;
+}
+
 ATTR_NONNULL_ALL int netsock_open_socket_v6(ddhcp_epoll_data* data, struct in6_addr* addr, uint16_t port) {
   
   struct sockaddr_in6 sin6 = { 0 };
@@ -157,6 +170,7 @@ ATTR_NONNULL_ALL int netsock_open_socket_v6(ddhcp_epoll_data* data, struct in6_a
 
   data->fd = sock;
   data->interface_id = sin6.sin6_scope_id;
+  data->mtu = netsock_interface_mtu(sock, data->interface_name);
 
   return 1;
 error:
@@ -247,6 +261,13 @@ ATTR_NONNULL_ALL int netsock_multicast_init(epoll_data_t data,ddhcp_config* conf
     close(ptr->fd);
     return -1;
   }
+
+  // Block messages are sent right away, a single slot suffices.
+  if (packet_tx_init(ptr, 1) < 0) {
+    FATAL("netsock_init(...): Unable to allocate multicast transmit buffer\n");
+    close(ptr->fd);
+    return -1;
+  }
   UNUSED(config);
   return 0;
 }
@@ -257,6 +278,12 @@ ATTR_NONNULL_ALL int netsock_server_init(epoll_data_t data,ddhcp_config* config)
     FATAL("netsock_init(...): Unable to open server socket\n");
     return -1;
   }
+
+  if (packet_tx_init(ptr, NETSOCK_BATCH_SIZE) < 0) {
+    FATAL("netsock_init(...): Unable to allocate server transmit queue\n");
+    close(ptr->fd);
+    return -1;
+  }
   UNUSED(config);
   return 0;
 }
@@ -267,7 +294,12 @@ ATTR_NONNULL_ALL int netsock_dhcp_init(epoll_data_t data,ddhcp_config* config) {
     FATAL("netsock_init(...): Unable to open dhcp socket\n");
     return -1;
   }
-  UNUSED(config);
+
+  if (netsock_tx_init(ptr, NETSOCK_BUFFER_SIZE, NETSOCK_BATCH_SIZE) < 0) {
+    FATAL("netsock_init(...): Unable to allocate dhcp transmit queue\n");
+    close(ptr->fd);
+    return -1;
+  }
   return 0;
 }
 
@@ -280,3 +312,129 @@ ATTR_NONNULL_ALL int netsock_control_init(epoll_data_t data,ddhcp_config* config
   UNUSED(config);
   return 0;
 }
+
+netsock_rx_ring* netsock_rx_ring_new(void) {
+  netsock_rx_ring* ring = (netsock_rx_ring*) calloc(1, sizeof(netsock_rx_ring));
+
+  if (!ring) {
+    return NULL;
+  }
+
+  for (int i = 0; i < NETSOCK_BATCH_SIZE; i++) {
+    ring->iov[i].iov_base = ring->buffer[i];
+    ring->iov[i].iov_len = NETSOCK_BUFFER_SIZE;
+    ring->msgs[i].msg_hdr.msg_iov = &ring->iov[i];
+    ring->msgs[i].msg_hdr.msg_iovlen = 1;
+    ring->msgs[i].msg_hdr.msg_name = &ring->sender[i];
+  }
+
+  return ring;
+}
+
+ATTR_NONNULL_ALL int netsock_recv_batch(int fd, netsock_rx_ring* ring) {
+  for (int i = 0; i < NETSOCK_BATCH_SIZE; i++) {
+    ring->msgs[i].msg_hdr.msg_namelen = sizeof(struct sockaddr_in6);
+  }
+
+  int n = recvmmsg(fd, ring->msgs, NETSOCK_BATCH_SIZE, MSG_DONTWAIT, NULL);
+
+  if (n < 0) {
+    if (errno != EAGAIN && errno != EINTR) {
+      ERROR("netsock_recv_batch(...): Failed (%i): %s\n", errno, strerror(errno));
+    }
+
+    return 0;
+  }
+
+  // A truncated datagram can not be parsed, it is dropped as empty.
+  for (int i = 0; i < n; i++) {
+    if (ring->msgs[i].msg_hdr.msg_flags & MSG_TRUNC) {
+      WARNING("netsock_recv_batch(...): Dropping datagram larger than %i bytes\n", NETSOCK_BUFFER_SIZE);
+      ring->msgs[i].msg_len = 0;
+    }
+  }
+
+  return n;
+}
+
+ATTR_NONNULL_ALL int netsock_tx_init(ddhcp_epoll_data* data, size_t size, uint32_t slots) {
+  if (slots > NETSOCK_BATCH_SIZE) {
+    slots = NETSOCK_BATCH_SIZE;
+  }
+
+  struct netsock_tx_queue* queue = (struct netsock_tx_queue*) calloc(1, sizeof(struct netsock_tx_queue) + size * slots);
+
+  if (!queue) {
+    ERROR("netsock_tx_init(...): Failed to allocate transmit queue\n");
+    return -ENOMEM;
+  }
+
+  queue->slots = slots;
+
+  for (uint32_t i = 0; i < slots; i++) {
+    queue->iov[i].iov_base = queue->buffer + size * i;
+    queue->msgs[i].msg_hdr.msg_iov = &queue->iov[i];
+    queue->msgs[i].msg_hdr.msg_iovlen = 1;
+    queue->msgs[i].msg_hdr.msg_name = &queue->addr[i];
+  }
+
+  free(data->tx_queue);
+  data->tx_queue = queue;
+  data->tx_buffer = queue->buffer;
+  data->tx_size = size;
+  data->tx_len = 0;
+
+  return 0;
+}
+
+ATTR_NONNULL_ALL ssize_t netsock_tx_enqueue(ddhcp_epoll_data* data, struct sockaddr* addr, socklen_t addr_len) {
+  struct netsock_tx_queue* queue = data->tx_queue;
+  uint32_t slot = queue->queued;
+
+  queue->iov[slot].iov_len = data->tx_len;
+  memcpy(&queue->addr[slot], addr, addr_len);
+  queue->msgs[slot].msg_hdr.msg_namelen = addr_len;
+  queue->queued++;
+
+  ssize_t len = (ssize_t) data->tx_len;
+
+  if (queue->queued == queue->slots) {
+    netsock_tx_flush(data);
+  } else {
+    data->tx_buffer = queue->buffer + data->tx_size * queue->queued;
+    data->tx_len = 0;
+  }
+
+  return len;
+}
+
+ATTR_NONNULL_ALL void netsock_tx_flush(ddhcp_epoll_data* data) {
+  struct netsock_tx_queue* queue = data->tx_queue;
+
+  if (!queue || queue->queued == 0) {
+    return;
+  }
+
+  DEBUG("netsock_tx_flush(fd:%i): sending %u messages\n", data->fd, queue->queued);
+  uint32_t sent = 0;
+
+  while (sent < queue->queued) {
+    int n = sendmmsg(data->fd, queue->msgs + sent, queue->queued - sent, 0);
+
+    if (n < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+
+      // Drop the message which failed and continue with the next one.
+      ERROR("netsock_tx_flush(...): Failed (%i): %s\n", errno, strerror(errno));
+      n = 1;
+    }
+
+    sent += (uint32_t) n;
+  }
+
+  queue->queued = 0;
+  data->tx_buffer = queue->buffer;
+  data->tx_len = 0;
+}
@@ -1,6 +1,8 @@
 #ifndef _NETSOCK_H
 #define _NETSOCK_H
 
+#include <sys/socket.h>
+
 #include "types.h"
 #include "epoll.h"
 #include "tools.h"
@@ -8,6 +10,36 @@
 #define DDHCP_MULTICAST_PORT 1234
 #define DDHCP_UNICAST_PORT 1235
 
+// Number of messages received or sent with a single system call.
+#define NETSOCK_BATCH_SIZE 32
+// Size of a receive buffer and of a transmit slot of the dhcp socket.
+#define NETSOCK_BUFFER_SIZE 1500
+
+/**
+ * Ring of receive buffers, filled by a single recvmmsg call.
+ */
+struct netsock_rx_ring {
+  struct mmsghdr msgs[NETSOCK_BATCH_SIZE];
+  struct iovec iov[NETSOCK_BATCH_SIZE];
+  struct sockaddr_in6 sender[NETSOCK_BATCH_SIZE];
+  uint8_t buffer[NETSOCK_BATCH_SIZE][NETSOCK_BUFFER_SIZE];
+};
+typedef struct netsock_rx_ring netsock_rx_ring;
+
+/**
+ * Queue of outgoing messages of a socket. Messages are serialised in place
+ * into the free slot, the tx_buffer of the socket, and sent with a single
+ * sendmmsg call by netsock_tx_flush.
+ */
+struct netsock_tx_queue {
+  uint32_t slots;
+  uint32_t queued;
+  struct mmsghdr msgs[NETSOCK_BATCH_SIZE];
+  struct iovec iov[NETSOCK_BATCH_SIZE];
+  struct sockaddr_storage addr[NETSOCK_BATCH_SIZE];
+  uint8_t buffer[];
+};
+
 const struct in6_addr in6addr_localmast;
 
 // ddhcpd_socket_init_t implementations
@@ -16,4 +48,33 @@ ATTR_NONNULL_ALL int netsock_server_init(epoll_data_t data,ddhcp_config* config)
 ATTR_NONNULL_ALL int netsock_dhcp_init(epoll_data_t data,ddhcp_config* config);
 ATTR_NONNULL_ALL int netsock_control_init(epoll_data_t data,ddhcp_config* config);
 
+/**
+ * Allocate a receive ring, returns NULL on failure.
+ */
+netsock_rx_ring* netsock_rx_ring_new(void);
+
+/**
+ * Receive up to NETSOCK_BATCH_SIZE messages into the ring.
+ * Returns the number of messages received, fewer than NETSOCK_BATCH_SIZE
+ * if the socket has been drained.
+ */
+ATTR_NONNULL_ALL int netsock_recv_batch(int fd, netsock_rx_ring* ring);
+
+/**
+ * Allocate the transmit queue of a socket with the given number of slots
+ * of size bytes each, at most NETSOCK_BATCH_SIZE. Returns 0 on success.
+ */
+ATTR_NONNULL_ALL int netsock_tx_init(ddhcp_epoll_data* data, size_t size, uint32_t slots);
+
+/**
+ * Queue the message in the tx_buffer of the socket for the given address.
+ * A full queue is flushed. Returns the length of the queued message.
+ */
+ATTR_NONNULL_ALL ssize_t netsock_tx_enqueue(ddhcp_epoll_data* data, struct sockaddr* addr, socklen_t addr_len);
+
+/**
+ * Send all queued messages of a socket.
+ */
+ATTR_NONNULL_ALL void netsock_tx_flush(ddhcp_epoll_data* data);
+
 #endif
@@ -34,6 +34,18 @@ ssize_t _packet_size(uint8_t command, ssize_t payload_count) {
     len = 16 + payload_count * 4;
     break;
 
+  case DDHCP_MSG_UPDATECLAIM_RANGE:
+    len = 16 + payload_count * 8;
+    break;
+
+  case DDHCP_MSG_STATEREQUEST:
+    len = 16 + 8;
+    break;
+
+  case DDHCP_MSG_STATE:
+    len = 16 + 8 + payload_count * 30;
+    break;
+
   case DDHCP_MSG_LEASEACK:
   case DDHCP_MSG_LEASENAK:
   case DDHCP_MSG_RENEWLEASE:
@@ -54,26 +66,35 @@ ssize_t _packet_size(uint8_t command, ssize_t payload_count) {
   return len;
 }
 
-ATTR_NONNULL_ALL struct ddhcp_mcast_packet* new_ddhcp_packet(uint8_t command, ddhcp_config* config) {
-  struct ddhcp_mcast_packet* packet = (struct ddhcp_mcast_packet*) calloc(sizeof(struct ddhcp_mcast_packet), 1);
+// Largest message for an MTU, the receive buffer of our peers is a limit
+// as well, larger datagrams would be truncated there.
+ATTR_NONNULL_ALL static size_t _packet_max_size(size_t mtu) {
+  size_t size = mtu - 40 - 8;
 
-  if (!packet) {
-    return NULL;
-  }
+  return size < NETSOCK_BUFFER_SIZE ? size : NETSOCK_BUFFER_SIZE;
+}
 
-  memcpy(&packet->node_id, config->node_id, 8);
-  memcpy(&packet->prefix, &config->prefix, sizeof(struct in_addr));
+ATTR_NONNULL_ALL uint8_t packet_max_payload(uint8_t command, ddhcp_epoll_data* data) {
+  // Without a known MTU fall back to the minimal MTU of IPv6.
+  size_t mtu = data->mtu > 0 ? data->mtu : 1280;
+  ssize_t header = _packet_size(command, 0);
+  ssize_t entry = _packet_size(command, 1) - header;
+  ssize_t max = ((ssize_t) _packet_max_size(mtu) - header) / entry;
 
-  packet->prefix_len = config->prefix_len;
-  packet->blocksize = config->block_size;
-  packet->command = command;
-  packet->sender = NULL;
+  if (max > UINT8_MAX) {
+    return UINT8_MAX;
+  }
 
-  return packet;
+  return (uint8_t)(max > 0 ? max : 1);
 }
 
 ATTR_NONNULL_ALL ssize_t ntoh_mcast_packet(uint8_t* buffer, ssize_t len, struct ddhcp_mcast_packet* packet) {
 
+  if (len < 16) {
+    WARNING("ntoh_mcast_packet(...): Packet too short for a header: Got %li\n", len);
+    return 1;
+  }
+
   // Header
   copy_buf_to_var_inc(buffer, ddhcp_node_id, packet->node_id);
 
@@ -97,6 +118,7 @@ ATTR_NONNULL_ALL ssize_t ntoh_mcast_packet(uint8_t* buffer, ssize_t len, struct
     return 1;
   }
 
+#if LOG_LEVEL_LIMIT >= LOG_DEBUG
   char str[INET_ADDRSTRLEN];
   inet_ntop(AF_INET, &(packet->prefix), str, INET_ADDRSTRLEN);
   DEBUG("NODE: %lu PREFIX: %s/%i BLOCKSIZE: %i COMMAND: %i ALLOCATIONS: %i\n",
@@ -107,56 +129,30 @@ ATTR_NONNULL_ALL ssize_t ntoh_mcast_packet(uint8_t* buffer, ssize_t len, struct
         packet->command,
         packet->count
        );
+#endif
 
   // Payload
-  uint8_t  tmp8;
-  uint16_t tmp16;
   uint32_t tmp32;
-  struct ddhcp_payload* payload;
+  uint16_t tmp16;
 
   switch (packet->command) {
-  // UpdateClaim
+  // UpdateClaim, InquireBlock and UpdateClaim for ranges of blocks
   case DDHCP_MSG_UPDATECLAIM:
-    packet->payload = (struct ddhcp_payload*) calloc(sizeof(struct ddhcp_payload), packet->count);
-    payload = packet->payload;
-
-    if (payload == NULL) {
-      WARNING("ntoh_mcast_packet(...): Failed to allocate packet payload\n");
-      return -ENOMEM;
-    }
-
-    for (int i = 0; i < packet->count; i++) {
-      copy_buf_to_var_inc(buffer, uint32_t, tmp32);
-      payload->block_index = ntohl(tmp32);
-
-      copy_buf_to_var_inc(buffer, uint16_t, tmp16);
-      payload->timeout = ntohs(tmp16);
-
-      copy_buf_to_var_inc(buffer, uint8_t, tmp8);
-      payload->reserved = tmp8;
-
-      payload++;
-    }
-
-    break;
-
-  // InquireBlock
   case DDHCP_MSG_INQUIRE:
-    packet->payload = (struct ddhcp_payload*) calloc(sizeof(struct ddhcp_payload), packet->count);
-    payload = packet->payload;
-
-    if (payload == NULL) {
-      WARNING("ntoh_mcast_packet(...): Failed to allocate packet payload\n");
-      return -ENOMEM;
-    }
-
-    for (int i = 0; i < packet->count; i++) {
-      copy_buf_to_var_inc(buffer, uint32_t, tmp32);
-      payload->block_index = ntohl(tmp32);
-
-      payload++;
-    }
+  case DDHCP_MSG_UPDATECLAIM_RANGE:
+    packet->payload = buffer;
+    break;
 
+  // State request and the answering state messages
+  case DDHCP_MSG_STATEREQUEST:
+  case DDHCP_MSG_STATE:
+    copy_buf_to_var_inc(buffer, uint32_t, tmp32);
+    packet->state.nonce = ntohl(tmp32);
+    copy_buf_to_var_inc(buffer, uint16_t, tmp16);
+    packet->state.seq = ntohs(tmp16);
+    copy_buf_to_var_inc(buffer, uint16_t, tmp16);
+    packet->state.total = ntohs(tmp16);
+    packet->payload = buffer;
     break;
 
   // ReNEWLease
@@ -164,20 +160,13 @@ ATTR_NONNULL_ALL ssize_t ntoh_mcast_packet(uint8_t* buffer, ssize_t len, struct
   case DDHCP_MSG_LEASEACK:
   case DDHCP_MSG_LEASENAK:
   case DDHCP_MSG_RELEASE:
-    packet->renew_payload = (struct ddhcp_renew_payload*) calloc(sizeof(struct ddhcp_renew_payload), 1);
-
-    if (packet->renew_payload == NULL) {
-      WARNING("ntoh_mcast_packet(...): Failed to allocate packet payload\n");
-      return -ENOMEM;
-    }
-
     copy_buf_to_var_inc(buffer, uint32_t, tmp32);
-    packet->renew_payload->address = ntohl(tmp32);
+    packet->renew_payload.address = ntohl(tmp32);
     copy_buf_to_var_inc(buffer, uint32_t, tmp32);
-    packet->renew_payload->xid = ntohl(tmp32);
+    packet->renew_payload.xid = ntohl(tmp32);
     copy_buf_to_var_inc(buffer, uint32_t, tmp32);
-    packet->renew_payload->lease_seconds = ntohl(tmp32);
-    memcpy(&packet->renew_payload->chaddr, buffer, 16);
+    packet->renew_payload.lease_seconds = ntohl(tmp32);
+    memcpy(&packet->renew_payload.chaddr, buffer, 16);
     break;
 
   default:
@@ -188,94 +177,219 @@ ATTR_NONNULL_ALL ssize_t ntoh_mcast_packet(uint8_t* buffer, ssize_t len, struct
   return 0;
 }
 
-ATTR_NONNULL_ALL int hton_packet(struct ddhcp_mcast_packet* packet, char* buffer) {
+ATTR_NONNULL_ALL void packet_payload_iter_init(struct ddhcp_mcast_packet* packet, ddhcp_payload_iter* iter) {
+  iter->next = packet->payload;
+  iter->command = packet->command;
+  iter->remaining = packet->count;
+}
 
-  // Header
-  copy_var_to_buf_inc(buffer, ddhcp_node_id, packet->node_id);
+ATTR_NONNULL_ALL int packet_payload_next(ddhcp_payload_iter* iter, struct ddhcp_payload* entry) {
+  if (iter->remaining == 0) {
+    return 0;
+  }
 
-  // The Python implementation prefixes with a node number?
-  // prefix address
-  copy_var_to_buf_inc(buffer, struct in_addr, packet->prefix);
+  uint8_t  tmp8;
+  uint16_t tmp16;
+  uint32_t tmp32;
 
-  // prefix length
-  copy_var_to_buf_inc(buffer, uint8_t, packet->prefix_len);
-  // size of a block
-  copy_var_to_buf_inc(buffer, uint8_t, packet->blocksize);
-  // the command
-  copy_var_to_buf_inc(buffer, uint8_t, packet->command);
-  // count of payload entries
-  copy_var_to_buf_inc(buffer, uint8_t, packet->count);
+  copy_buf_to_var_inc(iter->next, uint32_t, tmp32);
+  entry->block_index = ntohl(tmp32);
+  entry->timeout = 0;
+  entry->reserved = 0;
+  entry->length = 1;
+
+  switch (iter->command) {
+  case DDHCP_MSG_UPDATECLAIM:
+    copy_buf_to_var_inc(iter->next, uint16_t, tmp16);
+    entry->timeout = ntohs(tmp16);
+
+    copy_buf_to_var_inc(iter->next, uint8_t, tmp8);
+    entry->reserved = tmp8;
+    break;
+
+  case DDHCP_MSG_UPDATECLAIM_RANGE:
+    copy_buf_to_var_inc(iter->next, uint16_t, tmp16);
+    entry->length = ntohs(tmp16);
+
+    copy_buf_to_var_inc(iter->next, uint16_t, tmp16);
+    entry->timeout = ntohs(tmp16);
+    break;
+
+  default:
+    break;
+  }
+
+  iter->remaining--;
+  return 1;
+}
+
+ATTR_NONNULL_ALL int packet_state_next(ddhcp_payload_iter* iter, struct ddhcp_state_entry* entry) {
+  if (iter->remaining == 0) {
+    return 0;
+  }
 
-  uint8_t tmp8;
   uint16_t tmp16;
   uint32_t tmp32;
-  struct ddhcp_payload* payload;
 
-  switch (packet->command) {
-  case DDHCP_MSG_UPDATECLAIM:
-    payload = packet->payload;
+  copy_buf_to_var_inc(iter->next, uint32_t, tmp32);
+  entry->block_index = ntohl(tmp32);
+  copy_buf_to_var_inc(iter->next, uint16_t, tmp16);
+  entry->timeout = ntohs(tmp16);
+  copy_buf_to_var_inc(iter->next, ddhcp_node_id, entry->node_id);
+  copy_buf_to_var_inc(iter->next, struct in6_addr, entry->address);
 
-    for (unsigned int index = 0; index < packet->count; index++) {
-      tmp32 = htonl(payload->block_index);
-      copy_var_to_buf_inc(buffer, uint32_t, tmp32);
+  iter->remaining--;
+  return 1;
+}
 
-      tmp16 = htons(payload->timeout);
-      copy_var_to_buf_inc(buffer, uint16_t, tmp16);
+// Offset of the payload in the wire format.
+#define PACKET_TX_PAYLOAD 16
 
-      tmp8 = (uint8_t)payload->reserved;
-      copy_var_to_buf_inc(buffer, uint8_t, tmp8);
+ATTR_NONNULL_ALL int packet_tx_init(ddhcp_epoll_data* data, uint32_t slots) {
+  // Messages never exceed the MTU, but at least the minimal MTU of IPv6,
+  // nor the receive buffer.
+  size_t mtu = data->mtu > 1280 ? data->mtu : 1280;
 
-      payload++;
-    }
+  return netsock_tx_init(data, _packet_max_size(mtu), slots);
+}
 
-    break;
+ATTR_NONNULL_ALL void packet_tx_begin(ddhcp_epoll_data* data, uint8_t command, ddhcp_config* config) {
+  uint8_t* buffer = data->tx_buffer;
 
-  case DDHCP_MSG_INQUIRE:
-    payload = packet->payload;
+  // Header
+  memcpy(buffer, config->node_id, sizeof(ddhcp_node_id));
+  memcpy(buffer + 8, &config->prefix, sizeof(struct in_addr));
+  buffer[12] = config->prefix_len;
+  buffer[13] = config->block_size;
+  buffer[14] = command;
+  buffer[15] = 0;
+
+  data->tx_len = PACKET_TX_PAYLOAD;
+}
 
-    for (unsigned int index = 0; index < packet->count; index++) {
-      tmp32 = htonl(payload->block_index);
-      copy_var_to_buf_inc(buffer, uint32_t, tmp32);
+ATTR_NONNULL_ALL void packet_tx_add_claim(ddhcp_epoll_data* data, uint32_t block_index, uint16_t timeout) {
+  uint8_t* buffer = data->tx_buffer + data->tx_len;
+  uint32_t tmp32 = htonl(block_index);
+  uint16_t tmp16 = htons(timeout);
+  uint8_t tmp8 = 0;
 
-      payload++;
-    }
+  copy_var_to_buf_inc(buffer, uint32_t, tmp32);
+  copy_var_to_buf_inc(buffer, uint16_t, tmp16);
+  copy_var_to_buf_inc(buffer, uint8_t, tmp8);
 
-    break;
+  data->tx_len += 7;
+  packet_tx_count(data)++;
+}
 
-  case DDHCP_MSG_LEASEACK:
-  case DDHCP_MSG_LEASENAK:
-  case DDHCP_MSG_RELEASE:
-  case DDHCP_MSG_RENEWLEASE:
-    tmp32 = htonl(packet->renew_payload->address);
-    copy_var_to_buf_inc(buffer, uint32_t, tmp32);
-    tmp32 = htonl(packet->renew_payload->xid);
-    copy_var_to_buf_inc(buffer, uint32_t, tmp32);
-    tmp32 = htonl(packet->renew_payload->lease_seconds);
-    copy_var_to_buf_inc(buffer, uint32_t, tmp32);
-    memcpy(buffer, &packet->renew_payload->chaddr, 16);
-    break;
+ATTR_NONNULL_ALL void packet_tx_add_range(ddhcp_epoll_data* data, uint32_t block_index, uint16_t timeout) {
+  uint8_t* buffer = data->tx_buffer + data->tx_len;
+  uint32_t tmp32 = htonl(block_index);
+  uint16_t tmp16 = htons(1);
 
-  default:
-    DEBUG("hton_packet(...): Unknown packet type: %i\n", packet->command);
-    break;
+  copy_var_to_buf_inc(buffer, uint32_t, tmp32);
+  copy_var_to_buf_inc(buffer, uint16_t, tmp16);
+  tmp16 = htons(timeout);
+  copy_var_to_buf_inc(buffer, uint16_t, tmp16);
+
+  data->tx_len += 8;
+  packet_tx_count(data)++;
+}
+
+ATTR_NONNULL_ALL int packet_tx_extend_range(ddhcp_epoll_data* data, uint32_t block_index) {
+  if (packet_tx_count(data) == 0) {
+    return 1;
+  }
+
+  uint8_t* last = data->tx_buffer + data->tx_len - 8;
+  uint32_t start;
+  uint16_t length;
+
+  memcpy(&start, last, sizeof(uint32_t));
+  memcpy(&length, last + 4, sizeof(uint16_t));
+  start = ntohl(start);
+  length = ntohs(length);
+
+  if (start + length != block_index || length == UINT16_MAX) {
+    return 1;
   }
 
+  length = htons((uint16_t)(length + 1));
+  memcpy(last + 4, &length, sizeof(uint16_t));
+
   return 0;
 }
 
-ATTR_NONNULL_ALL ssize_t send_packet_mcast(struct ddhcp_mcast_packet* packet, ddhcp_epoll_data* data) {
-  size_t len = (size_t)_packet_size(packet->command, packet->count);
+ATTR_NONNULL_ALL void packet_tx_add_inquire(ddhcp_epoll_data* data, uint32_t block_index) {
+  uint32_t tmp32 = htonl(block_index);
 
-  char* buffer = (char*) calloc(1, len);
+  memcpy(data->tx_buffer + data->tx_len, &tmp32, sizeof(uint32_t));
 
-  if (buffer == NULL) {
-    return -1;
+  data->tx_len += 4;
+  packet_tx_count(data)++;
+}
+
+ATTR_NONNULL_ALL void packet_tx_add_renew(ddhcp_epoll_data* data, struct ddhcp_renew_payload* payload) {
+  uint8_t* buffer = data->tx_buffer + data->tx_len;
+  uint32_t tmp32;
+
+  tmp32 = htonl(payload->address);
+  copy_var_to_buf_inc(buffer, uint32_t, tmp32);
+  tmp32 = htonl(payload->xid);
+  copy_var_to_buf_inc(buffer, uint32_t, tmp32);
+  tmp32 = htonl(payload->lease_seconds);
+  copy_var_to_buf_inc(buffer, uint32_t, tmp32);
+  memcpy(buffer, &payload->chaddr, 16);
+
+  data->tx_len += sizeof(struct ddhcp_renew_payload);
+}
+
+ATTR_NONNULL_ALL void packet_tx_state_header(ddhcp_epoll_data* data, uint32_t nonce, uint16_t seq, uint16_t total) {
+  uint8_t* buffer = data->tx_buffer + data->tx_len;
+  uint32_t tmp32 = htonl(nonce);
+  uint16_t tmp16 = htons(seq);
+
+  copy_var_to_buf_inc(buffer, uint32_t, tmp32);
+  copy_var_to_buf_inc(buffer, uint16_t, tmp16);
+  tmp16 = htons(total);
+  copy_var_to_buf_inc(buffer, uint16_t, tmp16);
+
+  data->tx_len += 8;
+}
+
+ATTR_NONNULL_ALL void packet_tx_add_state(ddhcp_epoll_data* data, uint32_t block_index, uint16_t timeout, ddhcp_node_id node_id, struct in6_addr* address) {
+  uint8_t* buffer = data->tx_buffer + data->tx_len;
+  uint32_t tmp32 = htonl(block_index);
+  uint16_t tmp16 = htons(timeout);
+
+  copy_var_to_buf_inc(buffer, uint32_t, tmp32);
+  copy_var_to_buf_inc(buffer, uint16_t, tmp16);
+  memcpy(buffer, node_id, sizeof(ddhcp_node_id));
+  memcpy(buffer + sizeof(ddhcp_node_id), address, sizeof(struct in6_addr));
+
+  data->tx_len += 30;
+  packet_tx_count(data)++;
+}
+
+ATTR_NONNULL_ALL uint32_t packet_tx_claim(ddhcp_epoll_data* data, uint8_t index, uint16_t* length) {
+  uint8_t* entry;
+  uint32_t block_index;
+
+  *length = 1;
+
+  if (packet_tx_command(data) == DDHCP_MSG_UPDATECLAIM_RANGE) {
+    entry = data->tx_buffer + PACKET_TX_PAYLOAD + index * 8;
+    memcpy(length, entry + 4, sizeof(uint16_t));
+    *length = ntohs(*length);
+  } else {
+    entry = data->tx_buffer + PACKET_TX_PAYLOAD + index * 7;
   }
 
-  errno = 0;
+  memcpy(&block_index, entry, sizeof(uint32_t));
 
-  hton_packet(packet, buffer);
+  return ntohl(block_index);
+}
 
+ATTR_NONNULL_ALL ssize_t packet_tx_send_mcast(ddhcp_epoll_data* data) {
   struct sockaddr_in6 dest_addr = {
     .sin6_family = AF_INET6,
     .sin6_port = htons(DDHCP_MULTICAST_PORT),
@@ -284,27 +398,17 @@ ATTR_NONNULL_ALL ssize_t send_packet_mcast(struct ddhcp_mcast_packet* packet, dd
 
   memcpy(&dest_addr.sin6_addr, &in6addr_localmcast, sizeof(in6addr_localmcast));
 
-  ssize_t bytes_send = sendto(data->fd, buffer, len, 0, (struct sockaddr*) &dest_addr, sizeof(dest_addr));
-
-  free(buffer);
+  ssize_t bytes_send = sendto(data->fd, data->tx_buffer, data->tx_len, 0, (struct sockaddr*) &dest_addr, sizeof(dest_addr));
 
   if ( bytes_send < 0 ) {
-    ERROR("send_packet_mcast(...): Failed (%i): %s\n",errno,strerror(errno));
+    ERROR("packet_tx_send_mcast(...): Failed (%i): %s\n",errno,strerror(errno));
   }
 
   return bytes_send;
 }
 
-ATTR_NONNULL_ALL ssize_t send_packet_direct(struct ddhcp_mcast_packet* packet, struct in6_addr* dest, ddhcp_epoll_data* data) {
-  DEBUG("send_packet_direct(packet,dest,mcsocket:%i,scope:%u)\n", data->fd, data->interface_id);
-  size_t len = (size_t)_packet_size(packet->command, packet->count);
-
-  char* buffer = (char*) calloc(1, len);
-
-  if (buffer == NULL) {
-    ERROR("send_packet_direct(...): Failed to allocate send buffer\n");
-    return -1;
-  }
+ATTR_NONNULL_ALL ssize_t packet_tx_send_direct(ddhcp_epoll_data* data, struct in6_addr* dest) {
+  DEBUG("packet_tx_send_direct(dest,mcsocket:%i,scope:%u)\n", data->fd, data->interface_id);
 
   struct sockaddr_in6 dest_addr = {
     .sin6_family = AF_INET6,
@@ -322,15 +426,5 @@ ATTR_NONNULL_ALL ssize_t send_packet_direct(struct ddhcp_mcast_packet* packet, s
 
 #endif
 
-  hton_packet(packet, buffer);
-
-  ssize_t bytes_send = sendto(data->fd, buffer, len, 0, (struct sockaddr*) &dest_addr, sizeof(struct sockaddr_in6));
-
-  free(buffer);
-
-  if ( bytes_send < 0 ) {
-    ERROR("send_packet_direct(...): Failed (%i): %s\n",errno,strerror(errno));
-  }
-
-  return bytes_send;
+  return netsock_tx_enqueue(data, (struct sockaddr*) &dest_addr, sizeof(struct sockaddr_in6));
 }
@@ -25,12 +25,56 @@
 
 #define DDHCP_MSG_UPDATECLAIM 1
 #define DDHCP_MSG_INQUIRE 2
+#define DDHCP_MSG_UPDATECLAIM_RANGE 3
+#define DDHCP_MSG_STATEREQUEST 4
+#define DDHCP_MSG_STATE 5
 #define DDHCP_MSG_RENEWLEASE 16
 #define DDHCP_MSG_LEASEACK 17
 #define DDHCP_MSG_LEASENAK 18
 #define DDHCP_MSG_RELEASE 19
 
 
+struct ddhcp_payload {
+  uint32_t block_index;
+  uint16_t timeout;
+  uint16_t reserved;
+  // Number of consecutive blocks starting at block_index, for range claims.
+  uint16_t length;
+};
+typedef struct ddhcp_payload ddhcp_payload;
+
+struct ddhcp_renew_payload {
+  uint8_t chaddr[16];
+  uint32_t address;
+  uint32_t xid;
+  uint32_t lease_seconds;
+};
+typedef struct ddhcp_renew_payload ddhcp_renew_payload;
+
+/**
+ * A state request asks for the block table of a node, which answers with
+ * state messages. The answer is split into total messages numbered by seq,
+ * all of them carry the nonce of the request.
+ */
+struct ddhcp_state_header {
+  uint32_t nonce;
+  uint16_t seq;
+  uint16_t total;
+};
+typedef struct ddhcp_state_header ddhcp_state_header;
+
+/**
+ * Block of a state message with its owner. The address is unspecified
+ * for the blocks of the answering node itself.
+ */
+struct ddhcp_state_entry {
+  uint32_t block_index;
+  uint16_t timeout;
+  ddhcp_node_id node_id;
+  struct in6_addr address;
+};
+typedef struct ddhcp_state_entry ddhcp_state_entry;
+
 struct ddhcp_mcast_packet {
   ddhcp_node_id node_id;
   struct in_addr prefix;
@@ -42,31 +86,111 @@ struct ddhcp_mcast_packet {
   struct sockaddr_in6* sender;
 
   union {
-    struct ddhcp_payload* payload;
-    struct ddhcp_renew_payload* renew_payload;
+    struct {
+      // Payload entries in wire format, pointing into the receive buffer.
+      uint8_t* payload;
+      // Header of state messages, preceding their payload entries.
+      struct ddhcp_state_header state;
+    };
+    struct ddhcp_renew_payload renew_payload;
   };
 };
 typedef struct ddhcp_mcast_packet ddhcp_mcast_packet;
 
-struct ddhcp_payload {
-  uint32_t block_index;
-  uint16_t timeout;
-  uint16_t reserved;
-};
-typedef struct ddhcp_payload ddhcp_payload;
-
-struct ddhcp_renew_payload {
-  uint8_t chaddr[16];
-  uint32_t address;
-  uint32_t xid;
-  uint32_t lease_seconds;
+/**
+ * Iterator over the payload entries of a received claim or inquire message.
+ */
+struct ddhcp_payload_iter {
+  uint8_t* next;
+  uint8_t command;
+  uint8_t remaining;
 };
-typedef struct ddhcp_renew_payload ddhcp_renew_payload;
+typedef struct ddhcp_payload_iter ddhcp_payload_iter;
 
-ATTR_NONNULL_ALL struct ddhcp_mcast_packet* new_ddhcp_packet(uint8_t command, ddhcp_config* config);
+/**
+ * Decode the header of a message and validate its length. The payload of
+ * claim and inquire messages is not copied, it is read with an iterator
+ * straight from the buffer, which must outlive the packet.
+ * Returns 0 on success.
+ */
 ATTR_NONNULL_ALL ssize_t ntoh_mcast_packet(uint8_t* buffer, ssize_t len, struct ddhcp_mcast_packet* packet);
 
-ATTR_NONNULL_ALL ssize_t send_packet_mcast(struct ddhcp_mcast_packet* packet, ddhcp_epoll_data* data);
-ATTR_NONNULL_ALL ssize_t send_packet_direct(struct ddhcp_mcast_packet* packet, struct in6_addr* dest, ddhcp_epoll_data* data);
+/**
+ * Start iterating over the payload entries of a packet.
+ */
+ATTR_NONNULL_ALL void packet_payload_iter_init(struct ddhcp_mcast_packet* packet, ddhcp_payload_iter* iter);
+
+/**
+ * Decode the next payload entry into entry.
+ * Returns 1 on success and 0 if all entries have been read.
+ */
+ATTR_NONNULL_ALL int packet_payload_next(ddhcp_payload_iter* iter, struct ddhcp_payload* entry);
+
+/**
+ * Decode the next entry of a state message into entry.
+ * Returns 1 on success and 0 if all entries have been read.
+ */
+ATTR_NONNULL_ALL int packet_state_next(ddhcp_payload_iter* iter, struct ddhcp_state_entry* entry);
+
+/**
+ * Maximal number of payload entries of a packet with the given command,
+ * which fits into a single datagram on the interface of the socket.
+ */
+ATTR_NONNULL_ALL uint8_t packet_max_payload(uint8_t command, ddhcp_epoll_data* data);
+
+/**
+ * Messages are serialised in place into the transmit buffer of a socket.
+ * packet_tx_begin writes the header, the packet_tx_add_* functions append
+ * payload entries and packet_tx_send_* transmit the message. The caller
+ * must not append more entries than packet_max_payload allows.
+ */
+
+/**
+ * Allocate the transmit queue of a socket with the given number of slots,
+ * sized by the MTU of its interface. Returns 0 on success.
+ */
+ATTR_NONNULL_ALL int packet_tx_init(ddhcp_epoll_data* data, uint32_t slots);
+
+/**
+ * Start a new message with the given command in the transmit buffer.
+ */
+ATTR_NONNULL_ALL void packet_tx_begin(ddhcp_epoll_data* data, uint8_t command, ddhcp_config* config);
+
+/**
+ * Command and number of payload entries of the message in the transmit buffer.
+ */
+#define packet_tx_command(data) ((data)->tx_buffer[14])
+#define packet_tx_count(data) ((data)->tx_buffer[15])
+
+ATTR_NONNULL_ALL void packet_tx_add_claim(ddhcp_epoll_data* data, uint32_t block_index, uint16_t timeout);
+ATTR_NONNULL_ALL void packet_tx_add_range(ddhcp_epoll_data* data, uint32_t block_index, uint16_t timeout);
+ATTR_NONNULL_ALL void packet_tx_add_inquire(ddhcp_epoll_data* data, uint32_t block_index);
+ATTR_NONNULL_ALL void packet_tx_add_renew(ddhcp_epoll_data* data, struct ddhcp_renew_payload* payload);
+
+/**
+ * Write the state header of a state request or state message, it has to
+ * precede the payload entries.
+ */
+ATTR_NONNULL_ALL void packet_tx_state_header(ddhcp_epoll_data* data, uint32_t nonce, uint16_t seq, uint16_t total);
+ATTR_NONNULL_ALL void packet_tx_add_state(ddhcp_epoll_data* data, uint32_t block_index, uint16_t timeout, ddhcp_node_id node_id, struct in6_addr* address);
+
+/**
+ * Extend the last range of a range claim by the given block.
+ * Returns 0 on success and 1 if the block does not follow on the last range.
+ */
+ATTR_NONNULL_ALL int packet_tx_extend_range(ddhcp_epoll_data* data, uint32_t block_index);
+
+/**
+ * Read back the first block and the number of blocks of the index-th
+ * claim in the transmit buffer.
+ */
+ATTR_NONNULL_ALL uint32_t packet_tx_claim(ddhcp_epoll_data* data, uint8_t index, uint16_t* length);
+
+/**
+ * Multicast messages are sent right away, direct messages are queued
+ * until the transmit queue of the socket is flushed.
+ */
+ATTR_NONNULL_ALL ssize_t packet_tx_send_mcast(ddhcp_epoll_data* data);
+ATTR_NONNULL_ALL ssize_t packet_tx_send_direct(ddhcp_epoll_data* data, struct in6_addr* dest);
 
 #endif
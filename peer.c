@@ -0,0 +1,219 @@
+#include "peer.h"
+
+#include <arpa/inet.h>
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "logger.h"
+
+// Initial number of peers a table can hold without reallocation.
+#define PEER_TABLE_MIN_SIZE 16
+
+static uint32_t _peer_hash(const uint8_t* node_id) {
+  uint64_t key;
+  memcpy(&key, node_id, sizeof(key));
+  // Fibonacci hashing, node ids need not be uniformly distributed.
+  return (uint32_t)((key * 0x9E3779B97F4A7C15ull) >> 32);
+}
+
+/**
+ * Slot of the hash holding the peer with the given node id, or the empty
+ * slot where it has to be inserted.
+ */
+ATTR_NONNULL_ALL static uint32_t _peer_slot(ddhcp_peer_table* table, const uint8_t* node_id) {
+  uint32_t mask = table->num_slots - 1;
+  uint32_t slot = _peer_hash(node_id) & mask;
+
+  while (table->slots[slot] != 0 && NODE_ID_CMP(table->peers[table->slots[slot] - 1]->node_id, node_id) != 0) {
+    slot = (slot + 1) & mask;
+  }
+
+  return slot;
+}
+
+/**
+ * Rebuild the hash from the peers, as entries can not be removed
+ * from the probe sequences in place.
+ */
+ATTR_NONNULL_ALL static void _peer_reindex(ddhcp_peer_table* table) {
+  memset(table->slots, 0, sizeof(uint16_t) * table->num_slots);
+
+  for (uint32_t i = 0; i < table->size; i++) {
+    if (table->peers[i]) {
+      table->slots[_peer_slot(table, table->peers[i]->node_id)] = (uint16_t)(i + 1);
+    }
+  }
+}
+
+ATTR_NONNULL_ALL static int _peer_table_grow(ddhcp_peer_table* table) {
+  uint32_t size = table->size * 2;
+
+  if (size > DDHCP_PEER_NONE) {
+    size = DDHCP_PEER_NONE;
+  }
+
+  ddhcp_peer** peers = (ddhcp_peer**) realloc(table->peers, sizeof(ddhcp_peer*) * size);
+
+  if (!peers) {
+    return -ENOMEM;
+  }
+
+  memset(peers + table->size, 0, sizeof(ddhcp_peer*) * (size - table->size));
+  table->peers = peers;
+  table->size = size;
+
+  uint32_t num_slots = table->num_slots * 2;
+  uint16_t* slots = (uint16_t*) calloc(num_slots, sizeof(uint16_t));
+
+  if (!slots) {
+    return -ENOMEM;
+  }
+
+  free(table->slots);
+  table->slots = slots;
+  table->num_slots = num_slots;
+  _peer_reindex(table);
+
+  return 0;
+}
+
+ATTR_NONNULL_ALL int peer_table_init(ddhcp_peer_table* table, ddhcp_node_id node_id) {
+  table->peers = (ddhcp_peer**) calloc(PEER_TABLE_MIN_SIZE, sizeof(ddhcp_peer*));
+  table->slots = (uint16_t*) calloc(PEER_TABLE_MIN_SIZE * 2, sizeof(uint16_t));
+  table->size = PEER_TABLE_MIN_SIZE;
+  table->num_slots = PEER_TABLE_MIN_SIZE * 2;
+  table->num_peers = 0;
+
+  if (!table->peers || !table->slots) {
+    peer_table_free(table);
+    return -ENOMEM;
+  }
+
+  if (peer_register(table, node_id, (struct in6_addr*) &in6addr_any, time(NULL)) != DDHCP_PEER_SELF) {
+    peer_table_free(table);
+    return -ENOMEM;
+  }
+
+  return 0;
+}
+
+ATTR_NONNULL_ALL void peer_table_free(ddhcp_peer_table* table) {
+  if (table->peers) {
+    for (uint32_t i = 0; i < table->size; i++) {
+      free(table->peers[i]);
+    }
+  }
+
+  free(table->peers);
+  free(table->slots);
+  table->peers = NULL;
+  table->slots = NULL;
+  table->size = 0;
+  table->num_slots = 0;
+  table->num_peers = 0;
+}
+
+ATTR_NONNULL_ALL uint16_t peer_find(ddhcp_peer_table* table, ddhcp_node_id node_id) {
+  uint16_t entry = table->slots[_peer_slot(table, node_id)];
+  return entry ? (uint16_t)(entry - 1) : DDHCP_PEER_NONE;
+}
+
+ATTR_NONNULL_ALL uint16_t peer_register(ddhcp_peer_table* table, ddhcp_node_id node_id, struct in6_addr* address, time_t now) {
+  uint32_t slot = _peer_slot(table, node_id);
+  ddhcp_peer* peer;
+
+  if (table->slots[slot] != 0) {
+    uint16_t index = (uint16_t)(table->slots[slot] - 1);
+    peer = table->peers[index];
+    memcpy(&peer->address, address, sizeof(struct in6_addr));
+    peer->last_seen = now;
+    return index;
+  }
+
+  if (table->num_peers == table->size) {
+    if (table->size == DDHCP_PEER_NONE) {
+      WARNING("peer_register(...): Peer table is full\n");
+      return DDHCP_PEER_NONE;
+    }
+
+    if (_peer_table_grow(table)) {
+      WARNING("peer_register(...): Failed to grow the peer table\n");
+      return DDHCP_PEER_NONE;
+    }
+
+    slot = _peer_slot(table, node_id);
+  }
+
+  peer = (ddhcp_peer*) calloc(1, sizeof(ddhcp_peer));
+
+  if (!peer) {
+    WARNING("peer_register(...): Failed to allocate memory for peer\n");
+    return DDHCP_PEER_NONE;
+  }
+
+  NODE_ID_CP(&peer->node_id, node_id);
+  memcpy(&peer->address, address, sizeof(struct in6_addr));
+  peer->last_seen = now;
+  peer->num_blocks = 0;
+  INIT_LIST_HEAD(&peer->blocks);
+
+  // Reuse the first index given up by a forgotten peer.
+  uint32_t index = 0;
+
+  while (table->peers[index]) {
+    index++;
+  }
+
+  table->peers[index] = peer;
+  table->slots[slot] = (uint16_t)(index + 1);
+  table->num_peers++;
+
+  DEBUG("peer_register(...): new peer 0x%02x%02x%02x%02x%02x%02x%02x%02x at index %u\n", HEX_NODE_ID(node_id), index);
+
+  return (uint16_t) index;
+}
+
+ATTR_NONNULL_ALL void peer_collect(ddhcp_peer_table* table, time_t now, time_t timeout) {
+  uint32_t removed = 0;
+
+  for (uint32_t i = DDHCP_PEER_SELF + 1; i < table->size; i++) {
+    ddhcp_peer* peer = table->peers[i];
+
+    if (!peer || peer->num_blocks > 0 || peer->last_seen + timeout >= now) {
+      continue;
+    }
+
+    DEBUG("peer_collect(...): forget peer 0x%02x%02x%02x%02x%02x%02x%02x%02x\n", HEX_NODE_ID(peer->node_id));
+    free(peer);
+    table->peers[i] = NULL;
+    table->num_peers--;
+    removed++;
+  }
+
+  if (removed > 0) {
+    _peer_reindex(table);
+  }
+}
+
+ATTR_NONNULL_ALL void peer_show(int fd, ddhcp_peer_table* table) {
+  time_t now = time(NULL);
+  char address[INET6_ADDRSTRLEN];
+
+  dprintf(fd, "index\tnode id\t\t\tblocks\tlast seen\taddress\n");
+
+  for (uint32_t i = 0; i < table->size; i++) {
+    ddhcp_peer* peer = table->peers[i];
+
+    if (!peer) {
+      continue;
+    }
+
+    inet_ntop(AF_INET6, &peer->address, address, INET6_ADDRSTRLEN);
+    dprintf(fd, "%u\t%02X%02X%02X%02X%02X%02X%02X%02X\t%u\t%li\t\t%s\n", i, HEX_NODE_ID(peer->node_id),
+            peer->num_blocks, (long int)(now - peer->last_seen), address);
+  }
+
+  dprintf(fd, "\npeers: %u\n", table->num_peers);
+}
@@ -0,0 +1,52 @@
+#ifndef _PEER_H
+#define _PEER_H
+
+#include "types.h"
+
+/**
+ * The peer table holds the nodes of the network, which have been seen
+ * claiming or inquiring blocks. Blocks refer to their owner by its index
+ * in the table, which stays the same as long as the peer is known.
+ */
+
+/**
+ * Initialise the table with ourselves as peer DDHCP_PEER_SELF.
+ * Returns 0 on success and -ENOMEM otherwise.
+ */
+ATTR_NONNULL_ALL int peer_table_init(ddhcp_peer_table* table, ddhcp_node_id node_id);
+
+/**
+ * Release the memory held by the table, all peers must not own any blocks.
+ */
+ATTR_NONNULL_ALL void peer_table_free(ddhcp_peer_table* table);
+
+/**
+ * Peer with the given index, which has to be in use.
+ */
+#define peer_get(table, index) ((table)->peers[index])
+
+/**
+ * Index of the peer with the given node id or DDHCP_PEER_NONE.
+ */
+ATTR_NONNULL_ALL uint16_t peer_find(ddhcp_peer_table* table, ddhcp_node_id node_id);
+
+/**
+ * Note that a peer has been seen at the given address, the peer is
+ * added to the table when it is not yet known.
+ * Returns the index of the peer or DDHCP_PEER_NONE if the table is full
+ * or memory allocation fails.
+ */
+ATTR_NONNULL_ALL uint16_t peer_register(ddhcp_peer_table* table, ddhcp_node_id node_id, struct in6_addr* address, time_t now);
+
+/**
+ * Forget the peers without blocks, which have not been seen since
+ * timeout seconds.
+ */
+ATTR_NONNULL_ALL void peer_collect(ddhcp_peer_table* table, time_t now, time_t timeout);
+
+/**
+ * Print the peer table to fd.
+ */
+ATTR_NONNULL_ALL void peer_show(int fd, ddhcp_peer_table* table);
+
+#endif
@@ -0,0 +1,101 @@
+#include "pool.h"
+
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "logger.h"
+
+// Minimal number of objects allocated at once.
+#define POOL_MIN_SLAB_OBJECTS 8
+
+struct pool_slab {
+  struct pool_slab* next;
+  // Keep the objects following the header suitably aligned.
+  uint64_t objects[];
+};
+
+struct pool_object {
+  struct pool_object* next;
+};
+
+ATTR_NONNULL_ALL void pool_init(ddhcp_pool* pool, size_t object_size) {
+  // Every object has to hold the free list link and keep its successor aligned.
+  if (object_size < sizeof(struct pool_object)) {
+    object_size = sizeof(struct pool_object);
+  }
+
+  pool->object_size = (object_size + sizeof(uint64_t) - 1) & ~(sizeof(uint64_t) - 1);
+  pool->free_objects = NULL;
+  pool->slabs = NULL;
+  pool->num_free = 0;
+  pool->num_objects = 0;
+}
+
+ATTR_NONNULL_ALL void pool_free(ddhcp_pool* pool) {
+  struct pool_slab* slab = (struct pool_slab*) pool->slabs;
+
+  while (slab) {
+    struct pool_slab* next = slab->next;
+    free(slab);
+    slab = next;
+  }
+
+  pool_init(pool, pool->object_size);
+}
+
+ATTR_NONNULL_ALL int pool_reserve(ddhcp_pool* pool, uint32_t count) {
+  if (pool->num_free >= count) {
+    return 0;
+  }
+
+  uint32_t num = count - pool->num_free;
+
+  if (num < POOL_MIN_SLAB_OBJECTS) {
+    num = POOL_MIN_SLAB_OBJECTS;
+  }
+
+  struct pool_slab* slab = (struct pool_slab*) malloc(sizeof(struct pool_slab) + pool->object_size * num);
+
+  if (!slab) {
+    WARNING("pool_reserve(...): Failed to allocate slab of %u objects\n", num);
+    return -ENOMEM;
+  }
+
+  DEBUG("pool_reserve(...): Allocated slab of %u objects\n", num);
+
+  slab->next = (struct pool_slab*) pool->slabs;
+  pool->slabs = slab;
+
+  uint8_t* object = (uint8_t*) slab->objects;
+
+  for (uint32_t i = 0; i < num; i++) {
+    pool_release(pool, object);
+    object += pool->object_size;
+  }
+
+  pool->num_objects += num;
+
+  return 0;
+}
+
+ATTR_NONNULL_ALL void* pool_alloc(ddhcp_pool* pool) {
+  if (!pool->free_objects && pool_reserve(pool, 1)) {
+    return NULL;
+  }
+
+  struct pool_object* object = (struct pool_object*) pool->free_objects;
+  pool->free_objects = object->next;
+  pool->num_free--;
+
+  memset(object, 0, pool->object_size);
+
+  return object;
+}
+
+ATTR_NONNULL_ALL void pool_release(ddhcp_pool* pool, void* object) {
+  struct pool_object* released = (struct pool_object*) object;
+  released->next = (struct pool_object*) pool->free_objects;
+  pool->free_objects = released;
+  pool->num_free++;
+}
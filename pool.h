@@ -0,0 +1,44 @@
+#ifndef _POOL_H
+#define _POOL_H
+
+#include "types.h"
+
+/**
+ * A pool hands out objects of a fixed size. Objects are carved from slabs
+ * allocated in bulk, released objects are kept for reuse and the memory
+ * is only given back to the system when the pool is freed.
+ */
+
+/**
+ * Initialise an empty pool for objects of the given size.
+ */
+ATTR_NONNULL_ALL void pool_init(ddhcp_pool* pool, size_t object_size);
+
+/**
+ * Release all slabs of a pool, objects still in use become invalid.
+ */
+ATTR_NONNULL_ALL void pool_free(ddhcp_pool* pool);
+
+/**
+ * Make sure at least count objects can be taken from the pool
+ * without further allocation. Returns 0 on success and -ENOMEM otherwise.
+ */
+ATTR_NONNULL_ALL int pool_reserve(ddhcp_pool* pool, uint32_t count);
+
+/**
+ * Take a zeroed object from the pool, a new slab is allocated when
+ * no reserved objects are left. Returns NULL on allocation failure.
+ */
+ATTR_NONNULL_ALL void* pool_alloc(ddhcp_pool* pool);
+
+/**
+ * Return an object to the pool.
+ */
+ATTR_NONNULL_ALL void pool_release(ddhcp_pool* pool, void* object);
+
+/**
+ * Number of objects available without further allocation.
+ */
+#define pool_num_free(pool) ((pool)->num_free)
+
+#endif
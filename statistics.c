@@ -1,4 +1,5 @@
 #include "types.h"
+#include "block.h"
 #include <stdio.h>
 
 #ifdef DDHCPD_STATISTICS
@@ -37,35 +38,13 @@ ATTR_NONNULL_ALL void statistics_show(int fd, uint8_t reset, ddhcp_config* confi
 
 
   // calculate block status
-  ddhcp_block* block = config->blocks;
-  uint32_t blocks_free = 0;
-  uint32_t blocks_tentative = 0;
-  uint32_t blocks_claimed = 0;
-
+  uint32_t blocks_free = config->num_blocks_by_state[DDHCP_FREE] + config->num_blocks_by_state[DDHCP_BLOCKED];
+  uint32_t blocks_tentative = config->num_blocks_by_state[DDHCP_CLAIMING] + config->num_blocks_by_state[DDHCP_TENTATIVE];
+  uint32_t blocks_claimed = config->num_blocks_by_state[DDHCP_CLAIMED] + config->num_blocks_by_state[DDHCP_OURS];
   for (uint32_t i = 0; i < config->number_of_blocks; i++) {
-    switch (block->state) {
-    case DDHCP_BLOCKED:
-    case DDHCP_FREE:
-      blocks_free++;
-      break;
-
-    case DDHCP_CLAIMING:
-    case DDHCP_TENTATIVE:
-      blocks_tentative++;
-      break;
-
-    case DDHCP_CLAIMED:
-    case DDHCP_OURS:
-      blocks_claimed++;
-      break;
-
-    default:
-      break;
-    }
-  
-    dprintf(fd, "block.%u.owner %lu\n",block->index,(uint64_t) *block->node_id);
-
-    block++;
+    ddhcp_block* block = block_lookup(i, config);
+    uint64_t owner = block && block->owner != DDHCP_PEER_NONE ? (uint64_t) *block_owner(block, config)->node_id : 0;
+    dprintf(fd, "block.%u.owner %lu\n", i, owner);
   }
 
   dprintf(fd, "ddhcp.blocks.free %u\n", blocks_free);
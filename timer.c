@@ -0,0 +1,95 @@
+#include "timer.h"
+
+#include <errno.h>
+#include <stdlib.h>
+
+#include "logger.h"
+
+// Initial number of timers a queue can hold without reallocation.
+#define TIMER_QUEUE_MIN_SIZE 64
+
+ATTR_NONNULL_ALL void timer_queue_init(ddhcp_timer_queue* queue) {
+  queue->timers = NULL;
+  queue->len = 0;
+  queue->size = 0;
+}
+
+ATTR_NONNULL_ALL void timer_queue_free(ddhcp_timer_queue* queue) {
+  free(queue->timers);
+  timer_queue_init(queue);
+}
+
+ATTR_NONNULL_ALL static void _timer_swap(ddhcp_timer* a, ddhcp_timer* b) {
+  ddhcp_timer tmp = *a;
+  *a = *b;
+  *b = tmp;
+}
+
+ATTR_NONNULL_ALL int timer_queue_add(ddhcp_timer_queue* queue, time_t due, uint32_t id, uint32_t arg) {
+  if (queue->len == queue->size) {
+    uint32_t size = queue->size ? queue->size * 2 : TIMER_QUEUE_MIN_SIZE;
+    ddhcp_timer* timers = (ddhcp_timer*) realloc(queue->timers, sizeof(ddhcp_timer) * size);
+
+    if (!timers) {
+      WARNING("timer_queue_add(...): Failed to grow timer queue to %u entries\n", size);
+      return -ENOMEM;
+    }
+
+    queue->timers = timers;
+    queue->size = size;
+  }
+
+  // Sift the new timer up to its place in the heap
+  uint32_t pos = queue->len++;
+  queue->timers[pos].due = due;
+  queue->timers[pos].id = id;
+  queue->timers[pos].arg = arg;
+
+  while (pos > 0) {
+    uint32_t parent = (pos - 1) / 2;
+
+    if (queue->timers[parent].due <= queue->timers[pos].due) {
+      break;
+    }
+
+    _timer_swap(queue->timers + parent, queue->timers + pos);
+    pos = parent;
+  }
+
+  return 0;
+}
+
+ATTR_NONNULL_ALL int timer_queue_pop(ddhcp_timer_queue* queue, time_t now, ddhcp_timer* timer) {
+  if (!timer_queue_expired(queue, now)) {
+    return 0;
+  }
+
+  *timer = queue->timers[0];
+  queue->timers[0] = queue->timers[--queue->len];
+
+  // Sift the former last timer down to its place in the heap
+  uint32_t pos = 0;
+
+  for (;;) {
+    uint32_t smallest = pos;
+    uint32_t left = 2 * pos + 1;
+    uint32_t right = left + 1;
+
+    if (left < queue->len && queue->timers[left].due < queue->timers[smallest].due) {
+      smallest = left;
+    }
+
+    if (right < queue->len && queue->timers[right].due < queue->timers[smallest].due) {
+      smallest = right;
+    }
+
+    if (smallest == pos) {
+      break;
+    }
+
+    _timer_swap(queue->timers + pos, queue->timers + smallest);
+    pos = smallest;
+  }
+
+  return 1;
+}
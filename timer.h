@@ -0,0 +1,50 @@
+#ifndef _TIMER_H
+#define _TIMER_H
+
+#include "types.h"
+
+/**
+ * A timer queue is a binary min-heap of timers ordered by their due time.
+ * Timers can not be cancelled, instead the owner of a timer has to check
+ * on expiry whether the timer is still valid.
+ */
+
+/**
+ * Initialise an empty timer queue.
+ */
+ATTR_NONNULL_ALL void timer_queue_init(ddhcp_timer_queue* queue);
+
+/**
+ * Release the memory held by a timer queue.
+ */
+ATTR_NONNULL_ALL void timer_queue_free(ddhcp_timer_queue* queue);
+
+/**
+ * Schedule a timer with the given due time and identifiers.
+ * Returns 0 on success and -ENOMEM otherwise.
+ */
+ATTR_NONNULL_ALL int timer_queue_add(ddhcp_timer_queue* queue, time_t due, uint32_t id, uint32_t arg);
+
+/**
+ * Remove the earliest timer from the queue and store it in timer,
+ * iff its due time lies before now. Returns 1 when a timer has been
+ * removed and 0 otherwise.
+ */
+ATTR_NONNULL_ALL int timer_queue_pop(ddhcp_timer_queue* queue, time_t now, ddhcp_timer* timer);
+
+/**
+ * Number of scheduled timers.
+ */
+#define timer_queue_len(queue) ((queue)->len)
+
+/**
+ * Due time of the earliest timer, the queue must not be empty.
+ */
+#define timer_queue_next(queue) ((queue)->timers[0].due)
+
+/**
+ * Is the earliest timer expired at time now.
+ */
+#define timer_queue_expired(queue, now) ((queue)->len > 0 && timer_queue_next(queue) < (now))
+
+#endif
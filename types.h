@@ -2,6 +2,7 @@
 #define _TYPES_H
 
 #include <arpa/inet.h>
+#include <stdint.h>
 #include <time.h>
 
 #define ATTR_NONNULL_ALL __attribute__((nonnull))
@@ -56,6 +57,49 @@ enum {
 };
 #endif
 
+// timer structures
+
+struct ddhcp_timer {
+  time_t due;
+  uint32_t id;
+  uint32_t arg;
+};
+typedef struct ddhcp_timer ddhcp_timer;
+
+struct ddhcp_timer_queue {
+  ddhcp_timer* timers;
+  uint32_t len;
+  uint32_t size;
+};
+typedef struct ddhcp_timer_queue ddhcp_timer_queue;
+
+// demand estimation
+
+#define DEMAND_HISTORY_SLOTS 24
+
+struct ddhcp_demand {
+  // Leases offered since the last sample.
+  uint32_t arrivals;
+  time_t sampled;
+  // Moving average of the offered leases per second.
+  double rate;
+  // Average rate for every hour of the day, learned over several days.
+  double history[DEMAND_HISTORY_SLOTS];
+};
+typedef struct ddhcp_demand ddhcp_demand;
+
+// Fixed size object pool, objects are carved from larger slabs.
+struct ddhcp_pool {
+  size_t object_size;
+  // Singly linked list of unused objects.
+  void* free_objects;
+  // Singly linked list of all slabs of this pool.
+  void* slabs;
+  uint32_t num_free;
+  uint32_t num_objects;
+};
+typedef struct ddhcp_pool ddhcp_pool;
+
 // block structures
 
 enum ddhcp_block_state {
@@ -67,28 +111,84 @@ enum ddhcp_block_state {
   DDHCP_BLOCKED
 };
 
+#define DDHCP_BLOCK_STATES (DDHCP_BLOCKED + 1)
+
 // List of ddhcp_block
 typedef struct list_head ddhcp_block_list;
 
 struct ddhcp_block {
   uint32_t index;
   enum ddhcp_block_state state;
-  struct in_addr subnet;
-  uint8_t  subnet_len;
+  time_t timeout;
+  // Only iff state is equal to CLAIMED lease_block is not equal to NULL.
+  struct dhcp_lease_block* addresses;
   uint8_t claiming_counts;
-  ddhcp_node_id node_id;
-  struct in6_addr owner_address;
+  // Set iff a timer for this block is scheduled in block_timers.
+  uint8_t timer_pending;
+  // Set iff the block is queued for re-announcement, see block_reannounce.
+  uint8_t reannounce;
+  // Index of the owning peer in the peer table, see block_set_owner.
+  uint16_t owner;
+  // Slot of our block in the checkpoint plus one, zero if it has none.
+  uint32_t checkpoint_slot;
   time_t first_claimed;
   time_t needless_since;
-  time_t timeout;
-  // Only iff state is equal to CLAIMED lease_block is not equal to NULL.
-  struct dhcp_lease* addresses;
 
-  ddhcp_block_list tmp_list;
+  // Membership in the per-state block set, see block_set_state.
+  ddhcp_block_list state_list;
   ddhcp_block_list claim_list;
+  // Membership in the set of our blocks with free leases.
+  ddhcp_block_list free_leases_list;
+  // Membership in the blocks of the owning peer.
+  ddhcp_block_list owner_list;
 };
 typedef struct ddhcp_block ddhcp_block;
 
+// peer structures
+
+// We are always the first peer of the table.
+#define DDHCP_PEER_SELF 0
+#define DDHCP_PEER_NONE UINT16_MAX
+
+// A node of the network, which has been seen claiming or inquiring blocks.
+struct ddhcp_peer {
+  ddhcp_node_id node_id;
+  struct in6_addr address;
+  time_t last_seen;
+  uint32_t num_blocks;
+  // Set once the peer sent a heartbeat, only those peers are checked for liveness.
+  uint8_t heartbeat;
+  // Blocks owned by this peer.
+  ddhcp_block_list blocks;
+};
+typedef struct ddhcp_peer ddhcp_peer;
+
+struct ddhcp_peer_table {
+  // Peers by index, unused indices are NULL.
+  ddhcp_peer** peers;
+  uint32_t size;
+  uint32_t num_peers;
+  // Open addressing hash from node_id to peer index + 1, the number
+  // of slots is a power of two and at least twice the number of peers.
+  uint16_t* slots;
+  uint32_t num_slots;
+};
+typedef struct ddhcp_peer_table ddhcp_peer_table;
+
+// Number of blocks in a page of the block table.
+#define DDHCP_BLOCK_PAGE_SIZE 16
+
+// The block table is allocated in pages on first use of one of their
+// blocks, all blocks of a missing page are FREE.
+struct ddhcp_block_page {
+  // Number of blocks in this page, which are not FREE.
+  uint32_t num_used;
+  // Membership in the list of pages without used blocks.
+  struct list_head idle_list;
+  ddhcp_block block[DDHCP_BLOCK_PAGE_SIZE];
+};
+typedef struct ddhcp_block_page ddhcp_block_page;
+
 // DHCP structures
 
 enum dhcp_lease_state {
@@ -97,26 +197,64 @@ enum dhcp_lease_state {
   LEASED,
 };
 
+#define DHCP_LEASE_STATES (LEASED + 1)
+
+// Hardware address length stored in a lease, longer addresses are
+// kept in the lease_hwaddrs side table of the config.
+#define DHCP_LEASE_HWADDR_LEN 6
+
+// The state of a lease is kept in the bitmaps of its dhcp_lease_block.
 struct dhcp_lease {
-  uint8_t chaddr[16];
-  enum dhcp_lease_state state;
+  // Seconds since config->lease_epoch.
+  uint32_t lease_end;
   uint32_t xid;
-  time_t lease_end;
-};
+  uint8_t chaddr[DHCP_LEASE_HWADDR_LEN];
+} __attribute__((packed));
 typedef struct dhcp_lease dhcp_lease;
 
-// List of dhcp_option
-typedef struct list_head dhcp_option_list;
+// List of dhcp_lease_hwaddr
+typedef struct list_head dhcp_lease_hwaddr_list;
+
+// Full hardware address of a lease, which does not fit into dhcp_lease.
+struct dhcp_lease_hwaddr {
+  uint32_t block_index;
+  uint32_t lease_index;
+  uint8_t chaddr[16];
+  dhcp_lease_hwaddr_list hwaddr_list;
+};
+typedef struct dhcp_lease_hwaddr dhcp_lease_hwaddr;
+
+// The block size is a power of two below 256.
+#define DHCP_LEASE_BLOCK_MAX 128
+#define DHCP_LEASE_BITMAP_WORDS (DHCP_LEASE_BLOCK_MAX / 64)
+
+struct dhcp_lease_block {
+  // Bit i of bitmap[state] is set iff lease i is in that state.
+  uint64_t bitmap[DHCP_LEASE_STATES][DHCP_LEASE_BITMAP_WORDS];
+  // Bit i is set iff the hardware address of lease i is in lease_hwaddrs.
+  uint64_t long_hwaddr[DHCP_LEASE_BITMAP_WORDS];
+  uint8_t num[DHCP_LEASE_STATES];
+  dhcp_lease lease[];
+};
+typedef struct dhcp_lease_block dhcp_lease_block;
 
 struct dhcp_option {
   uint8_t code;
   uint8_t len;
   uint8_t* payload;
-
-  dhcp_option_list option_list;
 };
 typedef struct dhcp_option dhcp_option;
 
+// Options of our replies indexed by code.
+struct dhcp_option_store {
+  dhcp_option* option[256];
+  // Increased on every change of the store.
+  uint32_t generation;
+  // Lease time option in host byte order, 0 if not set.
+  uint32_t lease_time;
+};
+typedef struct dhcp_option_store dhcp_option_store;
+
 enum dhcp_option_code {
   // RFC 2132
   DHCP_CODE_PAD = 0,
@@ -132,6 +270,38 @@ enum dhcp_option_code {
   DHCP_CODE_END = 255,
 };
 
+// Options requested by a parameter request list serialised from the reply
+// template, see dhcp_options_requested.
+#define DHCP_REPLY_CACHE_SIZE 8
+#define DHCP_REPLY_CACHE_OPTIONS_MAX 312
+
+struct dhcp_reply_cache_entry {
+  // Generation of the option store the entry was built from, 0 if unused.
+  uint32_t generation;
+  uint32_t hash;
+  uint16_t len;
+  uint8_t requested_len;
+  uint8_t requested[255];
+  uint8_t options[DHCP_REPLY_CACHE_OPTIONS_MAX];
+};
+
+// Our DHCP replies preserialised from the option store, see dhcp_options_template.
+struct dhcp_reply_template {
+  // Generation of the option store the template was built from, 0 if unbuilt.
+  uint32_t generation;
+  // BOOTP header and magic cookie, the message type, server identifier and
+  // lease time options, which head every reply, and the other options of the store.
+  uint8_t* buffer;
+  uint16_t head_len;
+  uint16_t head_lease_time_len;
+  // Offset + 1 of each option of the store in the buffer, 0 if absent.
+  uint16_t option_offset[256];
+
+  struct dhcp_reply_cache_entry cache[DHCP_REPLY_CACHE_SIZE];
+  uint8_t cache_next;
+};
+typedef struct dhcp_reply_template dhcp_reply_template;
+
 
 // network socket
 #define SKT_MCAST 0
@@ -145,6 +315,38 @@ enum dhcp_option_code {
 #define DDHCP_SKT_CONTROL(config) ((ddhcp_epoll_data*) config->sockets[SKT_CONTROL])
 
 
+// Bootstrap of the block table from another node, see ddhcp_state_request.
+struct ddhcp_state_sync {
+  uint32_t nonce;
+  // Number of requests sent and the time the next one is due.
+  uint8_t requests;
+  time_t next_request;
+  // The first node answering the current request, we only take its state.
+  ddhcp_node_id responder;
+  uint8_t has_responder;
+  // Messages of the answer received so far, as a bitmap by number.
+  uint16_t total;
+  uint16_t received;
+  uint8_t* seen;
+};
+typedef struct ddhcp_state_sync ddhcp_state_sync;
+
+// Memory mapped file holding our blocks and their leases, see checkpoint.h.
+struct ddhcp_checkpoint {
+  int fd;
+  uint8_t* map;
+  size_t size;
+  uint32_t num_slots;
+  // Stack of unused slots.
+  uint32_t* free_slots;
+  uint32_t num_free_slots;
+  // Sequence number of the last journal entry.
+  uint64_t seq;
+  // Set while the checkpoint is restored, changes are not written then.
+  uint8_t restoring;
+};
+typedef struct ddhcp_checkpoint ddhcp_checkpoint;
+
 // configuration and global state
 struct ddhcp_config {
   ddhcp_node_id node_id;
@@ -158,20 +360,79 @@ struct ddhcp_config {
   struct in_addr prefix;
   uint8_t prefix_len;
   uint8_t disable_dhcp;
+  // Announce runs of adjacent blocks as range claims.
+  uint8_t claim_ranges;
+  // Set until we know the blocks of the network, either by listening
+  // for a block timeout or from the state of another node.
+  uint8_t learning_phase;
 
   // Global Stuff
   time_t next_wakeup;
-  uint32_t loop_timeout;
   uint8_t claiming_blocks_amount;
   uint8_t needless_marks;
-  ddhcp_block* blocks;
+  // Pages of the block table, NULL until one of their blocks is used.
+  ddhcp_block_page** block_pages;
+  uint32_t number_of_block_pages;
+  // Pages whose blocks are all FREE, see block_collect_pages.
+  struct list_head idle_block_pages;
+  // Storage for the pages of the block table
+  ddhcp_pool block_page_pool;
   ddhcp_block_list claiming_blocks;
+  // Blocks grouped by their state, OURS is ordered by first_claimed.
+  // FREE blocks are not listed, they are kept in free_blocks instead.
+  ddhcp_block_list blocks_by_state[DDHCP_BLOCK_STATES];
+  uint32_t num_blocks_by_state[DDHCP_BLOCK_STATES];
+  // Bitmap of the blocks which are not FREE by index, with a fenwick tree
+  // over the population count of its words for selecting the n-th free block.
+  // Both start zeroed, so setting up the set of FREE blocks is cheap.
+  uint64_t* used_blocks;
+  uint32_t* used_blocks_tree;
+  uint32_t used_blocks_words;
+  // Our blocks with free leases, ordered by first_claimed.
+  ddhcp_block_list blocks_with_free_leases;
+  // Storage for the dhcp_lease_blocks of all blocks
+  ddhcp_pool lease_blocks;
+  // Reference point of the lease end of all leases
+  time_t lease_epoch;
+  // Hardware addresses of leases longer than DHCP_LEASE_HWADDR_LEN
+  dhcp_lease_hwaddr_list lease_hwaddrs;
+  // Number of lease blocks to allocate at startup
+  uint32_t lease_blocks_prealloc;
+  // Start of the current claim refresh period and the time the
+  // next update claim packet of that period is due.
+  time_t claim_refresh_start;
+  time_t claim_refresh_next;
+  // Scratch space for the blocks of a claim update, grown on demand.
+  ddhcp_block** claim_scratch;
+  uint32_t claim_scratch_size;
+  // Our blocks to re-announce after the current receive batch.
+  ddhcp_block** reannounce_blocks;
+  uint32_t reannounce_count;
+  uint32_t reannounce_size;
+  // Nodes of the network, blocks refer to their owner in this table.
+  ddhcp_peer_table peers;
+  // Time our next heartbeat is due.
+  time_t heartbeat_next;
+  ddhcp_state_sync state_sync;
+  // Checkpoint of our blocks, disabled without a path.
+  char* checkpoint_path;
+  ddhcp_checkpoint checkpoint;
+  // Expiry timers of block timeouts
+  ddhcp_timer_queue block_timers;
+  // Expiry timers of dhcp leases, by block index and lease index
+  ddhcp_timer_queue lease_timers;
 
   // DHCP packets for later use.
   dhcp_packet_list dhcp_packet_cache;
+  // DISCOVERs waiting for a free lease, see dhcp_hdl_parked.
+  dhcp_packet_list dhcp_discover_queue;
+  uint32_t dhcp_discover_parked;
+  // Lease demand, which blocks are claimed and kept ahead for.
+  ddhcp_demand demand;
 
   // DHCP Options
-  dhcp_option_list options;
+  dhcp_option_store options;
+  dhcp_reply_template reply_template;
 
   // Network
   int epoll_fd;
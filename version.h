@@ -0,0 +1 @@
+#define REVISION "18930bec389c52ee9975f0090b88d9324eb1da2a"